@@ -0,0 +1,137 @@
+#include "attachcache.h"
+
+#include <array>
+#include <cstdint>
+
+namespace umq {
+
+namespace {
+
+///SHA-256 (FIPS 180-4)
+class Sha256 {
+public:
+    void update(std::string_view data) {
+        _total += data.size();
+        for (char c: data) {
+            _block[_used++] = static_cast<std::uint8_t>(c);
+            if (_used == 64) {
+                transform();
+                _used = 0;
+            }
+        }
+    }
+
+    std::array<std::uint8_t, 32> finish() {
+        std::uint64_t bits = _total * 8;
+        _block[_used++] = 0x80;
+        if (_used > 56) {
+            while (_used < 64) _block[_used++] = 0;
+            transform();
+            _used = 0;
+        }
+        while (_used < 56) _block[_used++] = 0;
+        for (int i = 7; i >= 0; i--) _block[_used++] = static_cast<std::uint8_t>(bits >> (i * 8));
+        transform();
+        std::array<std::uint8_t, 32> out;
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++) out[i*4+j] = static_cast<std::uint8_t>(_h[i] >> (24 - j * 8));
+        }
+        return out;
+    }
+
+protected:
+    std::uint32_t _h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::uint8_t _block[64];
+    std::size_t _used = 0;
+    std::uint64_t _total = 0;
+
+    static std::uint32_t rotr(std::uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void transform() {
+        static constexpr std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (std::uint32_t(_block[i*4]) << 24) | (std::uint32_t(_block[i*4+1]) << 16)
+                 | (std::uint32_t(_block[i*4+2]) << 8) | std::uint32_t(_block[i*4+3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            std::uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            std::uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        std::uint32_t a = _h[0], b = _h[1], c = _h[2], d = _h[3];
+        std::uint32_t e = _h[4], f = _h[5], g = _h[6], h = _h[7];
+        for (int i = 0; i < 64; i++) {
+            std::uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            std::uint32_t ch = (e & f) ^ (~e & g);
+            std::uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            std::uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            std::uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        _h[0] += a; _h[1] += b; _h[2] += c; _h[3] += d;
+        _h[4] += e; _h[5] += f; _h[6] += g; _h[7] += h;
+    }
+};
+
+}
+
+std::string AttachmentCache::hash(std::string_view data) {
+    //the hash identifies the content on the other side, it must be collision resistant
+    Sha256 sha;
+    sha.update(data);
+    auto digest = sha.finish();
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(digest.size() * 2);
+    for (auto b: digest) {
+        out.push_back(hex[b >> 4]);
+        out.push_back(hex[b & 0xF]);
+    }
+    return out;
+}
+
+bool AttachmentCache::store(const std::string_view &hash, std::size_t size, Content content) {
+    auto iter = _index.find(hash);
+    if (iter != _index.end()) {
+        _lru.splice(_lru.begin(), _lru, iter->second);
+        return true;
+    }
+    if (size > _capacity) return false;
+    _lru.push_front(Entry{std::string(hash), size, std::move(content)});
+    _index.emplace(_lru.front().hash, _lru.begin());
+    _size += size;
+    while (_size > _capacity) {
+        const Entry &e = _lru.back();
+        _size -= e.size;
+        _index.erase(e.hash);
+        _lru.pop_back();
+    }
+    return true;
+}
+
+bool AttachmentCache::find(const std::string_view &hash, Content *content) {
+    auto iter = _index.find(hash);
+    if (iter == _index.end()) return false;
+    _lru.splice(_lru.begin(), _lru, iter->second);
+    if (content) *content = iter->second->content;
+    return true;
+}
+
+}
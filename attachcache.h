@@ -0,0 +1,91 @@
+/*
+ * attachcache.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_ATTACHCACHE_H_xkw02jd93kdo20dk3
+#define LIB_UMQ_ATTACHCACHE_H_xkw02jd93kdo20dk3
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace umq {
+
+///Content addressed LRU cache of attachments limited by total size in bytes
+/**
+ * The cache is used on both sides of the connection. The receiver holds
+ * content of the attachments, the sender holds only a mirror of the receiver's
+ * cache (hashes and sizes). Both sides perform the same operations in the same
+ * order, so they evict the same entries and the sender always knows, which
+ * attachments are held by the receiver.
+ */
+class AttachmentCache {
+public:
+
+    using Content = std::shared_ptr<const std::string>;
+
+    ///Create cache
+    /**
+     * @param capacity maximum total size of stored attachments in bytes
+     */
+    explicit AttachmentCache(std::size_t capacity):_capacity(capacity) {}
+
+    ///Calculates hash of the content
+    /**
+     * @param data content
+     * @return SHA-256 of the content as hexadecimal string (64 characters)
+     */
+    static std::string hash(std::string_view data);
+
+    ///Stores attachment in the cache
+    /**
+     * Makes the entry most recently used and evicts least recently used entries
+     * to fit into capacity.
+     *
+     * @param hash hash of the content
+     * @param size size of the content in bytes
+     * @param content content, can be nullptr on sender's side
+     * @retval true stored
+     * @retval false attachment is larger than capacity, not stored
+     */
+    bool store(const std::string_view &hash, std::size_t size, Content content);
+
+    ///Finds attachment and makes it most recently used
+    /**
+     * @param hash hash of the content
+     * @param content receives content (can be nullptr)
+     * @retval true found
+     * @retval false not found
+     */
+    bool find(const std::string_view &hash, Content *content = nullptr);
+
+    std::size_t get_capacity() const {return _capacity;}
+    std::size_t get_size() const {return _size;}
+
+protected:
+
+    struct Entry {
+        std::string hash;
+        std::size_t size;
+        Content content;
+    };
+
+    using List = std::list<Entry>;
+
+    std::size_t _capacity;
+    std::size_t _size = 0;
+    ///most recently used first
+    List _lru;
+    std::unordered_map<std::string_view, List::iterator> _index;
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_ATTACHCACHE_H_xkw02jd93kdo20dk3 */
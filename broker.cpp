@@ -0,0 +1,177 @@
+#include "broker.h"
+
+#include <userver/helpers.h>
+#include <stdexcept>
+
+namespace umq {
+
+static constexpr std::string_view level_sep = "/";
+static constexpr std::string_view wildcard_one = "+";
+static constexpr std::string_view wildcard_rest = "#";
+
+Broker::Broker(HighWaterMarkBehavior hwmb):_hwmb(hwmb) {}
+
+std::size_t Broker::subscribe(const std::string_view &pattern, TopicUpdateCallback &&cb) {
+    std::size_t id;
+    {
+        std::lock_guard _(_subs_lock);
+        id = ++_next_id;
+    }
+    TopicUpdateCallback wrap = [this, id, cb = std::move(cb)](const Payload &data) {
+        bool r;
+        try {
+            r = cb(data);
+        } catch (...) {
+            r = false;
+        }
+        if (!r) forget(id);
+        return r;
+    };
+
+    std::unique_lock _(_trie_lock);
+    Node *nd = &_root;
+    Publisher *pub = nullptr;
+    std::size_t pos = 0;
+    while (pub == nullptr) {
+        std::size_t sep = pattern.find(level_sep, pos);
+        std::string_view level = pattern.substr(pos, sep == pattern.npos?sep:sep - pos);
+        pos = sep == pattern.npos?sep:sep + level_sep.size();
+        if (level == wildcard_rest) {
+            if (pos != pattern.npos) throw std::invalid_argument("'#' must be the last level");
+            pub = &nd->rest;
+        } else {
+            if (level.find_first_of("+#") != level.npos && level != wildcard_one) {
+                throw std::invalid_argument("Wildcard must occupy whole level");
+            }
+            auto iter = nd->children.find(level);
+            if (iter == nd->children.end()) {
+                iter = nd->children.emplace(std::string(level), std::make_shared<Node>()).first;
+            }
+            nd = iter->second.get();
+            if (pos == pattern.npos) pub = &nd->exact;
+        }
+    }
+    std::size_t pub_id = pub->subscribe(std::move(wrap));
+    std::lock_guard __(_subs_lock);
+    _subs.emplace(id, SubInfo{pub, pub_id});
+    return id;
+}
+
+void Broker::forget(std::size_t id) {
+    std::lock_guard _(_subs_lock);
+    _subs.erase(id);
+}
+
+void Broker::unsubscribe(std::size_t id) {
+    SubInfo info;
+    {
+        std::lock_guard _(_subs_lock);
+        auto iter = _subs.find(id);
+        if (iter == _subs.end()) return;
+        info = iter->second;
+        _subs.erase(iter);
+    }
+    std::shared_lock _(_trie_lock);
+    info.pub->unsubscribe(info.pub_id);
+}
+
+std::size_t Broker::publish(const std::string_view &topic, const std::string_view &data) {
+    if (topic.find_first_of("+#") != topic.npos) {
+        throw std::invalid_argument("Topic can't contain wildcards");
+    }
+    //the message is formatted once for all subscribers
+    std::string msg;
+    msg.reserve(topic.size()+data.size()+1);
+    msg.append(topic).append("\n").append(data);
+
+    //collect matching publishers under the lock, the callbacks are called
+    //without the lock, so they can subscribe or unsubscribe
+    std::vector<std::shared_ptr<Publisher> > targets;
+    {
+        //root is not owned by shared pointer, it lives as long as the broker
+        std::vector<std::shared_ptr<Node> > cur = {std::shared_ptr<Node>(std::shared_ptr<Node>(), &_root)};
+        std::vector<std::shared_ptr<Node> > next;
+        std::size_t pos = 0;
+        std::shared_lock _(_trie_lock);
+        while (pos != topic.npos && !cur.empty()) {
+            std::size_t sep = topic.find(level_sep, pos);
+            std::string_view level = topic.substr(pos, sep == topic.npos?sep:sep - pos);
+            pos = sep == topic.npos?sep:sep + level_sep.size();
+            next.clear();
+            for (const auto &nd: cur) {
+                //'#' matches remaining levels
+                targets.push_back(std::shared_ptr<Publisher>(nd, &nd->rest));
+                auto iter = nd->children.find(level);
+                if (iter != nd->children.end()) next.push_back(iter->second);
+                iter = nd->children.find(wildcard_one);
+                if (iter != nd->children.end()) next.push_back(iter->second);
+            }
+            std::swap(cur, next);
+        }
+        for (const auto &nd: cur) {
+            targets.push_back(std::shared_ptr<Publisher>(nd, &nd->exact));
+            //'#' matches zero levels too
+            targets.push_back(std::shared_ptr<Publisher>(nd, &nd->rest));
+        }
+    }
+    std::size_t cnt = 0;
+    for (const auto &pub: targets) {
+        if (pub->publish(msg)) ++cnt;
+    }
+    return cnt;
+}
+
+void Broker::prune() {
+    std::unique_lock _(_trie_lock);
+    prune(_root);
+}
+
+bool Broker::prune(Node &nd) {
+    for (auto iter = nd.children.begin(); iter != nd.children.end();) {
+        if (prune(*iter->second)) iter = nd.children.erase(iter);
+        else ++iter;
+    }
+    return nd.empty();
+}
+
+void Broker::register_methods(MethodList &ml, const std::string_view &prefix) {
+    std::string name(prefix);
+    ml.method(name + "subscribe")
+        << "Subscribe topic pattern. Argument: <topic_id>\\n<pattern>. Pattern levels are "
+           "separated by '/', '+' matches one level, '#' matches rest. Updates "
+           "are sent as <topic>\\n<data>"
+        >> [this](Request &&req) {
+            std::string_view args = req.get_data();
+            std::string_view topic_id = userver::splitAt("\n", args);
+            if (topic_id.empty() || args.empty()) {
+                req.send_exception(400, "Expected <topic_id>\\n<pattern>");
+                return;
+            }
+            auto peer = req.lock_peer();
+            try {
+                std::size_t id = subscribe(args, peer->start_publish(topic_id, _hwmb));
+                peer->on_unsubscribe(topic_id, [this, id]{unsubscribe(id);});
+                req.send_result(Payload());
+            } catch (const std::invalid_argument &e) {
+                req.send_exception(400, e.what());
+            }
+    };
+    ml.method(name + "publish")
+        << "Publish update. Argument: <topic>\\n<data>. Returns count of matching subscriber groups"
+        >> [this](Request &&req) {
+            std::string_view args = req.get_data();
+            std::string_view topic = userver::splitAt("\n", args);
+            if (topic.empty()) {
+                req.send_exception(400, "Expected <topic>\\n<data>");
+                return;
+            }
+            try {
+                std::string r = std::to_string(publish(topic, args));
+                req.send_result(Payload(r));
+            } catch (const std::invalid_argument &e) {
+                req.send_exception(400, e.what());
+            }
+    };
+}
+
+}
@@ -0,0 +1,124 @@
+/*
+ * broker.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_BROKER_H_dwoi3jd093jd02jd90
+#define LIB_UMQ_BROKER_H_dwoi3jd093jd02jd90
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "publisher.h"
+
+namespace umq {
+
+///Topic broker with hierarchical wildcard subscriptions
+/**
+ * Topic names are hierarchical, levels are separated by '/'. Subscription
+ * pattern can contain wildcards
+ *
+ * - '+' matches exactly one level ("sensors/+/temp")
+ * - '#' matches any count of levels (including zero), it must be the last level ("sensors/#")
+ *
+ * Patterns are stored in a trie, every node has its Publisher. Cost of
+ * publishing is proportional to the depth of the topic (and count of wildcard
+ * branches), not to the count of subscriptions.
+ *
+ * Subscribers receive update in format "<topic>\n<data>"
+ */
+class Broker {
+public:
+
+    ///Construct the broker
+    /**
+     * @param hwmb high water mark behavior of subscribers subscribed through
+     * the broker's methods
+     */
+    explicit Broker(HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip);
+
+    Broker(const Broker &) = delete;
+    Broker &operator=(const Broker &) = delete;
+
+    ///Subscribe pattern
+    /**
+     * @param pattern topic pattern
+     * @param cb callback
+     * @return id of subscription
+     * @exception std::invalid_argument invalid pattern
+     */
+    std::size_t subscribe(const std::string_view &pattern, TopicUpdateCallback &&cb);
+
+    ///Unsubscribe
+    /**
+     * @param id id of subscription
+     */
+    void unsubscribe(std::size_t id);
+
+    ///Publish update
+    /**
+     * @param topic topic name (can't contain wildcards)
+     * @param data data
+     * @return count of matching subscriber groups (0 - nobody received the update)
+     * @exception std::invalid_argument invalid topic name
+     */
+    std::size_t publish(const std::string_view &topic, const std::string_view &data);
+
+    ///Register methods of the broker
+    /**
+     * Registers methods
+     *
+     * - \<prefix\>subscribe - argument "<topic_id>\n<pattern>" - the caller must register
+     * the topic_id before the call (Peer::subscribe)
+     * - \<prefix\>publish - argument "<topic>\n<data>"
+     *
+     * @param ml method list
+     * @param prefix prefix of methods
+     *
+     * @note the broker must not be destroyed before the method list
+     */
+    void register_methods(MethodList &ml, const std::string_view &prefix = "broker:");
+
+    ///Remove empty nodes of the trie
+    /** Nodes which are just being published are released after publishing finishes */
+    void prune();
+
+protected:
+
+    struct Node {
+        ///nodes are shared, publish() keeps them alive after the lock is released
+        std::map<std::string, std::shared_ptr<Node>, std::less<> > children;
+        ///subscribers whose pattern ends here
+        Publisher exact;
+        ///subscribers with '#' at this level
+        Publisher rest;
+        bool empty() const {return children.empty() && exact.empty() && rest.empty();}
+    };
+
+    struct SubInfo {
+        Publisher *pub;
+        std::size_t pub_id;
+    };
+
+    HighWaterMarkBehavior _hwmb;
+    std::mutex _subs_lock;
+    std::map<std::size_t, SubInfo> _subs;
+    std::size_t _next_id = 0;
+    mutable std::shared_mutex _trie_lock;
+    ///declared last - publishers notify subscribers during destruction
+    Node _root;
+
+    void forget(std::size_t id);
+    static bool prune(Node &nd);
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_BROKER_H_dwoi3jd093jd02jd90 */
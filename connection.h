@@ -9,11 +9,15 @@
 #define LIB_UMQ_CONNECTION_H_qwepo23e2k2di902d2d
 #include <optional>
 #include <cstddef>
+#include <memory>
+#include <string>
 
 #include "message.h"
+#include "fileattach.h"
 namespace umq {
 
-
+///Body of a message shared by many connections
+using SharedBody = std::shared_ptr<const std::string>;
 
 class AbstractConnectionListener {
 public:
@@ -44,6 +48,71 @@ public:
      */
     virtual bool send_message(const MsgFrame &msg) = 0;
 
+    ///send message composed from a header and a body
+    /**
+     * The body is often shared by many connections (for example topic update
+     * sent to many subscribers), so it is passed separately and the caller
+     * doesn't need to build the whole frame. The connection copies both parts
+     * before the function returns, the body is not referenced later.
+     *
+     * Default implementation concatenates both parts in a temporary buffer
+     * and calls send_message(), so the body is copied to the temporary
+     * buffer and then to the output of the connection (WSConnection).
+     * TCPConnection appends both parts directly to its output.
+     *
+     * @param type type of the frame
+     * @param header header part
+     * @param body body part
+     * @retval true message sent (doesn't mean, that has been delivered)
+     * @retval false message was not send, connection is disconnected
+     */
+    virtual bool send_message(MsgFrameType type, const std::string_view &header, const std::string_view &body) {
+        if (body.empty()) return send_message(MsgFrame{type, header});
+        static thread_local std::string buff;
+        buff.clear();
+        buff.append(header);
+        buff.append(body);
+        return send_message(MsgFrame{type, buff});
+    }
+
+    ///send message composed from a header and a shared body
+    /**
+     * Same as previous function, but the body is passed as a reference to
+     * a shared buffer (for example the value published to many subscribers).
+     * The connection can hold the reference until the body is written, so it
+     * doesn't need to copy it. TCPConnection with known socket queues the
+     * reference and writes the header and the body by single writev().
+     *
+     * Default implementation passes the body as string_view, so it is copied.
+     *
+     * @param type type of the frame
+     * @param header header part
+     * @param body body part
+     * @retval true message sent (doesn't mean, that has been delivered)
+     * @retval false message was not send, connection is disconnected
+     */
+    virtual bool send_message(MsgFrameType type, const std::string_view &header, const SharedBody &body) {
+        return send_message(type, header, std::string_view(*body));
+    }
+
+    ///send binary frame, which content is a range of a file
+    /**
+     * Connection can transfer the content directly from the file without
+     * copying it to the user space (see TCPConnection).
+     *
+     * Default implementation reads the content to the memory and calls send_message().
+     * This is used by connections which need to frame the content (WebSocket)
+     *
+     * @param file file attachment. The connection can hold the reference until
+     * the content is sent
+     * @retval true message sent (doesn't mean, that has been delivered)
+     * @retval false message was not send, connection is disconnected
+     * @exception std::system_error unable to read the file (the frame is not sent)
+     */
+    virtual bool send_file(const PFileAttachment &file) {
+        return send_message(MsgFrame{MsgFrameType::binary, file->read()});
+    }
+
     ///Starts listening incomming messages
     /**
      * @param listener listening object.
@@ -0,0 +1,470 @@
+/*
+ * coro.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_CORO_H_wdo203jd023jd0wkdw
+#define LIB_UMQ_CORO_H_wdo203jd023jd0wkdw
+
+#if __cplusplus < 202002L
+#error "umq/coro.h requires C++20"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <variant>
+
+#include <userver/async_provider.h>
+#include "peer.h"
+
+namespace umq {
+
+namespace coro {
+
+///Allocator of coroutine frames
+/**
+ * Frames are recycled in per-thread free lists organized by size class. Most
+ * of coroutines in the request processing have similar size, so allocation
+ * is mostly served from the free list
+ */
+class FramePool {
+public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t classes = 16;
+    static constexpr std::size_t max_cached = 64;
+
+    static void *alloc(std::size_t sz) {
+        std::size_t cls = size_class(sz);
+        if (cls < classes) {
+            FreeList &fl = lists()[cls];
+            if (fl.head) {
+                Node *n = fl.head;
+                fl.head = n->next;
+                --fl.count;
+                return n;
+            }
+            return ::operator new((cls+1) * granularity);
+        }
+        return ::operator new(sz);
+    }
+
+    static void free(void *ptr, std::size_t sz) {
+        std::size_t cls = size_class(sz);
+        if (cls < classes) {
+            FreeList &fl = lists()[cls];
+            if (fl.count < max_cached) {
+                Node *n = static_cast<Node *>(ptr);
+                n->next = fl.head;
+                fl.head = n;
+                ++fl.count;
+                return;
+            }
+        }
+        ::operator delete(ptr);
+    }
+
+protected:
+    struct Node {Node *next;};
+    struct FreeList {
+        Node *head = nullptr;
+        std::size_t count = 0;
+        ~FreeList() {
+            while (head) {
+                Node *n = head;
+                head = n->next;
+                ::operator delete(n);
+            }
+        }
+    };
+
+    static std::size_t size_class(std::size_t sz) {
+        return (sz + granularity - 1) / granularity - 1;
+    }
+
+    static FreeList *lists() {
+        static thread_local FreeList l[classes];
+        return l;
+    }
+};
+
+///Base of promises - allocates frames from the FramePool
+struct PooledPromise {
+    static void *operator new(std::size_t sz) {
+        return FramePool::alloc(sz);
+    }
+    static void operator delete(void *ptr, std::size_t sz) {
+        FramePool::free(ptr, sz);
+    }
+};
+
+template<typename T> class Task;
+
+template<typename T>
+struct TaskPromiseBase: PooledPromise {
+    std::coroutine_handle<> _continuation;
+    std::exception_ptr _exception;
+    bool _detached = false;
+
+    std::suspend_always initial_suspend() noexcept {return {};}
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept {return false;}
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto &p = h.promise();
+            if (p._continuation) return p._continuation;
+            if (p._detached) h.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {return {};}
+    void unhandled_exception() {
+        if (_detached) std::terminate();
+        _exception = std::current_exception();
+    }
+};
+
+template<typename T>
+struct TaskPromise: TaskPromiseBase<T> {
+    std::optional<T> _value;
+    Task<T> get_return_object();
+    template<typename X>
+    void return_value(X &&v) {_value.emplace(std::forward<X>(v));}
+    T get() {
+        if (this->_exception) std::rethrow_exception(this->_exception);
+        return std::move(*_value);
+    }
+};
+
+template<>
+struct TaskPromise<void>: TaskPromiseBase<void> {
+    Task<void> get_return_object();
+    void return_void() {}
+    void get() {
+        if (this->_exception) std::rethrow_exception(this->_exception);
+    }
+};
+
+///Coroutine task
+/**
+ * Task is lazy - it starts when it is awaited or detached. Awaiting coroutine
+ * is resumed directly by the task once the task finishes (symmetric transfer)
+ */
+template<typename T = void>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle h):_h(h) {}
+    Task(Task &&other):_h(std::exchange(other._h, nullptr)) {}
+    Task &operator=(Task &&other) {
+        if (this != &other) {
+            if (_h) _h.destroy();
+            _h = std::exchange(other._h, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {if (_h) _h.destroy();}
+
+    bool await_ready() const noexcept {return false;}
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+        _h.promise()._continuation = h;
+        return _h;
+    }
+    T await_resume() {return _h.promise().get();}
+
+    ///Start the task without waiting for the result
+    /** The task destroys itself once it finishes. Unhandled exception terminates the program */
+    void detach() {
+        Handle h = std::exchange(_h, nullptr);
+        h.promise()._detached = true;
+        h.resume();
+    }
+
+protected:
+    Handle _h;
+};
+
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+///Helper to resume awaiting coroutine by callback, which can be called synchronously
+/**
+ * Both await_suspend and the callback mark the flag. The one which comes second
+ * continues. If the callback is called before the coroutine is suspended, the
+ * coroutine doesn't suspend at all.
+ */
+class ResumeFlag {
+public:
+    ///Called from await_suspend after callback was registered
+    /** @retval true suspend
+     *  @retval false don't suspend, result is ready
+     */
+    bool suspend(std::coroutine_handle<> h) {
+        _h = h;
+        return !_flag.exchange(true, std::memory_order_acq_rel);
+    }
+    ///Called from the callback once result is ready
+    void ready() {
+        if (_flag.exchange(true, std::memory_order_acq_rel)) _h.resume();
+    }
+protected:
+    std::atomic<bool> _flag = false;
+    std::coroutine_handle<> _h;
+};
+
+///Awaitable RPC call
+class CallAwaiter {
+public:
+    CallAwaiter(PPeer peer, std::string_view method, const Payload &params)
+        :_peer(std::move(peer)),_method(method),_params(std::string(params), params.attachments) {}
+
+    bool await_ready() const noexcept {return false;}
+    bool await_suspend(std::coroutine_handle<> h) {
+        _peer->call(_method, _params, [this](Response &&resp) {
+            _result.emplace(std::move(resp));
+            _flag.ready();
+        });
+        return _flag.suspend(h);
+    }
+    Response await_resume() {return std::move(*_result);}
+
+protected:
+    PPeer _peer;
+    //copies, the awaiter can outlive the arguments (co_await of a stored awaiter)
+    std::string _method;
+    PayloadStr _params;
+    std::optional<Response> _result;
+    ResumeFlag _flag;
+};
+
+///Perform awaitable RPC call
+/**
+ * @code
+ * Response resp = co_await umq::coro::call(peer, "method", "args");
+ * @endcode
+ *
+ * The coroutine is resumed in the thread which processed the response. The
+ * method name and the parameters are copied to the awaiter, so temporaries
+ * can be passed even if the awaiter is stored and awaited later
+ */
+inline CallAwaiter call(PPeer peer, std::string_view method, const Payload &params) {
+    return CallAwaiter(std::move(peer), method, params);
+}
+
+///Awaitable window space (see Peer::wait_call_window)
+class CallWindowAwaiter {
+public:
+    explicit CallWindowAwaiter(PPeer peer):_peer(std::move(peer)) {}
+    bool await_ready() const noexcept {return _peer->has_call_window();}
+    bool await_suspend(std::coroutine_handle<> h) {
+        _peer->wait_call_window([this]{_flag.ready();});
+        return _flag.suspend(h);
+    }
+    void await_resume() {}
+protected:
+    PPeer _peer;
+    ResumeFlag _flag;
+};
+
+///Wait for free space in the call window
+inline CallWindowAwaiter call_window(PPeer peer) {
+    return CallWindowAwaiter(std::move(peer));
+}
+
+///Awaitable attachment
+class AttachmentAwaiter {
+public:
+    explicit AttachmentAwaiter(Attachment att):_att(std::move(att)) {}
+    bool await_ready() const noexcept {return false;}
+    bool await_suspend(std::coroutine_handle<> h) {
+        (*_att) >> [this](const AttachContent &ctx, bool) {
+            try {
+                const std::string &data = ctx;
+                _result = data;
+            } catch (...) {
+                _result = std::current_exception();
+            }
+            _flag.ready();
+        };
+        return _flag.suspend(h);
+    }
+    ///Returns content of attachment or throws exception
+    std::string await_resume() {
+        if (std::holds_alternative<std::exception_ptr>(_result)) {
+            std::rethrow_exception(std::get<std::exception_ptr>(_result));
+        }
+        return std::move(std::get<std::string>(_result));
+    }
+protected:
+    Attachment _att;
+    std::variant<std::string, std::exception_ptr> _result;
+    ResumeFlag _flag;
+};
+
+///Wait for content of the attachment
+inline AttachmentAwaiter attachment(Attachment att) {
+    return AttachmentAwaiter(std::move(att));
+}
+
+///Subscription to a topic readable by co_await
+/**
+ * @code
+ * auto sub = umq::coro::TopicStream::subscribe(peer, "topic");
+ * while (auto v = co_await sub.next()) {
+ *      process(*v);
+ * }
+ * @endcode
+ *
+ * Updates are returned as PayloadStr including attachments.
+ * Updates arriving while the consumer is busy are buffered. When the
+ * buffer is full, the oldest update is dropped. Destroying the stream
+ * unsubscribes the topic with the next update. The stream is closed when
+ * the topic is closed or the peer is disconnected.
+ *
+ * The waiting coroutine is never resumed by the thread which delivers the
+ * update (it holds the lock of the peer), it is resumed by the executor, so
+ * it can call or publish through the same peer.
+ */
+class TopicStream {
+public:
+
+    using Executor = ondra_shared::Callback<void(ondra_shared::Callback<void()> &&)>;
+
+protected:
+
+    struct State {
+        std::mutex mx;
+        std::deque<PayloadStr> queue;
+        std::size_t max_buffer = 64;
+        std::coroutine_handle<> waiting;
+        Executor executor;
+        bool closed = false;
+        bool abandoned = false;
+
+        bool push(const Payload &data) {
+            std::unique_lock lk(mx);
+            if (abandoned) return false;
+            if (queue.size() >= max_buffer) queue.pop_front();
+            queue.emplace_back(std::string(data), data.attachments);
+            resume_waiting(lk);
+            return true;
+        }
+        void close() {
+            std::unique_lock lk(mx);
+            closed = true;
+            resume_waiting(lk);
+        }
+        void resume_waiting(std::unique_lock<std::mutex> &lk) {
+            auto h = std::exchange(waiting, nullptr);
+            lk.unlock();
+            if (h) executor([h]{h.resume();});
+        }
+    };
+
+    ///Marks the stream closed when the subscription callback is destroyed
+    struct Closer {
+        std::shared_ptr<State> st;
+        explicit Closer(std::shared_ptr<State> st):st(std::move(st)) {}
+        Closer(Closer &&other):st(std::move(other.st)) {}
+        ~Closer() {if (st) st->close();}
+    };
+
+public:
+
+    ///Subscribe the topic
+    /**
+     * @param peer peer
+     * @param topic topic id
+     * @param max_buffer maximum count of buffered updates
+     * @param executor executor which resumes the waiting coroutine. If not
+     * specified, the async provider of the calling thread is used
+     * @exception std::logic_error no executor and no async provider
+     */
+    static TopicStream subscribe(const PPeer &peer, std::string_view topic, std::size_t max_buffer = 64,
+            Executor &&executor = nullptr) {
+        auto st = std::make_shared<State>();
+        st->max_buffer = max_buffer;
+        if (executor == nullptr) {
+            auto prov = userver::getCurrentAsyncProvider();
+            if (prov == nullptr) throw std::logic_error("TopicStream: no executor");
+            executor = [prov](ondra_shared::Callback<void()> &&fn) {
+                prov->runAsync(std::move(fn));
+            };
+        }
+        st->executor = std::move(executor);
+        peer->subscribe(topic, [st, closer = Closer(st)](const Payload &data) {
+            return st->push(data);
+        });
+        return TopicStream(std::move(st));
+    }
+
+    TopicStream(TopicStream &&) = default;
+    TopicStream &operator=(TopicStream &&) = default;
+    ~TopicStream() {
+        if (_st) {
+            std::lock_guard _(_st->mx);
+            _st->abandoned = true;
+        }
+    }
+
+    class NextAwaiter {
+    public:
+        explicit NextAwaiter(State &st):_st(st) {}
+        bool await_ready() {
+            std::lock_guard _(_st.mx);
+            return !_st.queue.empty() || _st.closed;
+        }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard _(_st.mx);
+            if (!_st.queue.empty() || _st.closed) return false;
+            _st.waiting = h;
+            return true;
+        }
+        std::optional<PayloadStr> await_resume() {
+            std::lock_guard _(_st.mx);
+            if (_st.queue.empty()) return {};
+            PayloadStr r = std::move(_st.queue.front());
+            _st.queue.pop_front();
+            return r;
+        }
+    protected:
+        State &_st;
+    };
+
+    ///Wait for next update
+    /** @return update or empty value when topic has been closed */
+    NextAwaiter next() {return NextAwaiter(*_st);}
+
+protected:
+
+    explicit TopicStream(std::shared_ptr<State> st):_st(std::move(st)) {}
+
+    std::shared_ptr<State> _st;
+};
+
+}
+
+}
+
+
+
+#endif /* LIB_UMQ_CORO_H_wdo203jd023jd0wkdw */
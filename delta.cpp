@@ -0,0 +1,162 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+namespace umq {
+
+static constexpr std::uint32_t hash_mult = 0x01000193;
+
+static bool is_utf8_cont(char c) {
+    return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+static std::uint32_t block_hash(const char *data, std::size_t sz) {
+    std::uint32_t h = 0;
+    for (std::size_t i = 0; i < sz; i++) h = h * hash_mult + static_cast<unsigned char>(data[i]);
+    return h;
+}
+
+static std::uint32_t block_hash_pow(std::size_t sz) {
+    std::uint32_t r = 1;
+    for (std::size_t i = 1; i < sz; i++) r *= hash_mult;
+    return r;
+}
+
+namespace {
+
+class DeltaWriter {
+public:
+    DeltaWriter(std::string &out):_out(out) {}
+    ~DeltaWriter() {flush_copy();}
+
+    void copy(std::size_t offset, std::size_t len) {
+        if (!len) return;
+        if (_copy_len && _copy_offset + _copy_len == offset) {
+            _copy_len += len;
+        } else {
+            flush_copy();
+            _copy_offset = offset;
+            _copy_len = len;
+        }
+    }
+
+    void insert(std::string_view data) {
+        if (data.empty()) return;
+        flush_copy();
+        _out.push_back('I');
+        _out.append(std::to_string(data.size()));
+        _out.push_back('\n');
+        _out.append(data);
+    }
+
+protected:
+    std::string &_out;
+    std::size_t _copy_offset = 0;
+    std::size_t _copy_len = 0;
+
+    void flush_copy() {
+        if (!_copy_len) return;
+        _out.push_back('C');
+        _out.append(std::to_string(_copy_offset));
+        _out.push_back(' ');
+        _out.append(std::to_string(_copy_len));
+        _out.push_back('\n');
+        _copy_len = 0;
+    }
+};
+
+}
+
+void TopicDelta::encode(std::string_view base, std::string_view value, std::string &out) {
+    constexpr std::size_t B = block_size;
+    const std::size_t bn = base.size();
+    const std::size_t vn = value.size();
+    const std::size_t mn = std::min(bn, vn);
+    DeltaWriter wr(out);
+
+    //common prefix and suffix are the most common case, they don't need the index
+    std::size_t p = 0;
+    while (p < mn && base[p] == value[p]) ++p;
+    while (p > 0 && p < vn && is_utf8_cont(value[p])) --p;
+    std::size_t s = 0;
+    while (s < mn - p && base[bn-s-1] == value[vn-s-1]) ++s;
+    while (s > 0 && is_utf8_cont(value[vn-s])) --s;
+    const std::size_t vend = vn - s;
+
+    wr.copy(0, p);
+    std::size_t lit = p;
+    std::size_t pos = p;
+    if (vend - pos >= B && bn >= B) {
+        static thread_local std::unordered_map<std::uint32_t, std::size_t> index;
+        index.clear();
+        for (std::size_t i = 0; i + B <= bn; i += B) {
+            index.emplace(block_hash(base.data()+i, B), i);
+        }
+        const std::uint32_t pw = block_hash_pow(B);
+        std::uint32_t h = block_hash(value.data()+pos, B);
+        while (true) {
+            bool matched = false;
+            auto iter = index.find(h);
+            if (iter != index.end() && std::memcmp(base.data()+iter->second, value.data()+pos, B) == 0) {
+                std::size_t bs = iter->second, vs = pos;
+                std::size_t be = bs + B, ve = pos + B;
+                while (vs > lit && bs > 0 && base[bs-1] == value[vs-1]) {--vs;--bs;}
+                while (ve < vend && be < bn && base[be] == value[ve]) {++ve;++be;}
+                //inserted bytes must not split a character
+                while (vs < ve && is_utf8_cont(value[vs])) {++vs;++bs;}
+                while (ve > vs && ve < vn && is_utf8_cont(value[ve])) --ve;
+                if (ve > vs) {
+                    wr.insert(value.substr(lit, vs - lit));
+                    wr.copy(bs, ve - vs);
+                    lit = pos = ve;
+                    matched = true;
+                }
+            }
+            if (matched) {
+                if (vend - pos < B) break;
+                h = block_hash(value.data()+pos, B);
+            } else {
+                if (pos + B >= vend) break;
+                h = (h - static_cast<unsigned char>(value[pos]) * pw) * hash_mult
+                        + static_cast<unsigned char>(value[pos+B]);
+                ++pos;
+            }
+        }
+    }
+    wr.insert(value.substr(lit, vend - lit));
+    wr.copy(bn - s, s);
+}
+
+static bool parse_size(std::string_view &data, char sep, std::size_t &out) {
+    auto pos = data.find(sep);
+    if (pos == data.npos) return false;
+    if (std::from_chars(data.data(), data.data()+pos, out, 10).ec != std::errc()) return false;
+    data = data.substr(pos+1);
+    return true;
+}
+
+bool TopicDelta::apply(std::string_view base, std::string_view delta, std::string &out) {
+    while (!delta.empty()) {
+        char t = delta[0];
+        delta = delta.substr(1);
+        std::size_t a = 0, b = 0;
+        if (t == 'C') {
+            if (!parse_size(delta, ' ', a) || !parse_size(delta, '\n', b)) return false;
+            if (a > base.size() || b > base.size() - a) return false;
+            out.append(base.substr(a, b));
+        } else if (t == 'I') {
+            if (!parse_size(delta, '\n', a) || a > delta.size()) return false;
+            out.append(delta.substr(0, a));
+            delta = delta.substr(a);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
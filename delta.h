@@ -0,0 +1,59 @@
+/*
+ * delta.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_DELTA_H_owid20jd02j3d9wjdwe
+#define LIB_UMQ_DELTA_H_owid20jd02j3d9wjdwe
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace umq {
+
+///Encodes and applies differences between two versions of a value
+/**
+ * The delta is a sequence of operations, which builds new value:
+ *
+ * - C<offset> <length>\n - copy bytes from the base value
+ * - I<length>\n<bytes> - insert bytes
+ *
+ * Numbers are decimal, lengths are in bytes. Inserted bytes are never split
+ * inside of a UTF-8 character, so the delta of two valid UTF-8 strings can be
+ * sent in a text frame.
+ *
+ * The encoder looks for blocks of the base value in the new value (rolling hash),
+ * so it can find changes even when parts of the value have been moved.
+ */
+class TopicDelta {
+public:
+
+    ///size of the block which is searched in the new value
+    static constexpr std::size_t block_size = 32;
+
+    ///Encode difference
+    /**
+     * @param base base value (known to the other side)
+     * @param value new value
+     * @param out the delta is appended to this string
+     */
+    static void encode(std::string_view base, std::string_view value, std::string &out);
+
+    ///Apply difference
+    /**
+     * @param base base value
+     * @param delta delta created by encode()
+     * @param out result (the new value) is appended to this string
+     * @retval true success
+     * @retval false delta is corrupted or doesn't match the base
+     */
+    static bool apply(std::string_view base, std::string_view delta, std::string &out);
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_DELTA_H_owid20jd02j3d9wjdwe */
@@ -0,0 +1,44 @@
+#include "durabletopic.h"
+
+namespace umq {
+
+DurableTopic::DurableTopic(const std::string &path, const TopicLogConfig &cfg)
+:_log(path, cfg) {}
+
+std::uint64_t DurableTopic::publish(const std::string_view &data) {
+    std::lock_guard _(_mx);
+    std::uint64_t offset = _log.append(data);
+    _pub.publish(data);
+    return offset;
+}
+
+std::size_t DurableTopic::subscribe(TopicUpdateCallback &&cb) {
+    std::lock_guard _(_mx);
+    return _pub.subscribe(std::move(cb));
+}
+
+std::size_t DurableTopic::subscribe(TopicUpdateCallback &&cb, std::uint64_t from_offset) {
+    bool active = true;
+    auto replay = [&](const TopicLog::Record &r) {
+        active = cb(Payload(r.data));
+        return active;
+    };
+    //most of records are replayed without blocking publishers
+    std::uint64_t next = _log.read(from_offset, replay);
+    if (!active) return 0;
+    //the rest is replayed while publishing is blocked, then switch to live updates
+    std::lock_guard _(_mx);
+    _log.read(next, replay);
+    if (!active) return 0;
+    return _pub.subscribe(std::move(cb));
+}
+
+std::size_t DurableTopic::subscribe_since(TopicUpdateCallback &&cb, std::uint64_t timestamp) {
+    return subscribe(std::move(cb), _log.find_offset(timestamp));
+}
+
+void DurableTopic::unsubscribe(std::size_t id) {
+    _pub.unsubscribe(id);
+}
+
+}
@@ -0,0 +1,84 @@
+/*
+ * durabletopic.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_DURABLETOPIC_H_woeid209dj02jd0ew
+#define LIB_UMQ_DURABLETOPIC_H_woeid209dj02jd0ew
+#include <mutex>
+
+#include "publisher.h"
+#include "topiclog.h"
+
+namespace umq {
+
+///Topic which stores all updates to the TopicLog
+/**
+ * Subscriber can start from any offset (or time) available in the log. Stored
+ * updates are replayed first, then the subscriber is switched to live updates
+ * without missing or repeating an update.
+ *
+ * @note replay sends updates as fast as possible. If the subscriber is a Peer,
+ * use HighWaterMarkBehavior::block to avoid skipping updates during replay
+ */
+class DurableTopic {
+public:
+
+    ///Open the topic
+    /**
+     * @param path directory of the log
+     * @param cfg configuration of the log
+     */
+    explicit DurableTopic(const std::string &path, const TopicLogConfig &cfg = TopicLogConfig());
+
+    ///Store and publish update
+    /**
+     * @param data update
+     * @return offset of the update in the log
+     * @exception std::length_error update is larger than TopicLog::max_record_size
+     */
+    std::uint64_t publish(const std::string_view &data);
+
+    ///Subscribe live updates only
+    /**
+     * @param cb callback
+     * @return id of subscriber
+     */
+    std::size_t subscribe(TopicUpdateCallback &&cb);
+
+    ///Subscribe from given offset
+    /**
+     * @param cb callback
+     * @param from_offset offset of first update. Use 0 to replay all available updates
+     * @return id of subscriber, or 0 if the subscriber unsubscribed during replay
+     */
+    std::size_t subscribe(TopicUpdateCallback &&cb, std::uint64_t from_offset);
+
+    ///Subscribe from given time
+    /**
+     * @param cb callback
+     * @param timestamp time in milliseconds since epoch
+     * @return id of subscriber, or 0 if the subscriber unsubscribed during replay
+     */
+    std::size_t subscribe_since(TopicUpdateCallback &&cb, std::uint64_t timestamp);
+
+    ///Unsubscribe the subscriber
+    void unsubscribe(std::size_t id);
+
+    ///Access to the log
+    TopicLog &get_log() {return _log;}
+
+protected:
+    TopicLog _log;
+    Publisher _pub;
+    ///serializes publishing and switching subscribers to live updates
+    std::mutex _mx;
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_DURABLETOPIC_H_woeid209dj02jd0ew */
@@ -0,0 +1,65 @@
+#include "fileattach.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+
+namespace umq {
+
+Attachment FileAttachment::make(int fd, std::uint64_t offset, std::size_t size, bool take_ownership) {
+    auto file = std::make_shared<FileAttachment>(fd, offset, size, take_ownership);
+    struct stat st;
+    //a shorter file would break the framing of the connection
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+            && (offset > static_cast<std::uint64_t>(st.st_size)
+                || size > static_cast<std::uint64_t>(st.st_size) - offset)) {
+        throw std::invalid_argument("File attachment is beyond the end of the file");
+    }
+    Attachment att(new AttachContent, Deleter{std::move(file)});
+    //the content is not loaded, the future is resolved so local consumers don't wait forever
+    (*att) = std::make_exception_ptr(std::logic_error(
+            "File attachment is not loaded, use FileAttachment::get(att)->read()"));
+    return att;
+}
+
+Attachment FileAttachment::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int e = errno;
+        ::close(fd);
+        throw std::system_error(e, std::generic_category(), path);
+    }
+    return make(fd, 0, static_cast<std::size_t>(st.st_size), true);
+}
+
+PFileAttachment FileAttachment::get(const Attachment &att) {
+    const Deleter *d = std::get_deleter<Deleter>(att);
+    return d?d->file:nullptr;
+}
+
+FileAttachment::~FileAttachment() {
+    if (_owner) ::close(_fd);
+}
+
+std::string FileAttachment::read() const {
+    std::string out(_size, '\0');
+    std::size_t pos = 0;
+    while (pos < _size) {
+        ssize_t r = ::pread(_fd, out.data()+pos, _size - pos, static_cast<off_t>(_offset + pos));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "File attachment read error");
+        }
+        if (r == 0) throw std::system_error(EIO, std::generic_category(), "File attachment is truncated");
+        pos += static_cast<std::size_t>(r);
+    }
+    return out;
+}
+
+}
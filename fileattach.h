@@ -0,0 +1,105 @@
+/*
+ * fileattach.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_FILEATTACH_H_dk20dj39fj20dk3ld0
+#define LIB_UMQ_FILEATTACH_H_dk20dj39fj20dk3ld0
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "payload.h"
+
+namespace umq {
+
+class FileAttachment;
+
+using PFileAttachment = std::shared_ptr<const FileAttachment>;
+
+///Attachment which content is a range of a file
+/**
+ * Content of the attachment is not loaded to the memory. When the attachment
+ * is sent, the connection transfers the range directly from the file
+ * (TCPConnection uses sendfile(), so the content is not copied to the user space).
+ * Connections which need to frame the content (WebSocket) read the range to
+ * a buffer and send it as binary frame.
+ *
+ * The attachment created by make() or open() is ordinary Attachment, it can
+ * be put to a Payload. The content is not loaded to the future, the future is
+ * resolved with an exception (std::logic_error). Use get() and read() to access
+ * the content locally. Such attachment is not deduplicated by the attachment cache.
+ *
+ * @code
+ * Payload p("report.pdf");
+ * p.attachments.push_back(FileAttachment::open("/var/reports/report.pdf"));
+ * peer->call("upload", p, ...);
+ * @endcode
+ */
+class FileAttachment {
+public:
+
+    ///Create file attachment
+    /**
+     * @param fd file descriptor
+     * @param offset offset of the content in the file
+     * @param size size of the content in bytes
+     * @param take_ownership true to close the descriptor when the attachment is destroyed
+     * @return attachment
+     * @exception std::invalid_argument the range is beyond the end of a regular file
+     */
+    static Attachment make(int fd, std::uint64_t offset, std::size_t size, bool take_ownership);
+
+    ///Open file and create attachment of whole file
+    /**
+     * @param path path to the file
+     * @return attachment
+     * @exception std::system_error unable to open the file
+     */
+    static Attachment open(const std::string &path);
+
+    ///Retrieve file of the attachment
+    /**
+     * @param att attachment
+     * @return pointer to file attachment, or nullptr, if the attachment is not backed by a file
+     */
+    static PFileAttachment get(const Attachment &att);
+
+    FileAttachment(int fd, std::uint64_t offset, std::size_t size, bool owner)
+        :_fd(fd),_offset(offset),_size(size),_owner(owner) {}
+    FileAttachment(const FileAttachment &) = delete;
+    FileAttachment &operator=(const FileAttachment &) = delete;
+    ~FileAttachment();
+
+    int get_fd() const {return _fd;}
+    std::uint64_t get_offset() const {return _offset;}
+    std::size_t get_size() const {return _size;}
+
+    ///Read content to the memory
+    /**
+     * @return content
+     * @exception std::system_error read error, or the file is shorter than expected
+     */
+    std::string read() const;
+
+protected:
+    int _fd;
+    std::uint64_t _offset;
+    std::size_t _size;
+    bool _owner;
+
+    ///Deleter of the attachment, carries the file
+    struct Deleter {
+        PFileAttachment file;
+        void operator()(AttachContent *ptr) const {delete ptr;}
+    };
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_FILEATTACH_H_dk20dj39fj20dk3ld0 */
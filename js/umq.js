@@ -19,16 +19,23 @@ export const PeerMsgType =  {
     discover : '?',
     attachment : 'A',
     attachment_error : '-',
+    var_batch : 'B',
     callback : 'C',
+    topic_delta : 'D',
     exception : 'E',
     hello : 'H',
+    attachment_cached : 'K',
+    attachment_cache : 'L',
     method_call : 'M',
+    topic_batch : 'P',
+    topic_update_seq : 'Q',
     result : 'R',
     var_set : 'S',
     topic_update : 'T',
     unsubscribe : 'U',
     welcome : 'W',
     var_unset : 'X',
+    resync : 'Y',
     topic_close : 'Z'
 };
 
@@ -134,8 +141,33 @@ export class Peer {
         await this.#p_disconnect;
     }
     
+    ///Subscribes topic
+    /**
+    @param topic topic id
+    @param callback function called for every update. If the publisher sends
+      sequence numbers, you can set ongap property of the callback to a function
+      (expected, received), which is called when updates are missing. If
+      this function returns true, resync is requested
+    */
     subscribe(topic, callback) {
         this.#subscriptions[topic] = callback;
+        delete this.#subscr_seq[topic];
+        delete this.#subscr_delta[topic];
+    }
+
+    ///Announces that this peer accepts batched topic updates
+    /**
+    The publisher then can send more updates in one message. Call only if
+    the other side supports batches
+    */
+    enable_topic_batch() {
+        this.#send_msg(PeerMsgType.topic_batch);
+    }
+
+    ///Requests resync of the topic (publisher should send complete state)
+    request_resync(topic) {
+        const last = this.#subscr_seq[topic] || 0;
+        this.#send_msg(PeerMsgType.resync+topic+"\n"+last);
     }
     
     ///Initiates publishing of given topic
@@ -176,6 +208,8 @@ export class Peer {
         if (topic in this.#subscriptions) {
             this.#subscriptions[topic](null);
             delete this.#subscriptions[topic];
+            delete this.#subscr_seq[topic];
+            delete this.#subscr_delta[topic];
             this.#send_unsubscribe(topic);
             return true;
         } else {
@@ -300,6 +334,17 @@ export class Peer {
                 case PeerMsgType.topic_update: 
                           this.#on_topic_update(id, new Payload(data,att));
                           break;
+                case PeerMsgType.topic_update_seq: {
+                            const [seq,tdata] = Peer.split("\n", data);
+                            this.#on_topic_update_seq(id, parseInt(seq), new Payload(tdata,att));
+                          }
+                          break;
+                case PeerMsgType.topic_delta:
+                          this.#on_topic_delta(id, data, att);
+                          break;
+                case PeerMsgType.topic_batch:
+                          this.#on_topic_batch(id, data);
+                          break;
                 case PeerMsgType.unsubscribe:
                           this.#on_unsubscribe(id);
                           break;
@@ -312,6 +357,9 @@ export class Peer {
                 case PeerMsgType.var_unset: 
                           this.#on_var_unset(id);
                           break;
+                case PeerMsgType.var_batch: 
+                          this.#on_var_batch(id, data);
+                          break;
                 case PeerMsgType.welcome:
                           this.#on_welcome(id, new Payload(data,att));                          
                           break;
@@ -329,6 +377,9 @@ export class Peer {
                     }
                 }
                 break;
+                case PeerMsgType.attachment_cache:
+                    //attachments are always sent in full, the cache of the other side is not used
+                break;
                 case PeerMsgType.attachment_error: 
                     if (this.#dwnl_attachments.length) {
                         this.#dwnl_attachments.shift().err(data);
@@ -415,6 +466,113 @@ export class Peer {
         }
     }
     
+    #on_topic_update_seq(id, seq, data) {
+        if (isNaN(seq)) {
+            this.#send_node_error(PeerError.messageParseError);
+            return;
+        }
+        const s = this.#subscriptions[id];
+        if (s) {
+            const last = this.#subscr_seq[id];
+            this.#subscr_seq[id] = seq;
+            if (last && seq != last+1 && s.ongap && s.ongap(last+1, seq)) {
+                this.#send_msg(PeerMsgType.resync+id+"\n"+last);
+            }
+        }
+        this.#on_topic_update(id, data);
+    }
+
+    #on_topic_delta(id, data, att) {
+        if (!(id in this.#subscriptions)) return;
+        const [hdr, body] = Peer.split("\n", data);
+        const enc = new TextEncoder();
+        let value;
+        if (hdr == "K") {
+            value = enc.encode(body || "");
+        } else {
+            //offsets and sizes are in bytes
+            const base = this.#subscr_delta[id];
+            if (!base || base.length != parseInt(hdr)) {
+                //base is lost, drop updates until the next keyframe, request it once
+                if (base !== null) {
+                    this.#subscr_delta[id] = null;
+                    this.#send_msg(PeerMsgType.resync+id+"\n0");
+                }
+                return;
+            }
+            const bytes = enc.encode(body || "");
+            const parts = [];
+            let pos = 0;
+            let total = 0;
+            const num = (sep) => {
+                let e = bytes.indexOf(sep, pos);
+                if (e == -1) throw new Error("Invalid delta");
+                const r = parseInt(String.fromCharCode(...bytes.subarray(pos, e)));
+                if (isNaN(r)) throw new Error("Invalid delta");
+                pos = e + 1;
+                return r;
+            };
+            while (pos < bytes.length) {
+                const t = String.fromCharCode(bytes[pos++]);
+                if (t == 'C') {
+                    const offset = num(32);
+                    const len = num(10);
+                    if (offset + len > base.length) throw new Error("Invalid delta");
+                    parts.push(base.subarray(offset, offset + len));
+                    total += len;
+                } else if (t == 'I') {
+                    const len = num(10);
+                    if (pos + len > bytes.length) throw new Error("Invalid delta");
+                    parts.push(bytes.subarray(pos, pos + len));
+                    pos += len;
+                    total += len;
+                } else {
+                    throw new Error("Invalid delta");
+                }
+            }
+            value = new Uint8Array(total);
+            let wr = 0;
+            parts.forEach(p => {value.set(p, wr); wr += p.length;});
+        }
+        this.#subscr_delta[id] = value;
+        this.#on_topic_update(id, new Payload(new TextDecoder().decode(value), att));
+    }
+
+    #on_topic_batch(id, data) {
+        //announcement of the other side, this peer doesn't send batches
+        if (!id && !data) return;
+        //sizes of entries are in bytes
+        const bytes = new TextEncoder().encode(data);
+        const dec = new TextDecoder();
+        const updates = [];
+        let pos = 0;
+        const line = () => {
+            let e = bytes.indexOf(10, pos);
+            if (e == -1) e = bytes.length;
+            const r = dec.decode(bytes.subarray(pos, e));
+            pos = e + 1;
+            return r;
+        };
+        while (pos < bytes.length) {
+            const t = String.fromCharCode(bytes[pos++]);
+            if (t != PeerMsgType.topic_update && t != PeerMsgType.topic_update_seq) throw new Error("Invalid batch");
+            const topic = line();
+            const sz = parseInt(line());
+            if (isNaN(sz) || pos + sz > bytes.length) throw new Error("Invalid batch");
+            updates.push([t, topic, dec.decode(bytes.subarray(pos, pos + sz))]);
+            pos += sz;
+        }
+        if (updates.length != parseInt(id)) throw new Error("Invalid batch");
+        updates.forEach(([t, topic, body]) => {
+            if (t == PeerMsgType.topic_update) {
+                this.#on_topic_update(topic, new Payload(body, []));
+            } else {
+                const [seq,tdata] = Peer.split("\n", body);
+                this.#on_topic_update_seq(topic, parseInt(seq), new Payload(tdata, []));
+            }
+        });
+    }
+
     #on_unsubscribe(id) {
         const s = this.#topics[id];
         delete this.#topics[id];
@@ -438,6 +596,40 @@ export class Peer {
     #on_var_unset(id) {
         delete this.peer_vars[id];
     }
+
+    #on_var_batch(id, data) {
+        //sizes of values are in bytes
+        const bytes = new TextEncoder().encode(data);
+        const dec = new TextDecoder();
+        const changes = [];
+        let pos = 0;
+        const line = () => {
+            let e = bytes.indexOf(10, pos);
+            if (e == -1) e = bytes.length;
+            const r = dec.decode(bytes.subarray(pos, e));
+            pos = e + 1;
+            return r;
+        };
+        while (pos < bytes.length) {
+            const t = String.fromCharCode(bytes[pos++]);
+            const name = line();
+            if (t == PeerMsgType.var_set) {
+                const sz = parseInt(line());
+                if (isNaN(sz) || pos + sz > bytes.length) throw new Error("Invalid batch");
+                changes.push([name, dec.decode(bytes.subarray(pos, pos + sz))]);
+                pos += sz;
+            } else if (t == PeerMsgType.var_unset) {
+                changes.push([name]);
+            } else {
+                throw new Error("Invalid batch");
+            }
+        }
+        if (changes.length != parseInt(id)) throw new Error("Invalid batch");
+        changes.forEach(([name, value]) => {
+            if (value === undefined) delete this.peer_vars[name];
+            else this.peer_vars[name] = value;
+        });
+    }
     #on_discover(id,query) {
         if (!query) {
             var res = "";
@@ -529,6 +721,8 @@ export class Peer {
         }        
         this.#topics = {};
         this.#subscriptions = {};
+        this.#subscr_seq = {};
+        this.#subscr_delta = {};
         this.#requests = {};
         this.#connected = false;
     }
@@ -583,6 +777,8 @@ export class Peer {
 
     #topics = {}; //topic map with unsubscribe function
     #subscriptions = {}; //active subscriptions
+    #subscr_seq = {}; //last sequence number of subscriptions
+    #subscr_delta = {}; //last values of delta encoded subscriptions (bytes)
     #requests = {}; //requests
     #callbacks = {}; //callbacks
     #req_next_id = 0;  
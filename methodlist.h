@@ -2,10 +2,15 @@
 #define LIB_UMQ_METHODLIST_H_qweqweq8e32eu29dwioed2983
 
 #include "request.h"
+#include "radixtree.h"
 
 #include <shared/callback.h>
 #include <shared/shared_lockable_ptr.h>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
 namespace umq {
@@ -74,66 +79,245 @@ public:
 
 
     MethodSetHelper method(std::string &&name) {
+        mark_changed();
         return MethodSetHelper(methods[std::move(name)]);
     }
     MethodSetHelper method(const std::string_view &name) {
+        mark_changed();
         return MethodSetHelper(methods[std::string(name)]);
     }
     MethodSetHelper method(const char *name) {
+        mark_changed();
         return MethodSetHelper(methods[std::string(name)]);
     }
     RouteSetHelper route(std::string &&name) {
+        mark_changed();
         return RouteSetHelper(proxies[std::move(name)]);
     }
     RouteSetHelper route(const std::string_view &name) {
+        mark_changed();
         return RouteSetHelper(proxies[std::string(name)]);
     }
     RouteSetHelper route(const char *name) {
+        mark_changed();
         return RouteSetHelper(proxies[std::string(name)]);
     }
 
-    const MethodCall * find_method(const std::string &name) const {
-        auto iter = methods.find(name);
-        if (iter != methods.end()) return &iter->second.first;
-        auto iter2 = proxies.lower_bound(name);
-        if (iter2 != proxies.end()) {
-            if (name.compare(0,iter2->first.size(), iter2->first)==0) {
-                return &iter2->second.first;
-            }
+    ///Marks the list changed
+    /**
+     * Invalidates cached discover listing and lookup index and increases
+     * the version. It is called automatically by method() and route(). You need
+     * to call this function when you modify the maps methods or proxies directly
+     * (especially when you erase an item, because the index refers the items)
+     */
+    void mark_changed() {
+        _version = next_version();
+        _dirty.store(true, std::memory_order_release);
+    }
+
+    ///Retrieves current version of the list
+    /** Version is changed everytime the list is changed. It is reported
+     * to the discover clients, which can use it to skip unchanged listings.
+     * Versions are taken from a process wide counter, which starts at current
+     * time (in microseconds), so two lists (or the same list after restart of
+     * the process) never report the same version
+     */
+    std::size_t get_version() const {
+        return _version;
+    }
+
+    ///Retrieves preformatted discover listing
+    /**
+     * The listing is built on the first request after the list has been changed,
+     * following requests receive cached content. The function can be called
+     * under shared lock.
+     *
+     * @return listing in format of the discover response (including the version line)
+     */
+    const std::string &get_discover_listing() const {
+        update_cache();
+        return _listing;
+    }
+
+    ///Find method or route for given method name
+    /**
+     * Exact match of a method has priority. If there is no such method, the
+     * longest route which is prefix of the name is returned. Lookup doesn't
+     * allocate memory.
+     *
+     * @param name method name
+     * @param matched optional pointer to variable which receives name
+     * of the found method or route
+     * @return pointer to method or nullptr
+     */
+    const MethodCall * find_method(const std::string_view &name, std::string_view *matched = nullptr) const {
+        update_cache();
+        const IndexEntry *m = nullptr;
+        const IndexEntry *rt = nullptr;
+        std::size_t rtlen = 0;
+        _index.walk(name, [&](const IndexEntry &e, std::size_t len) {
+            if (e.route) {rt = &e; rtlen = len;}
+            if (len == name.size() && e.method) m = &e;
+        });
+        if (m) {
+            if (matched) *matched = name;
+            return &m->method->first;
+        }
+        if (rt) {
+            if (matched) *matched = name.substr(0, rtlen);
+            return &rt->route->first;
         }
         return nullptr;
     }
 
-    const std::string *find_doc(const std::string &name) const {
-        auto iter = methods.find(name);
-        if (iter != methods.end()) return &iter->second.second;
+    const std::string *find_doc(const std::string_view &name) const {
+        update_cache();
+        const IndexEntry *e = _index.find(name);
+        if (e && e->method) return &e->method->second;
         return nullptr;
 
     }
 
-    const DiscoverCall * find_route_discover(const std::string &name) const {
-        auto iter2 = proxies.lower_bound(name);
-        if (iter2 != proxies.end()) {
-            if (name.compare(0,iter2->first.size(), iter2->first)==0) {
-                if (iter2->second.second != nullptr) {
-                    return &iter2->second.second;
-                } else {
-                    return nullptr;
-                }
-            }
-        }
+    ///Find discover handler of the longest route which is prefix of the name
+    const DiscoverCall * find_route_discover(const std::string_view &name) const {
+        update_cache();
+        const IndexEntry *e = _index.find_longest_prefix(name, [](const IndexEntry &e){
+            return e.route != nullptr;
+        });
+        if (e && e->route->second != nullptr) return &e->route->second;
         return nullptr;
     }
 
     std::unordered_map<std::string, std::pair<MethodCall, std::string> > methods;
     std::map<std::string, RouterDoc, std::greater<std::string> > proxies;
 
+protected:
+
+    struct IndexEntry {
+        const MethodDoc *method = nullptr;
+        const RouterDoc *route = nullptr;
+    };
+
+    std::size_t _version = next_version();
+    mutable std::atomic<bool> _dirty = true;
+    mutable std::mutex _cache_lock;
+    mutable std::string _listing;
+    mutable RadixTree<IndexEntry> _index;
+
+    static std::size_t next_version() {
+        static std::atomic<std::size_t> counter(static_cast<std::size_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count()));
+        return counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void update_cache() const {
+        if (_dirty.load(std::memory_order_acquire)) {
+            std::lock_guard _(_cache_lock);
+            if (_dirty.load(std::memory_order_relaxed)) {
+                build_listing();
+                build_index();
+                _dirty.store(false, std::memory_order_release);
+            }
+        }
+    }
+
+    void build_index() const {
+        _index.clear();
+        for (const auto &x: methods) _index[x.first].method = &x.second;
+        for (const auto &x: proxies) _index[x.first].route = &x.second;
+    }
+
+    void build_listing() const {
+        std::size_t need = 24;
+        for (const auto &x: methods) need += x.first.size()+2;
+        for (const auto &x: proxies) need += x.first.size()+2;
+        _listing.clear();
+        _listing.reserve(need);
+        _listing.push_back('V');
+        _listing.append(std::to_string(_version));
+        _listing.push_back('\n');
+        for (const auto &x: methods) {
+            _listing.push_back('M');
+            _listing.append(x.first);
+            _listing.push_back('\n');
+        }
+        for (const auto &x: proxies) {
+            _listing.push_back('R');
+            _listing.append(x.first);
+            _listing.push_back('\n');
+        }
+    }
+
 
 };
 
 
 using PMethodList = ondra_shared::shared_lockable_ptr<MethodList>;
 
+///Immutable snapshot of a method list
+using MethodListSnapshot = std::shared_ptr<const MethodList>;
+
+///Method list updated by publishing immutable snapshots
+/**
+ * Alternative to PMethodList. Readers don't need to lock the list, they
+ * just retrieve current snapshot. Writers build a complete new method list
+ * and publish it. Published list can't be modified. Old snapshot is released
+ * once the last reader drops its reference.
+ *
+ * Peers cache the snapshot and check only the generation counter, so
+ * dispatching a message doesn't touch any shared lock.
+ */
+class SnapshotMethodList {
+public:
+
+    SnapshotMethodList():_current(std::make_shared<MethodList>()) {}
+
+    ///Publish new method list
+    /**
+     * @param list new method list. Caller must not modify the list after
+     * it is published
+     */
+    void publish(std::shared_ptr<MethodList> list) {
+        //every published list gets new version, so clients don't skip the change
+        list->mark_changed();
+        //build caches before the list is shared, readers then never lock it
+        list->get_discover_listing();
+        std::atomic_store(&_current, MethodListSnapshot(std::move(list)));
+        _generation.fetch_add(1, std::memory_order_release);
+    }
+
+    ///Build and publish new method list
+    /**
+     * @param fn function which receives reference to new empty MethodList. It
+     * should register all methods and routes. Builds are serialized.
+     */
+    template<typename Fn>
+    void build(Fn &&fn) {
+        std::lock_guard _(_build_lock);
+        auto lst = std::make_shared<MethodList>();
+        fn(*lst);
+        publish(std::move(lst));
+    }
+
+    ///Retrieve current snapshot
+    MethodListSnapshot get() const {
+        return std::atomic_load(&_current);
+    }
+
+    ///Retrieve generation. It is increased by every publish
+    std::size_t get_generation() const {
+        return _generation.load(std::memory_order_acquire);
+    }
+
+protected:
+    MethodListSnapshot _current;
+    std::atomic<std::size_t> _generation = 1;
+    std::mutex _build_lock;
+};
+
+using PSnapshotMethodList = std::shared_ptr<SnapshotMethodList>;
+
 
 }
 
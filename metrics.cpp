@@ -0,0 +1,261 @@
+#include "metrics.h"
+#include "peer.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace umq {
+
+static const char *hwm_names[] = {"skip","block","ignore","unsubscribe","close"};
+
+PeerMetricsSnapshot &PeerMetricsSnapshot::operator+=(const PeerMetricsSnapshot &other) {
+    for (const auto &x: other.messages) {
+        auto &c = messages[x.first];
+        c.msgs_in += x.second.msgs_in;
+        c.bytes_in += x.second.bytes_in;
+        c.msgs_out += x.second.msgs_out;
+        c.bytes_out += x.second.bytes_out;
+    }
+    for (std::size_t i = 0; i < hwm_events.size(); i++) hwm_events[i] += other.hwm_events[i];
+    pending_calls += other.pending_calls;
+    queued_calls += other.queued_calls;
+    queued_attachments += other.queued_attachments;
+    pending_downloads += other.pending_downloads;
+    peers += other.peers;
+    return *this;
+}
+
+std::string metrics_to_string(const PeerMetricsSnapshot &snapshot) {
+    std::ostringstream buff;
+    for (const auto &x: snapshot.messages) {
+        std::string t = x.first?std::string(1, x.first):std::string("binary");
+        buff << "msgs_in." << t << " " << x.second.msgs_in << "\n"
+             << "bytes_in." << t << " " << x.second.bytes_in << "\n"
+             << "msgs_out." << t << " " << x.second.msgs_out << "\n"
+             << "bytes_out." << t << " " << x.second.bytes_out << "\n";
+    }
+    for (std::size_t i = 0; i < snapshot.hwm_events.size(); i++) {
+        buff << "hwm." << hwm_names[i] << " " << snapshot.hwm_events[i] << "\n";
+    }
+    buff << "pending_calls " << snapshot.pending_calls << "\n"
+         << "queued_calls " << snapshot.queued_calls << "\n"
+         << "queued_attachments " << snapshot.queued_attachments << "\n"
+         << "pending_downloads " << snapshot.pending_downloads << "\n"
+         << "peers " << snapshot.peers << "\n";
+    return buff.str();
+}
+
+std::string metrics_to_string(const std::map<std::string, LatencySnapshot, std::less<> > &latencies, const std::string_view &prefix) {
+    std::ostringstream buff;
+    for (const auto &x: latencies) {
+        const std::string &n = x.first;
+        buff << prefix << "." << n << ".count " << x.second.count << "\n"
+             << prefix << "." << n << ".sum_ns " << x.second.sum_ns << "\n"
+             << prefix << "." << n << ".min_ns " << x.second.min_ns << "\n"
+             << prefix << "." << n << ".p50_ns " << x.second.p50_ns << "\n"
+             << prefix << "." << n << ".p90_ns " << x.second.p90_ns << "\n"
+             << prefix << "." << n << ".p99_ns " << x.second.p99_ns << "\n"
+             << prefix << "." << n << ".max_ns " << x.second.max_ns << "\n";
+    }
+    return buff.str();
+}
+
+#ifdef UMQ_ENABLE_METRICS
+
+unsigned int LatencyHistogram::bucket_index(std::uint64_t v) {
+    if (v < sub_count) return static_cast<unsigned int>(v);
+    unsigned int e = 63 - __builtin_clzll(v);
+    if (e > max_exp) return bucket_count - 1;
+    unsigned int sub = static_cast<unsigned int>(v >> (e - sub_bits)) & (sub_count - 1);
+    return (e - sub_bits + 1) * sub_count + sub;
+}
+
+std::uint64_t LatencyHistogram::bucket_upper_bound(unsigned int idx) {
+    if (idx < sub_count) return idx;
+    unsigned int e = idx / sub_count + sub_bits - 1;
+    std::uint64_t sub = idx % sub_count;
+    return ((sub_count + sub + 1) << (e - sub_bits)) - 1;
+}
+
+LatencySnapshot LatencyHistogram::get() const {
+    LatencySnapshot r;
+    std::array<std::uint64_t, bucket_count> b;
+    for (unsigned int i = 0; i < bucket_count; i++) {
+        b[i] = _buckets[i].load(std::memory_order_relaxed);
+        r.count += b[i];
+    }
+    r.sum_ns = _sum.load(std::memory_order_relaxed);
+    if (r.count == 0) return r;
+    std::uint64_t p50 = (r.count * 50 + 99) / 100;
+    std::uint64_t p90 = (r.count * 90 + 99) / 100;
+    std::uint64_t p99 = (r.count * 99 + 99) / 100;
+    std::uint64_t acc = 0;
+    bool has_min = false;
+    for (unsigned int i = 0; i < bucket_count; i++) {
+        if (!b[i]) continue;
+        std::uint64_t ub = bucket_upper_bound(i);
+        if (!has_min) {r.min_ns = ub; has_min = true;}
+        r.max_ns = ub;
+        std::uint64_t prev = acc;
+        acc += b[i];
+        if (prev < p50 && acc >= p50) r.p50_ns = ub;
+        if (prev < p90 && acc >= p90) r.p90_ns = ub;
+        if (prev < p99 && acc >= p99) r.p99_ns = ub;
+    }
+    return r;
+}
+
+PeerMetrics::PeerMetrics() {
+    ProcessMetrics::instance().reg(this);
+}
+
+PeerMetrics::~PeerMetrics() {
+    ProcessMetrics::instance().unreg(this);
+}
+
+LatencyHistogram *PeerMetrics::method(const std::string_view &name) {
+    return ProcessMetrics::instance().method(name);
+}
+
+void PeerMetrics::on_upload(std::chrono::steady_clock::time_point queued, std::chrono::steady_clock::time_point resolved) {
+    ProcessMetrics &pm = ProcessMetrics::instance();
+    pm._upload_wait.record(std::chrono::duration_cast<std::chrono::nanoseconds>(resolved - queued).count());
+    pm._upload_send.record_since(resolved);
+}
+
+std::size_t PeerMetrics::type_slot(char type) {
+    //slot 0 is reserved for binary frames, last slot for unknown types
+    static constexpr std::string_view types = "!?-ABCDEHKLMPQRSTUWXYZ";
+    auto pos = types.find(type);
+    if (pos == types.npos) return type_slots - 1;
+    return pos + 1;
+}
+
+char PeerMetrics::slot_type(std::size_t slot) {
+    static constexpr std::string_view types = "!?-ABCDEHKLMPQRSTUWXYZ";
+    if (slot == 0) return 0;
+    if (slot > types.size()) return '*';
+    return types[slot - 1];
+}
+
+void PeerMetrics::count(const MsgFrame &frame, bool in, std::size_t extra) {
+    std::size_t slot;
+    if (frame.type == MsgFrameType::binary) {
+        slot = 0;
+    } else if (frame.data.empty()) {
+        slot = type_slots - 1;
+    } else {
+        char t = frame.data[0];
+        if (t == static_cast<char>(PeerMsgType::attachment)) {
+            //count type of the message which carries the attachments
+            auto pos = frame.data.find('\n');
+            if (pos != frame.data.npos && pos + 1 < frame.data.size()) t = frame.data[pos + 1];
+        }
+        slot = type_slot(t);
+    }
+    Counters &c = _msgs[slot];
+    std::size_t sz = frame.data.size() + extra;
+    if (in) {
+        c.msgs_in.fetch_add(1, std::memory_order_relaxed);
+        c.bytes_in.fetch_add(sz, std::memory_order_relaxed);
+    } else {
+        c.msgs_out.fetch_add(1, std::memory_order_relaxed);
+        c.bytes_out.fetch_add(sz, std::memory_order_relaxed);
+    }
+}
+
+PeerMetricsSnapshot PeerMetrics::get() const {
+    PeerMetricsSnapshot r;
+    for (std::size_t i = 0; i < type_slots; i++) {
+        const Counters &c = _msgs[i];
+        PeerMetricsSnapshot::MsgCounters s;
+        s.msgs_in = c.msgs_in.load(std::memory_order_relaxed);
+        s.bytes_in = c.bytes_in.load(std::memory_order_relaxed);
+        s.msgs_out = c.msgs_out.load(std::memory_order_relaxed);
+        s.bytes_out = c.bytes_out.load(std::memory_order_relaxed);
+        if (s.msgs_in || s.msgs_out) r.messages[slot_type(i)] = s;
+    }
+    for (std::size_t i = 0; i < _hwm.size(); i++) {
+        r.hwm_events[i] = _hwm[i].load(std::memory_order_relaxed);
+    }
+    r.peers = 1;
+    return r;
+}
+
+ProcessMetrics &ProcessMetrics::instance() {
+    static ProcessMetrics inst;
+    return inst;
+}
+
+void ProcessMetrics::reg(PeerMetrics *m) {
+    std::lock_guard _(_peers_lock);
+    _peers.push_back(m);
+}
+
+void ProcessMetrics::unreg(PeerMetrics *m) {
+    std::lock_guard _(_peers_lock);
+    auto iter = std::find(_peers.begin(), _peers.end(), m);
+    if (iter != _peers.end()) {
+        std::swap(*iter, _peers.back());
+        _peers.pop_back();
+        PeerMetricsSnapshot s = m->get();
+        s.peers = 0;
+        _retired += s;
+    }
+}
+
+PeerMetricsSnapshot ProcessMetrics::get_peers() const {
+    std::lock_guard _(_peers_lock);
+    PeerMetricsSnapshot r = _retired;
+    for (const PeerMetrics *m: _peers) r += m->get();
+    return r;
+}
+
+LatencyHistogram *ProcessMetrics::method(const std::string_view &name) {
+    {
+        std::shared_lock _(_methods_lock);
+        auto iter = _methods.find(name);
+        if (iter != _methods.end()) return iter->second.get();
+    }
+    std::unique_lock _(_methods_lock);
+    auto &h = _methods[std::string(name)];
+    if (h == nullptr) h = std::make_unique<LatencyHistogram>();
+    return h.get();
+}
+
+std::map<std::string, LatencySnapshot, std::less<> > ProcessMetrics::get_methods() const {
+    std::shared_lock _(_methods_lock);
+    std::map<std::string, LatencySnapshot, std::less<> > r;
+    for (const auto &x: _methods) r.emplace(x.first, x.second->get());
+    return r;
+}
+
+std::map<std::string, LatencySnapshot, std::less<> > ProcessMetrics::get_uploads() const {
+    std::map<std::string, LatencySnapshot, std::less<> > r;
+    r.emplace("wait", _upload_wait.get());
+    r.emplace("send", _upload_send.get());
+    return r;
+}
+
+void register_metrics_method(MethodList &ml, const std::string_view &name) {
+    ml.method(name)
+        << "Returns metrics of this connection and of the whole process. "
+           "Format: one metric per line, name and value separated by a space"
+        >> [](Request &&req) {
+            auto peer = req.lock_peer();
+            std::string out;
+            std::istringstream peer_metrics(metrics_to_string(peer->get_metrics()));
+            std::string line;
+            while (std::getline(peer_metrics, line)) {
+                out.append("peer.").append(line).append("\n");
+            }
+            out.append(metrics_to_string(ProcessMetrics::instance().get_peers()));
+            out.append(metrics_to_string(ProcessMetrics::instance().get_methods()));
+            out.append(metrics_to_string(ProcessMetrics::instance().get_uploads(), "upload"));
+            req.send_result(Payload(out));
+    };
+}
+
+#endif
+
+}
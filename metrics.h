@@ -0,0 +1,239 @@
+/*
+ * metrics.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_METRICS_H_oiwje2039dj20dj0923jd
+#define LIB_UMQ_METRICS_H_oiwje2039dj20dj0923jd
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "message.h"
+
+namespace umq {
+
+enum class HighWaterMarkBehavior;
+
+///Snapshot of a latency histogram
+struct LatencySnapshot {
+    ///count of samples
+    std::uint64_t count = 0;
+    ///sum of all samples in nanoseconds
+    std::uint64_t sum_ns = 0;
+    ///minimum sample (upper bound of the bucket)
+    std::uint64_t min_ns = 0;
+    ///maximum sample (upper bound of the bucket)
+    std::uint64_t max_ns = 0;
+    ///median
+    std::uint64_t p50_ns = 0;
+    ///90th percentile
+    std::uint64_t p90_ns = 0;
+    ///99th percentile
+    std::uint64_t p99_ns = 0;
+};
+
+///Snapshot of peer's metrics
+struct PeerMetricsSnapshot {
+    ///Counters of a message type
+    struct MsgCounters {
+        std::uint64_t msgs_in = 0;
+        std::uint64_t bytes_in = 0;
+        std::uint64_t msgs_out = 0;
+        std::uint64_t bytes_out = 0;
+    };
+    ///Counters by message type (type char, 0 for binary frames)
+    std::map<char, MsgCounters> messages;
+    ///HWM events by behavior
+    std::array<std::uint64_t, 5> hwm_events = {};
+    ///Count of pending calls (only valid for single peer)
+    std::size_t pending_calls = 0;
+    ///Count of calls queued locally because call window is full (only valid for single peer)
+    std::size_t queued_calls = 0;
+    ///Count of queued attachments waiting to upload (only valid for single peer)
+    std::size_t queued_attachments = 0;
+    ///Count of attachments waiting to download (only valid for single peer)
+    std::size_t pending_downloads = 0;
+    ///Count of peers (process snapshot only)
+    std::size_t peers = 0;
+
+    PeerMetricsSnapshot &operator+=(const PeerMetricsSnapshot &other);
+};
+
+///Converts snapshot to text (one metric per line, "name value")
+std::string metrics_to_string(const PeerMetricsSnapshot &snapshot);
+///Converts latencies to text (one metric per line, "name value")
+/**
+ * @param latencies latencies
+ * @param prefix prefix of the names
+ */
+std::string metrics_to_string(const std::map<std::string, LatencySnapshot, std::less<> > &latencies, const std::string_view &prefix = "method");
+
+#ifdef UMQ_ENABLE_METRICS
+
+///Log-linear latency histogram
+/**
+ * Every power of two is divided to 16 linear buckets, so relative error is
+ * less than 6.25%. Recording is lock-free (relaxed atomics)
+ */
+class LatencyHistogram {
+public:
+
+    static constexpr unsigned int sub_bits = 4;
+    static constexpr unsigned int sub_count = 1U << sub_bits;
+    static constexpr unsigned int max_exp = 40;
+    static constexpr unsigned int bucket_count = (max_exp - sub_bits + 2) * sub_count;
+
+    ///Record sample
+    void record(std::uint64_t ns) {
+        _buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    ///Record duration since the start
+    void record_since(std::chrono::steady_clock::time_point start) {
+        record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+
+    LatencySnapshot get() const;
+
+    static unsigned int bucket_index(std::uint64_t v);
+    static std::uint64_t bucket_upper_bound(unsigned int idx);
+
+protected:
+    std::array<std::atomic<std::uint64_t>, bucket_count> _buckets = {};
+    std::atomic<std::uint64_t> _sum = 0;
+};
+
+///Metrics of single peer
+/**
+ * Counters are updated using relaxed atomics. All peers are registered
+ * in the ProcessMetrics, which aggregates counters of all peers
+ */
+class PeerMetrics {
+public:
+
+    PeerMetrics();
+    ~PeerMetrics();
+    PeerMetrics(const PeerMetrics &) = delete;
+    PeerMetrics &operator=(const PeerMetrics &) = delete;
+
+    void on_recv(const MsgFrame &frame) {
+        count(frame, true);
+    }
+    void on_send(const MsgFrame &frame) {
+        count(frame, false);
+    }
+    ///frame sent as header and body
+    void on_send(const MsgFrame &header, std::size_t body_size) {
+        count(header, false, body_size);
+    }
+    void on_hwm(HighWaterMarkBehavior hwmb) {
+        auto idx = static_cast<std::size_t>(hwmb);
+        if (idx < _hwm.size()) _hwm[idx].fetch_add(1, std::memory_order_relaxed);
+    }
+    ///Attachment has been sent
+    /**
+     * Records time the attachment waited for its content (queued - resolved), and
+     * time of sending (resolved - now), which includes waiting for previous attachments
+     *
+     * @param queued time when the attachment has been queued
+     * @param resolved time when the content has been resolved
+     */
+    static void on_upload(std::chrono::steady_clock::time_point queued, std::chrono::steady_clock::time_point resolved);
+    ///Retrieve histogram for the method
+    static LatencyHistogram *method(const std::string_view &name);
+
+    ///Retrieve snapshot of counters (without gauges)
+    PeerMetricsSnapshot get() const;
+
+protected:
+
+    struct Counters {
+        std::atomic<std::uint64_t> msgs_in = 0;
+        std::atomic<std::uint64_t> bytes_in = 0;
+        std::atomic<std::uint64_t> msgs_out = 0;
+        std::atomic<std::uint64_t> bytes_out = 0;
+    };
+
+    static constexpr std::size_t type_slots = 24;
+    std::array<Counters, type_slots> _msgs;
+    std::array<std::atomic<std::uint64_t>, 5> _hwm = {};
+
+    void count(const MsgFrame &frame, bool in, std::size_t extra = 0);
+    static std::size_t type_slot(char type);
+    static char slot_type(std::size_t slot);
+};
+
+class MethodList;
+
+///Registers method which returns metrics as text
+/**
+ * @param ml method list
+ * @param name name of the method
+ */
+void register_metrics_method(MethodList &ml, const std::string_view &name = "umq:metrics");
+
+///Process-wide metrics
+class ProcessMetrics {
+public:
+
+    static ProcessMetrics &instance();
+
+    ///Get aggregated counters of all peers (including already destroyed peers)
+    PeerMetricsSnapshot get_peers() const;
+    ///Get latencies of all methods
+    std::map<std::string, LatencySnapshot, std::less<> > get_methods() const;
+    ///Get latencies of attachment upload ("wait" - waiting for content, "send" - waiting for previous attachments and sending)
+    std::map<std::string, LatencySnapshot, std::less<> > get_uploads() const;
+
+protected:
+    friend class PeerMetrics;
+
+    void reg(PeerMetrics *m);
+    void unreg(PeerMetrics *m);
+    LatencyHistogram *method(const std::string_view &name);
+
+    mutable std::mutex _peers_lock;
+    std::vector<PeerMetrics *> _peers;
+    PeerMetricsSnapshot _retired;
+
+    mutable std::shared_mutex _methods_lock;
+    std::map<std::string, std::unique_ptr<LatencyHistogram>, std::less<> > _methods;
+
+    LatencyHistogram _upload_wait;
+    LatencyHistogram _upload_send;
+};
+
+
+#else
+
+///Metrics are disabled - all functions are empty
+class PeerMetrics {
+public:
+    void on_recv(const MsgFrame &) {}
+    void on_send(const MsgFrame &) {}
+    void on_send(const MsgFrame &, std::size_t) {}
+    void on_hwm(HighWaterMarkBehavior) {}
+    static void on_upload(std::chrono::steady_clock::time_point, std::chrono::steady_clock::time_point) {}
+    PeerMetricsSnapshot get() const {return {};}
+};
+
+#endif
+
+}
+
+
+
+#endif /* LIB_UMQ_METRICS_H_oiwje2039dj20dj0923jd */
@@ -1,8 +1,12 @@
 #include "peer.h"
+#include "delta.h"
+#include "throttle.h"
 
 #include <shared/trailer.h>
 #include <unistd.h>
 #include <charconv>
+#include <tuple>
+#include <limits>
 #include <sstream>
 #include <thread>
 namespace umq {
@@ -13,9 +17,9 @@ std::string_view Peer::version = "1.0.0";
 std::size_t Peer::default_hwm = 256*1024;
 
 Peer::Peer()
-:remote(*this, nullptr)
-,local(*this, &Peer::syncVar)
-,context(*this, nullptr)
+:remote(*this, nullptr, nullptr)
+,local(*this, &Peer::syncVar, &Peer::syncVars)
+,context(*this, nullptr, nullptr)
 ,_listener(*this), _hwm(default_hwm) {}
 
 PPeer Peer::make() {
@@ -41,15 +45,72 @@ void Peer::call(const std::string_view &method, const Payload &params,
 
 	std::unique_lock _(_lock);
 	if (!is_connected()) {
+	    _.unlock();
 	    result(Response(Response::Type::disconnected, Payload()));
         return;
 	}
+	if (_max_inflight && (_call_map.size() >= _max_inflight || !_call_queue.empty())) {
+	    if (_call_queue.size() < _max_queued) {
+	        _call_queue.push_back({std::string(method),
+	            PayloadStr(std::string(params), params.attachments),
+	            std::move(result)});
+	    } else {
+	        _.unlock();
+	        result(Response(Response::Type::rejected, Payload()));
+	    }
+	    return;
+	}
 	int id = _call_id++;
 	std::string idstr = std::to_string(id);
 	_call_map[idstr] = std::move(result);
 	send_call(idstr, method, params);
 }
 
+void Peer::set_call_window(std::size_t max_inflight, std::size_t max_queued) {
+	std::unique_lock _(_lock);
+	_max_inflight = max_inflight;
+	_max_queued = max_queued;
+	send_queued_calls();
+	auto waiters = collect_window_waiters();
+	_.unlock();
+	for (auto &w: waiters) w();
+}
+
+bool Peer::has_call_window() const {
+	std::shared_lock _(_lock);
+	return _max_inflight == 0 || (_call_map.size() < _max_inflight && _call_queue.empty());
+}
+
+void Peer::wait_call_window(CallWindowCallback &&cb) {
+	std::unique_lock _(_lock);
+	if (is_connected() && _max_inflight && (_call_map.size() >= _max_inflight || !_call_queue.empty())) {
+		_window_waiters.push_back(std::move(cb));
+	} else {
+		_.unlock();
+		cb();
+	}
+}
+
+void Peer::send_queued_calls() {
+	if (!is_connected()) return;
+	while (!_call_queue.empty() && (_max_inflight == 0 || _call_map.size() < _max_inflight)) {
+		QueuedCall qc = std::move(_call_queue.front());
+		_call_queue.pop_front();
+		int id = _call_id++;
+		std::string idstr = std::to_string(id);
+		_call_map[idstr] = std::move(qc.result);
+		send_call(idstr, qc.method, qc.params);
+	}
+}
+
+std::vector<CallWindowCallback> Peer::collect_window_waiters() {
+	std::vector<CallWindowCallback> out;
+	if (_max_inflight == 0 || (_call_map.size() < _max_inflight && _call_queue.empty())) {
+		std::swap(out, _window_waiters);
+	}
+	return out;
+}
+
 void Peer::subscribe(const std::string_view &topic, TopicUpdateCallback &&cb) {
 	std::unique_lock _(_lock);
 
@@ -63,7 +124,7 @@ TopicUpdateCallback Peer::start_publish(const std::string_view &topic, HighWater
 	if (is_connected()) {
 
         std::string t(topic);
-        _topic_map.emplace(t, nullptr);
+        _topic_map.try_emplace(t);
 
         auto trailer = ondra_shared::trailer([=,me = weak_from_this()]{
             auto melk = me.lock();
@@ -81,7 +142,9 @@ TopicUpdateCallback Peer::start_publish(const std::string_view &topic, HighWater
                 std::shared_lock _(melk->_lock);
                 auto iter = melk->_topic_map.find(t);
                 if (iter != melk->_topic_map.end()) {
-                    return melk->send_topic_update(t, data, hwmb, hwm_size);
+                    PublishedTopic &pt = iter->second;
+                    std::uint64_t seq = pt.sequenced?pt.seq.fetch_add(1, std::memory_order_relaxed)+1:0;
+                    return melk->send_topic_update(t, data, hwmb, hwm_size, seq, pt.delta.get());
                 } else{
                     return false;
                 }
@@ -96,12 +159,17 @@ TopicUpdateCallback Peer::start_publish(const std::string_view &topic, HighWater
 	}
 }
 
+TopicUpdateCallback Peer::start_publish(const std::string_view &topic, std::chrono::milliseconds min_interval,
+		HighWaterMarkBehavior hwmb, std::size_t hwm_percent) {
+	return UpdateThrottle::wrap(start_publish(topic, hwmb, hwm_percent), min_interval);
+}
+
 bool Peer::on_unsubscribe(const std::string_view &topic,
 		UnsubscribeRequest &&cb) {
 	std::unique_lock _(_lock);
 	auto iter = _topic_map.find(topic);
 	if (iter != _topic_map.end()) {
-		iter->second = std::move(cb);
+		iter->second.unsub = std::move(cb);
 		return true;
 	} else{
 		return false;
@@ -109,9 +177,77 @@ bool Peer::on_unsubscribe(const std::string_view &topic,
 
 }
 
+bool Peer::enable_sequence(const std::string_view &topic, ResyncRequest &&cb) {
+	std::unique_lock _(_lock);
+	auto iter = _topic_map.find(topic);
+	if (iter != _topic_map.end() && iter->second.delta == nullptr) {
+		iter->second.sequenced = true;
+		if (cb != nullptr) iter->second.resync = std::make_shared<ResyncRequest>(std::move(cb));
+		else iter->second.resync.reset();
+		return true;
+	} else {
+		return false;
+	}
+}
+
+bool Peer::enable_delta(const std::string_view &topic, std::size_t keyframe_interval) {
+	std::unique_lock _(_lock);
+	auto iter = _topic_map.find(topic);
+	if (iter != _topic_map.end() && !iter->second.sequenced) {
+		if (iter->second.delta == nullptr) iter->second.delta = std::make_unique<DeltaState>();
+		iter->second.delta->keyframe_interval = std::max<std::size_t>(keyframe_interval, 1);
+		return true;
+	} else {
+		return false;
+	}
+}
+
+bool Peer::enable_attachment_cache(std::size_t capacity) {
+	std::unique_lock _(_lock);
+	if (_dwnl_cache != nullptr || !is_connected()) return false;
+	_dwnl_cache = std::make_unique<AttachmentCache>(capacity);
+	send_message(PeerMsgType::attachment_cache, std::to_string(capacity));
+	return true;
+}
+
+bool Peer::enable_topic_batch() {
+	std::unique_lock _(_lock);
+	if (_topic_batch_announced || !is_connected()) return false;
+	_topic_batch_announced = true;
+	send_message(PeerMsgType::topic_batch, std::string_view());
+	return true;
+}
+
+bool Peer::on_topic_gap(const std::string_view &topic, TopicGapCallback &&cb) {
+	std::unique_lock _(_lock);
+	if (_subscr_map.find(topic) == _subscr_map.end()) return false;
+	auto iter = _subscr_seq.find(topic);
+	if (iter == _subscr_seq.end()) {
+		iter = _subscr_seq.try_emplace(std::string(topic)).first;
+	}
+	if (cb != nullptr) iter->second.gap = std::make_shared<TopicGapCallback>(std::move(cb));
+	else iter->second.gap.reset();
+	return true;
+}
+
+void Peer::request_resync(const std::string_view &topic) {
+	std::shared_lock _(_lock);
+	std::uint64_t last = 0;
+	auto iter = _subscr_seq.find(topic);
+	if (iter != _subscr_seq.end()) last = iter->second.last.load(std::memory_order_relaxed);
+	send_resync(topic, last);
+}
+
 void Peer::set_methods(const PMethodList &method_list) {
 	std::unique_lock _(_lock);
 	_methods = method_list;
+	std::atomic_store(&_snapshot_methods, PSnapshotMethodList());
+}
+
+void Peer::set_methods(const PSnapshotMethodList &method_list) {
+	std::unique_lock _(_lock);
+	_methods = PMethodList();
+	std::atomic_store(&_snapshot_methods, method_list);
 }
 
 void Peer::unsubscribe(const std::string_view &topic) {
@@ -120,6 +256,10 @@ void Peer::unsubscribe(const std::string_view &topic) {
 	if (iter != _subscr_map.end()) {
 		send_unsubscribe(topic);
 		_subscr_map.erase(iter);
+		auto siter = _subscr_seq.find(topic);
+		if (siter != _subscr_seq.end()) _subscr_seq.erase(siter);
+		auto diter = _subscr_delta.find(topic);
+		if (diter != _subscr_delta.end()) _subscr_delta.erase(diter);
 	}
 }
 
@@ -159,7 +299,7 @@ void Peer::on_unsubscribe(const std::string_view &topic_id) {
 	std::unique_lock _(_lock);
 	auto iter = _topic_map.find(topic_id);
 	if (iter != _topic_map.end()) {
-		UnsubscribeRequest req = std::move(iter->second);
+		UnsubscribeRequest req = std::move(iter->second.unsub);
 		_topic_map.erase(iter);
 		_.unlock();
 		if (req != nullptr) req();
@@ -170,6 +310,7 @@ bool Peer::on_topic_update(const std::string_view &topic_id, const Payload &data
 	std::shared_lock _(_lock);
 	auto iter = _subscr_map.find(topic_id);
 	if (iter != _subscr_map.end()) {
+		TraceScope _trc(TracePoint::dispatch, static_cast<char>(PeerMsgType::topic_update), topic_id, data.size());
 		bool unsub = !iter->second(data);
 		if (unsub) {
 			_.unlock();
@@ -180,20 +321,135 @@ bool Peer::on_topic_update(const std::string_view &topic_id, const Payload &data
 	return false;
 }
 
+bool Peer::on_topic_update_seq(const std::string_view &topic_id, std::string_view data, AttachList &&alist) {
+	std::string_view seqstr = userver::splitAt("\n", data);
+	std::uint64_t seq = 0;
+	if (std::from_chars(seqstr.data(), seqstr.data()+seqstr.size(), seq, 10).ec != std::errc()) return false;
+	std::shared_ptr<TopicGapCallback> gap;
+	std::uint64_t last = 0;
+	{
+		std::shared_lock _(_lock);
+		auto iter = _subscr_seq.find(topic_id);
+		if (iter != _subscr_seq.end()) {
+			SubscribedSeq &ss = iter->second;
+			last = ss.last.exchange(seq, std::memory_order_relaxed);
+			if (last && seq != last+1) gap = ss.gap;
+		}
+	}
+	//the callback can unsubscribe or replace itself, it is called without the lock
+	if (gap != nullptr && (*gap)(last+1, seq)) {
+		std::shared_lock _(_lock);
+		if (_subscr_map.find(topic_id) != _subscr_map.end()) send_resync(topic_id, last);
+	}
+	on_topic_update(topic_id, Payload(data, alist));
+	return true;
+}
+
+bool Peer::on_topic_delta(const std::string_view &topic_id, std::string_view data, AttachList &&alist) {
+	std::string_view hdr = userver::splitAt("\n", data);
+	std::shared_ptr<const std::string> value;
+	if (hdr == "K") {
+		value = std::make_shared<const std::string>(data);
+	} else {
+		std::size_t base_size = 0;
+		if (std::from_chars(hdr.data(), hdr.data()+hdr.size(), base_size, 10).ec != std::errc()) return false;
+		std::shared_ptr<const std::string> base;
+		{
+			std::shared_lock _(_lock);
+			//update can arrive after unsubscribe
+			if (_subscr_map.find(topic_id) == _subscr_map.end()) return true;
+			auto iter = _subscr_delta.find(topic_id);
+			if (iter != _subscr_delta.end()) base = iter->second;
+		}
+		if (base == nullptr || base->size() != base_size) {
+			//base is lost (update arrived before the keyframe, or the subscription was renewed)
+			//drop updates until the next keyframe, ask the publisher for one once
+			std::unique_lock _(_lock);
+			if (_subscr_map.find(topic_id) == _subscr_map.end()) return true;
+			auto iter = _subscr_delta.find(topic_id);
+			if (iter == _subscr_delta.end()) {
+				_subscr_delta.emplace(std::string(topic_id), nullptr);
+				send_resync(topic_id, 0);
+			} else if (iter->second != nullptr) {
+				iter->second = nullptr;
+				send_resync(topic_id, 0);
+			}
+			return true;
+		}
+		std::string out;
+		out.reserve(base_size);
+		if (!TopicDelta::apply(*base, data, out)) return false;
+		value = std::make_shared<const std::string>(std::move(out));
+	}
+	{
+		std::unique_lock _(_lock);
+		if (_subscr_map.find(topic_id) == _subscr_map.end()) return true;
+		auto iter = _subscr_delta.find(topic_id);
+		if (iter == _subscr_delta.end()) _subscr_delta.emplace(std::string(topic_id), value);
+		else iter->second = value;
+	}
+	on_topic_update(topic_id, Payload(std::string_view(*value), alist));
+	return true;
+}
+
+void Peer::on_resync(const std::string_view &topic_id, const std::string_view &last_seq) {
+	std::shared_ptr<ResyncRequest> cb;
+	{
+		std::shared_lock _(_lock);
+		auto iter = _topic_map.find(topic_id);
+		if (iter != _topic_map.end()) {
+			cb = iter->second.resync;
+			if (iter->second.delta != nullptr) {
+				//subscriber lost the base, next update is sent as keyframe
+				std::lock_guard _(iter->second.delta->mx);
+				iter->second.delta->has_base = false;
+			}
+		}
+	}
+	if (cb != nullptr) {
+		std::uint64_t last = 0;
+		std::from_chars(last_seq.data(), last_seq.data()+last_seq.size(), last, 10);
+		//the handler can keep the callback and send the updates later
+		TopicUpdateCallback send = [me = weak_from_this(), topic = std::string(topic_id)](const Payload &data) {
+			auto melk = me.lock();
+			if (melk == nullptr) return false;
+			std::shared_lock _(melk->_lock);
+			auto iter = melk->_topic_map.find(topic);
+			if (iter == melk->_topic_map.end()) return false;
+			std::uint64_t seq = iter->second.seq.fetch_add(1, std::memory_order_relaxed)+1;
+			return melk->send_topic_update(topic, data, HighWaterMarkBehavior::ignore,
+					std::numeric_limits<std::size_t>::max(), seq, iter->second.delta.get());
+		};
+		(*cb)(last, send);
+	}
+}
+
 bool Peer::on_method_call(const std::string_view &id, const std::string_view &method, const Payload &args) {
-    if (_methods != nullptr) {
-        auto mlk = _methods.lock_shared();
-        std::string strm(method);
-        const MethodCall *m = mlk->find_method(strm);
-        if (m) {
-            (*m)(Request(weak_from_this(),id,strm,args));
-            return true;
+    return with_methods([&](const MethodList *mlk) {
+        if (mlk != nullptr) {
+#ifdef UMQ_ENABLE_METRICS
+            std::string_view matched;
+            const MethodCall *m = mlk->find_method(method, &matched);
+            if (m) {
+                Request req(weak_from_this(),id,method,args);
+                req.start_latency(PeerMetrics::method(matched));
+                TraceScope _trc(TracePoint::dispatch, static_cast<char>(PeerMsgType::method_call), id, args.size());
+                (*m)(std::move(req));
+                return true;
+#else
+            const MethodCall *m = mlk->find_method(method);
+            if (m) {
+                TraceScope _trc(TracePoint::dispatch, static_cast<char>(PeerMsgType::method_call), id, args.size());
+                (*m)(Request(weak_from_this(),id,method,args));
+                return true;
+#endif
+            } else {
+                return false;
+            }
         } else {
             return false;
         }
-    } else {
-        return false;
-    }
+    });
 
 }
 
@@ -205,7 +461,18 @@ bool Peer::on_binary_message(const MsgFrame &msg) {
 	if (!_dwnl_attachments.empty()) {
 		Attachment a = _dwnl_attachments.front();
 		_dwnl_attachments.pop();
-		(*a) = std::string(msg.data);
+		if (!_dwnl_cache_store.empty()) {
+			auto content = std::make_shared<const std::string>(msg.data);
+			{
+				//the cache is modified, the shared lock is not enough
+				std::unique_lock _(_lock);
+				if (_dwnl_cache) _dwnl_cache->store(_dwnl_cache_store, content->size(), content);
+			}
+			_dwnl_cache_store.clear();
+			(*a) = std::string(*content);
+		} else {
+			(*a) = std::string(msg.data);
+		}
 		return true;
 	} else {
 		return false;
@@ -223,6 +490,41 @@ bool Peer::on_attachment_error(const std::string_view &msg) {
 	}
 }
 
+bool Peer::on_attachment_cached(const std::string_view &hash, const std::string_view &mode) {
+	if (hash.empty()) return false;
+	if (mode == "+") {
+		//next binary frame is stored
+		if (!_dwnl_cache_store.empty()) return false;
+		_dwnl_cache_store = hash;
+		return true;
+	}
+	if (!mode.empty() || _dwnl_attachments.empty()) return false;
+	Attachment a = _dwnl_attachments.front();
+	_dwnl_attachments.pop();
+	AttachmentCache::Content content;
+	bool found;
+	{
+		//find() also updates the order of the items
+		std::unique_lock _(_lock);
+		found = _dwnl_cache && _dwnl_cache->find(hash, &content);
+	}
+	if (found) {
+		(*a) = std::string(*content);
+	} else {
+		(*a) = std::make_exception_ptr(std::runtime_error("Attachment is not in the cache"));
+	}
+	return true;
+}
+
+bool Peer::on_attachment_cache(const std::string_view &capacity) {
+	std::size_t cap = 0;
+	if (std::from_chars(capacity.data(), capacity.data()+capacity.size(), cap, 10).ec != std::errc()) return false;
+	std::unique_lock _(_lock);
+	//the mirror must follow the cache since its creation, so the first announcement wins
+	if (_upld_cache == nullptr) _upld_cache = std::make_unique<AttachmentCache>(cap);
+	return true;
+}
+
 void Peer::on_unset_var(const std::string_view &variable) {
 	remote.set(variable, {});
 }
@@ -231,13 +533,94 @@ void Peer::on_set_var(const std::string_view &variable, const std::string_view &
 	remote.set(variable, std::optional<std::string>(data));
 }
 
+bool Peer::on_var_batch(const std::string_view &count, std::string_view data) {
+	std::size_t cnt = 0;
+	if (std::from_chars(count.data(), count.data()+count.size(), cnt, 10).ec != std::errc()) return false;
+	//parse whole message first, changes are applied only when message is valid
+	std::vector<std::pair<std::string_view, std::optional<std::string_view> > > changes;
+	changes.reserve(std::min<std::size_t>(cnt, data.size()/2));
+	while (!data.empty()) {
+		char t = data[0];
+		data = data.substr(1);
+		std::string_view name = userver::splitAt("\n", data);
+		if (t == static_cast<char>(PeerMsgType::var_unset)) {
+			changes.emplace_back(name, std::nullopt);
+		} else if (t == static_cast<char>(PeerMsgType::var_set)) {
+			std::string_view szstr = userver::splitAt("\n", data);
+			std::size_t sz = 0;
+			if (std::from_chars(szstr.data(), szstr.data()+szstr.size(), sz, 10).ec != std::errc()
+					|| sz > data.size()) return false;
+			changes.emplace_back(name, data.substr(0, sz));
+			data = data.substr(sz);
+		} else {
+			return false;
+		}
+	}
+	if (changes.size() != cnt) return false;
+	std::unique_lock _(_lock);
+	for (const auto &[name, value]: changes) {
+		if (value.has_value()) {
+			auto iter = remote._vars.find(name);
+			if (iter == remote._vars.end()) remote._vars.emplace(std::string(name), std::string(*value));
+			else iter->second.assign(value->begin(), value->end());
+		} else {
+			auto iter = remote._vars.find(name);
+			if (iter != remote._vars.end()) remote._vars.erase(iter);
+		}
+	}
+	return true;
+}
+
+bool Peer::on_topic_batch(const std::string_view &count, std::string_view data) {
+	if (count.empty() && data.empty()) {
+		//the other side accepts batches
+		_topic_batch_accepted.store(true, std::memory_order_relaxed);
+		return true;
+	}
+	std::size_t cnt = 0;
+	if (std::from_chars(count.data(), count.data()+count.size(), cnt, 10).ec != std::errc()) return false;
+	//parse whole message first, updates are processed only when message is valid
+	std::vector<std::tuple<char, std::string_view, std::string_view> > updates;
+	updates.reserve(std::min<std::size_t>(cnt, data.size()/4));
+	while (!data.empty()) {
+		char t = data[0];
+		if (t != static_cast<char>(PeerMsgType::topic_update)
+				&& t != static_cast<char>(PeerMsgType::topic_update_seq)) return false;
+		data = data.substr(1);
+		std::string_view topic = userver::splitAt("\n", data);
+		std::string_view szstr = userver::splitAt("\n", data);
+		std::size_t sz = 0;
+		if (std::from_chars(szstr.data(), szstr.data()+szstr.size(), sz, 10).ec != std::errc()
+				|| sz > data.size()) return false;
+		updates.emplace_back(t, topic, data.substr(0, sz));
+		data = data.substr(sz);
+	}
+	if (updates.size() != cnt) return false;
+	bool ok = true;
+	for (const auto &[t, topic, body]: updates) {
+		if (t == static_cast<char>(PeerMsgType::topic_update)) {
+			on_topic_update(topic, Payload(body, {}));
+		} else {
+			ok = on_topic_update_seq(topic, body, {}) && ok;
+		}
+	}
+	return ok;
+}
+
 void Peer::finish_call(const std::string_view &id, Response &&response) {
 	std::unique_lock _(_lock);
-	auto iter = _call_map.find(std::string(id));
+	auto iter = _call_map.find(id);
 	if (iter != _call_map.end()) {
 		ResponseCallback cb = std::move(iter->second);
 		_call_map.erase(iter);
+		std::vector<CallWindowCallback> waiters;
+		if (_max_inflight) {
+			send_queued_calls();
+			waiters = collect_window_waiters();
+		}
 		_.unlock();
+		for (auto &w: waiters) w();
+		TraceScope _trc(TracePoint::dispatch, static_cast<char>(PeerMsgType::result), id, response.get_data().size());
 		cb(std::move(response));
 	}
 }
@@ -250,6 +633,7 @@ bool Peer::on_callback(const std::string_view &id, const std::string_view &name,
         auto cb = std::move(iter->second);
         _cb_map.erase(iter);
         _.unlock();
+        TraceScope _trc(TracePoint::dispatch, static_cast<char>(PeerMsgType::callback), id, args.size());
         cb(Request(weak_from_this(), id, name, args));
         return true;
     } else {
@@ -290,36 +674,105 @@ void Peer::call_callback(const std::string_view &name, const std::string_view &a
 }
 
 void Peer::run_upload() {
-	while (!_upld_attachments.empty()) {
-		bool done = false;
-		(*_upld_attachments.front()) >> [me = weak_from_this(), &done]
-					(const AttachContent &ctx, bool async){
-			auto melk = me.lock();
-			if (melk) {
-				try {
-					const std::string &data = ctx;
-					melk->send_message(MsgFrame{MsgFrameType::binary, data});
-				} catch (std::exception &e) {
-					melk->send_message(PeerMsgType::attachmentError, e.what());
-				}
-				if (async) {
-					std::lock_guard _(melk->_lock);
-					melk->_upld_attachments.pop();
-					melk->run_upload();
-				} else {
-					done = true;
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		//the protocol requires the order of the queue
+		while (!_upld_attachments.empty() && _upld_attachments.front().ready) {
+			UploadItem item = std::move(_upld_attachments.front());
+			_upld_attachments.pop_front();
+			--_upld_watched;
+			send_upload(item);
+		}
+		//watch following attachments, they can resolve in any order
+		while (_upld_watched < _upld_window && _upld_watched < _upld_attachments.size()) {
+			UploadItem &item = _upld_attachments[_upld_watched++];
+			if (FileAttachment::get(item.att)) {
+				item.resolved = std::chrono::steady_clock::now();
+				item.ready = true;
+				progress = true;
+				continue;
+			}
+			bool done = false;
+			//item is not removed from the queue until it is ready
+			(*item.att) >> [me = weak_from_this(), &item, &done]
+						(const AttachContent &, bool async){
+				auto melk = me.lock();
+				if (melk) {
+					if (async) {
+						std::lock_guard _(melk->_lock);
+						item.resolved = std::chrono::steady_clock::now();
+						item.ready = true;
+						melk->run_upload();
+					} else {
+						done = true;
+					}
 				}
+			};
+			if (done) {
+				item.resolved = std::chrono::steady_clock::now();
+				item.ready = true;
+				progress = true;
 			}
-		};
-		if (!done) break;
+		}
 	}
 }
 
+void Peer::send_upload(const UploadItem &item) {
+	try {
+		if (PFileAttachment file = FileAttachment::get(item.att)) {
+			send_file(file);
+		} else {
+			const std::string &data = *item.att;
+			send_attachment(data);
+		}
+	} catch (std::exception &e) {
+		//the message has no id, the error is in the data part
+		send_message(PeerMsgType::attachmentError, std::string_view(), Payload(e.what()));
+	}
+	_metrics.on_upload(item.queued, item.resolved);
+}
+
+void Peer::set_upload_window(std::size_t count) {
+	std::unique_lock _(_lock);
+	_upld_window = std::max<std::size_t>(count, 1);
+	run_upload();
+}
+
+std::size_t Peer::get_upload_window() const {
+	std::shared_lock _(_lock);
+	return _upld_window;
+}
+
+void Peer::send_attachment(const std::string &data) {
+	if (_upld_cache && data.size() >= attachment_cache_min_size) {
+		std::string hash = AttachmentCache::hash(data);
+		if (_upld_cache->find(hash)) {
+			send_message(PeerMsgType::attachment_cached, hash);
+			return;
+		}
+		//same operation is performed by the other side when the frame arrives
+		if (_upld_cache->store(hash, data.size(), nullptr)) {
+			send_message(PeerMsgType::attachment_cached, hash, Payload("+"));
+		}
+	}
+	send_message(MsgFrame{MsgFrameType::binary, data});
+}
+
+void Peer::send_file(const PFileAttachment &file) {
+	if (!_conn) return;
+	_metrics.on_send(MsgFrame{MsgFrameType::binary, std::string_view()}, file->get_size());
+	_conn->send_file(file);
+}
+
 void Peer::disconnect() {
     DisconnectEvent cb;
     Topics tpcs;
     CallMap clmp;
+    std::deque<QueuedCall> clq;
+    std::vector<CallWindowCallback> waiters;
     std::queue<Attachment> dwn;
+    Subscriptions subs;
 
 
     {
@@ -328,20 +781,32 @@ void Peer::disconnect() {
             _conn.reset();
             std::swap(cb, _discnt_cb);
             std::swap(tpcs, _topic_map);
+            std::swap(subs, _subscr_map);
+            _subscr_seq.clear();
+            _subscr_delta.clear();
+            std::swap(clmp, _call_map);
+            std::swap(clq, _call_queue);
+            std::swap(waiters, _window_waiters);
             std::swap(dwn, _dwnl_attachments);
         }
     }
 
     if (cb != nullptr) cb();
+    //subscribers are notified by destruction of their callbacks
+    subs.clear();
     for (const auto &x: tpcs) {
-        if (x.second!=nullptr) x.second();
+        if (x.second.unsub!=nullptr) x.second.unsub();
     }
     for (const auto &x: clmp) {
         if (x.second!=nullptr) x.second(Response(Response::Type::disconnected, Payload()));
     }
-	while (!_dwnl_attachments.empty()) {
-		Attachment a = _dwnl_attachments.front();
-		_dwnl_attachments.pop();
+    for (const auto &x: clq) {
+        if (x.result!=nullptr) x.result(Response(Response::Type::disconnected, Payload()));
+    }
+    for (auto &w: waiters) w();
+	while (!dwn.empty()) {
+		Attachment a = dwn.front();
+		dwn.pop();
 		(*a)=std::make_exception_ptr(std::runtime_error("-1 Peer disconnected"));
 	}
 
@@ -378,7 +843,9 @@ Peer::~Peer() {
 
 
 void Peer::parse_message(const MsgFrame &msg) {
+    _metrics.on_recv(msg);
     if (msg.type == MsgFrameType::binary) {
+        TraceScope _trc(TracePoint::parse, 0, std::string_view(), msg.data.size());
         if (!on_binary_message(msg)) {
             send_node_error(PeerError::unexpectedBinaryFrame);
         }
@@ -392,6 +859,7 @@ void Peer::parse_text_message(std::string_view data, AttachList &&alist) {
 	if (!topic.empty()) {
 		char mt = topic[0];
 		std::string_view id = topic.substr(1);
+		TraceScope _trc(TracePoint::parse, mt, id, data.size());
 		try {
 			switch (static_cast<PeerMsgType>(mt)) {
 				default:
@@ -401,6 +869,14 @@ void Peer::parse_text_message(std::string_view data, AttachList &&alist) {
 					if (!on_attachment_error(data))
 						send_node_error(PeerError::unknownMessageType);
 					break;
+				case PeerMsgType::attachment_cached:
+					if (!on_attachment_cached(id, data))
+						send_node_error(PeerError::messageParseError);
+					break;
+				case PeerMsgType::attachment_cache:
+					if (!on_attachment_cache(id))
+						send_node_error(PeerError::messageParseError);
+					break;
 				case PeerMsgType::attachment: {
 						std::size_t cnt = 0;
 						if (std::from_chars(id.data(), id.data()+id.length(), cnt, 10).ec == std::errc()) {
@@ -456,6 +932,21 @@ void Peer::parse_text_message(std::string_view data, AttachList &&alist) {
 				case PeerMsgType::topic_update:
 					on_topic_update(id, Payload(data,alist));
 					break;
+				case PeerMsgType::topic_update_seq:
+					if (!on_topic_update_seq(id, data, std::move(alist)))
+						send_node_error(PeerError::messageParseError);
+					break;
+				case PeerMsgType::topic_delta:
+					if (!on_topic_delta(id, data, std::move(alist)))
+						send_node_error(PeerError::messageParseError);
+					break;
+				case PeerMsgType::topic_batch:
+					if (!on_topic_batch(id, data))
+						send_node_error(PeerError::messageParseError);
+					break;
+				case PeerMsgType::resync:
+					on_resync(id, data);
+					break;
 				case PeerMsgType::unsubscribe:
 					on_unsubscribe(id);
 					break;
@@ -468,6 +959,10 @@ void Peer::parse_text_message(std::string_view data, AttachList &&alist) {
 				case PeerMsgType::var_unset:
 					on_unset_var(id);
 					break;
+				case PeerMsgType::var_batch:
+					if (!on_var_batch(id, data))
+						send_node_error(PeerError::messageParseError);
+					break;
 				case PeerMsgType::hello:
 					if (id != version) {
 						send_node_error(PeerError::unsupportedVersion);
@@ -495,9 +990,10 @@ void Peer::parse_text_message(std::string_view data, AttachList &&alist) {
 
 
 bool Peer::send_topic_update(const std::string_view &topic_id,
-		const Payload &data, HighWaterMarkBehavior hwmb, std::size_t hwm_size) {
+		const Payload &data, HighWaterMarkBehavior hwmb, std::size_t hwm_size, std::uint64_t seq, DeltaState *delta) {
     if (!_conn) return false;
     if (_conn->is_hwm(hwm_size)) {
+        _metrics.on_hwm(hwmb);
         switch(hwmb) {
         case HighWaterMarkBehavior::block: _conn->flush();break;
         case HighWaterMarkBehavior::close: disconnect();break;
@@ -506,11 +1002,66 @@ bool Peer::send_topic_update(const std::string_view &topic_id,
         case HighWaterMarkBehavior::unsubscribe: send_topic_close(topic_id);return false;
         }
     }
-    send_message(PeerMsgType::topic_update, topic_id, data);
+    if (delta) {
+        if (TopicUpdateBatch::active()) TopicUpdateBatch::flush(*this);
+        send_topic_delta(topic_id, data, *delta);
+        return true;
+    }
+    //the peer receives batches only when it has announced it
+    if (TopicUpdateBatch::active() && _topic_batch_accepted.load(std::memory_order_relaxed)) {
+        if (data.attachments.empty()) {
+            TopicUpdateBatch::append(*this, seq?PeerMsgType::topic_update_seq:PeerMsgType::topic_update,
+                    topic_id, data, seq);
+            return true;
+        }
+        //updates with attachments are not batched, but must not overtake pending updates
+        TopicUpdateBatch::flush(*this);
+    }
+    if (seq) {
+        build_send_message(PeerMsgType::topic_update_seq, topic_id, [&](MsgBld &bld){
+            ondra_shared::unsignedToString(seq, [&](char c){
+                bld.push_back(c);
+            },10,1);
+            bld.push_back('\n');
+        }, data);
+    } else {
+        send_message(PeerMsgType::topic_update, topic_id, data);
+    }
     return true;
 }
 
+void Peer::send_topic_delta(const std::string_view &topic_id, const Payload &data, DeltaState &delta) {
+    //the lock keeps order of messages, every delta depends on the previous one
+    std::lock_guard _(delta.mx);
+    bool keyframe = !delta.has_base || delta.since_keyframe + 1 >= delta.keyframe_interval;
+    static thread_local std::string diff;
+    diff.clear();
+    if (!keyframe) {
+        TopicDelta::encode(delta.last, data, diff);
+        keyframe = diff.size() >= data.size();
+    }
+    if (keyframe) {
+        build_send_message(PeerMsgType::topic_delta, topic_id, [&](MsgBld &bld){
+            bld.push_back('K');
+            bld.push_back('\n');
+        }, data);
+        delta.since_keyframe = 0;
+    } else {
+        build_send_message(PeerMsgType::topic_delta, topic_id, [&](MsgBld &bld){
+            ondra_shared::unsignedToString(delta.last.size(), [&](char c){
+                bld.push_back(c);
+            },10,1);
+            bld.push_back('\n');
+        }, Payload(std::string_view(diff), data.attachments));
+        ++delta.since_keyframe;
+    }
+    delta.last.assign(data.begin(), data.end());
+    delta.has_base = true;
+}
+
 void Peer::send_topic_close(const std::string_view &topic_id) {
+    //the close must not overtake updates pending in the batch
+    if (TopicUpdateBatch::active()) TopicUpdateBatch::flush(*this);
     send_message(PeerMsgType::topic_close, topic_id);
 }
 
@@ -518,6 +1069,14 @@ void Peer::send_unsubscribe(const std::string_view &topic_id) {
     send_message(PeerMsgType::unsubscribe, topic_id);
 }
 
+void Peer::send_resync(const std::string_view &topic_id, std::uint64_t last_seq) {
+    build_send_message(PeerMsgType::resync, topic_id, [&](MsgBld &bld){
+        ondra_shared::unsignedToString(last_seq, [&](char c){
+            bld.push_back(c);
+        },10,1);
+    }, Payload());
+}
+
 void Peer::send_result(const std::string_view &id, const Payload &data) {
     send_message(PeerMsgType::result, id, data);
 }
@@ -557,15 +1116,120 @@ void Peer::send_var_set(const std::string_view &variable,const std::string_view
 void Peer::send_var_unset(const std::string_view &variable) {
     send_message(PeerMsgType::var_unset, variable);
 }
+
+void Peer::send_var_batch(const VarSpaceRO<std::string, std::equal_to<std::string> >::Changes &changes) {
+    std::string cnt = std::to_string(changes.size());
+    build_send_message(PeerMsgType::var_batch, cnt, [&](MsgBld &bld){
+        for (const auto &[name, value]: changes) {
+            if (value) {
+                bld.push_back(static_cast<char>(PeerMsgType::var_set));
+                bld.append(name.begin(), name.end());
+                bld.push_back('\n');
+                ondra_shared::unsignedToString(value->size(), [&](char c){
+                    bld.push_back(c);
+                },10,1);
+                bld.push_back('\n');
+                bld.append(value->begin(), value->end());
+            } else {
+                bld.push_back(static_cast<char>(PeerMsgType::var_unset));
+                bld.append(name.begin(), name.end());
+                bld.push_back('\n');
+            }
+        }
+    }, Payload());
+}
+void Peer::send_topic_batch(std::size_t count, const std::string_view &entries) {
+    MsgBld bld;
+    bld.push_back(static_cast<char>(PeerMsgType::topic_batch));
+    ondra_shared::unsignedToString(count, [&](char c){
+        bld.push_back(c);
+    },10,1);
+    bld.push_back('\n');
+    send_message(std::string_view(bld.data(), bld.size()), entries);
+}
+
+thread_local TopicUpdateBatch *TopicUpdateBatch::_cur = nullptr;
+
+TopicUpdateBatch::TopicUpdateBatch():_prev(_cur) {
+    if (_prev == nullptr) _cur = this;
+}
+
+TopicUpdateBatch::~TopicUpdateBatch() {
+    if (_cur != this) return;
+    //updates sent during flush are sent directly
+    _cur = nullptr;
+    for (auto &[p, pend]: _pending) {
+        if (!pend.count) continue;
+        std::shared_lock _(p->_lock);
+        p->send_topic_batch(pend.count, pend.entries);
+    }
+}
+
+void TopicUpdateBatch::append(Peer &peer, PeerMsgType type, const std::string_view &topic_id,
+        const std::string_view &data, std::uint64_t seq) {
+    Pending &pend = _cur->_pending[&peer];
+    if (pend.peer == nullptr) pend.peer = peer.shared_from_this();
+    std::string &e = pend.entries;
+    std::string seqstr;
+    if (seq) seqstr = std::to_string(seq).append("\n");
+    e.push_back(static_cast<char>(type));
+    e.append(topic_id);
+    e.push_back('\n');
+    e.append(std::to_string(seqstr.size() + data.size()));
+    e.push_back('\n');
+    e.append(seqstr);
+    e.append(data);
+    ++pend.count;
+}
+
+void TopicUpdateBatch::flush(Peer &peer) {
+    auto iter = _cur->_pending.find(&peer);
+    if (iter == _cur->_pending.end() || !iter->second.count) return;
+    peer.send_topic_batch(iter->second.count, iter->second.entries);
+    iter->second.entries.clear();
+    iter->second.count = 0;
+}
+
+thread_local SharedTopicValue *SharedTopicValue::_cur = nullptr;
+
+SharedTopicValue::SharedTopicValue(const SharedBody *values, std::size_t count)
+:_values(values),_count(count),_prev(_cur) {
+    _cur = this;
+}
+
+SharedTopicValue::~SharedTopicValue() {
+    _cur = _prev;
+}
+
+SharedBody SharedTopicValue::find(const std::string_view &data) {
+    if (data.empty()) return nullptr;
+    for (const SharedTopicValue *p = _cur; p; p = p->_prev) {
+        for (std::size_t i = 0; i < p->_count; i++) {
+            const SharedBody &v = p->_values[i];
+            if (v && v->data() == data.data() && v->size() == data.size()) return v;
+        }
+    }
+    return nullptr;
+}
+
 void Peer::send_callback_call(const std::string_view &id, const std::string_view &name, const Payload &args) {
     send_message(PeerMsgType::callback, id, name, args);
 }
 
 void Peer::send_message(const MsgFrame &msg) {
     if (!_conn) return;
+    _metrics.on_send(msg);
     _conn->send_message(msg);
 }
 
+void Peer::send_message(const std::string_view &header, const std::string_view &body) {
+    if (!_conn) return;
+    _metrics.on_send(MsgFrame{MsgFrameType::text, header}, body.size());
+    SharedBody shared = SharedTopicValue::find(body);
+    if (shared) _conn->send_message(MsgFrameType::text, header, shared);
+    else _conn->send_message(MsgFrameType::text, header, body);
+}
+
 
 void Peer::send_node_error(PeerError error) {
     std::unique_lock _(_lock);
@@ -595,6 +1259,16 @@ bool Peer::is_connected() const {
     return !!_conn;
 }
 
+PeerMetricsSnapshot Peer::get_metrics() const {
+    PeerMetricsSnapshot r = _metrics.get();
+    std::shared_lock _(_lock);
+    r.pending_calls = _call_map.size();
+    r.queued_calls = _call_queue.size();
+    r.queued_attachments = _upld_attachments.size();
+    r.pending_downloads = _dwnl_attachments.size();
+    return r;
+}
+
 
 
 void Peer::send_call(const std::string_view &id, const std::string_view &method, const Payload &params) {
@@ -622,65 +1296,86 @@ void Peer::send_discover(const std::string_view &id, const std::string_view &met
     send_message(PeerMsgType::discover, id, method_name);
 }
 
-
-
-bool Peer::on_discover(const std::string_view &id, const std::string_view &method_name) {
-    if (_methods != nullptr) {
-        auto mlk = _methods.lock_shared();
-        if (method_name.empty()) {
-            std::ostringstream buff;
-            for (const auto &x: mlk->methods) {
-                buff << "M" << x.first << "\n";
-            }
-            for (const auto &x: mlk->proxies) {
-                buff << "R" << x.first << "\n";
-            }
-            send_result(id, Payload(buff.str()));
-            return true;
-        } else {
-            std::string strm(method_name);
-            const std::string *doc = mlk->find_doc(strm);
-            if (doc) {
-                send_result(id, std::string_view("D"+*doc));
+void Peer::send_discover(const std::string_view &id, const std::string_view &method_name, std::size_t known_version) {
+    build_send_message(PeerMsgType::discover, id, [&](MsgBld &bld){
+        bld.append(method_name.begin(), method_name.end());
+        bld.push_back('\n');
+        ondra_shared::unsignedToString(known_version, [&](char c){
+            bld.push_back(c);
+        },10,1);
+    }, Payload());
+}
+
+
+
+bool Peer::on_discover(const std::string_view &id, const std::string_view &query) {
+    return with_methods([&](const MethodList *mlk) {
+        if (mlk != nullptr) {
+            std::string_view known_version = query;
+            std::string_view method_name = userver::splitAt("\n", known_version);
+            if (method_name.empty()) {
+                std::size_t kv = 0;
+                if (!known_version.empty()
+                        && std::from_chars(known_version.data(), known_version.data()+known_version.size(), kv, 10).ec == std::errc()
+                        && kv == mlk->get_version()) {
+                    build_send_message(PeerMsgType::result, id, [&](MsgBld &bld){
+                        bld.push_back('=');
+                        bld.append(known_version.begin(), known_version.end());
+                        bld.push_back('\n');
+                    }, Payload());
+                } else {
+                    send_result(id, Payload(mlk->get_discover_listing()));
+                }
                 return true;
             } else {
-                const DiscoverCall *m = mlk->find_route_discover(strm);
-                if (m) {
-                    (*m)(DiscoverRequest(weak_from_this(), [me=weak_from_this(), id = std::string(id)](const DiscoverResponse &resp){
-                        auto lkme = me.lock();
-                        if (lkme != nullptr) {
-                            if (!resp.error.empty()) {
-                                lkme->send_exception(id, std::string_view(resp.error));
-                            } else {
-                                std::ostringstream buff;
-                                if (!resp.isdoc) {
-                                    for (const auto &x: resp.methods) {
-                                        buff << "M" << x << "\n";
-                                    }
-                                    for (const auto &x: resp.routes) {
-                                        buff << "R" << x << "\n";
-                                    }                                
+                const std::string *doc = mlk->find_doc(method_name);
+                if (doc) {
+                    build_send_message(PeerMsgType::result, id, [](MsgBld &bld){
+                        bld.push_back('D');
+                    }, Payload(*doc));
+                    return true;
+                } else {
+                    const DiscoverCall *m = mlk->find_route_discover(method_name);
+                    if (m) {
+                        (*m)(DiscoverRequest(weak_from_this(), [me=weak_from_this(), id = std::string(id)](const DiscoverResponse &resp){
+                            auto lkme = me.lock();
+                            if (lkme != nullptr) {
+                                if (!resp.error.empty()) {
+                                    lkme->send_exception(id, std::string_view(resp.error));
                                 } else {
-                                    buff << "D" << resp.doc;
+                                    std::ostringstream buff;
+                                    if (!resp.isdoc) {
+                                        for (const auto &x: resp.methods) {
+                                            buff << "M" << x << "\n";
+                                        }
+                                        for (const auto &x: resp.routes) {
+                                            buff << "R" << x << "\n";
+                                        }                                
+                                    } else {
+                                        buff << "D" << resp.doc;
+                                    }
+                                    lkme->send_result(id, std::string_view(buff.str()));
                                 }
-                                lkme->send_result(id, std::string_view(buff.str()));
                             }
-                        }
-                    }, id, strm));                    
-                    return true;
-                } else {
-                    return false;
+                        }, id, method_name));                    
+                        return true;
+                    } else {
+                        return false;
+                    }
                 }
             }
+        } else {
+            send_result(id, "");
+            return true;
         }
-    } else {
-        send_result(id, "");
-        return true;
-    }
-
+    });
 }
 
 void Peer::discover(const std::string_view &query, DiscoverCallback  &&cb) {
+    discover(query, 0, std::move(cb));
+}
+
+void Peer::discover(const std::string_view &query, std::size_t known_version, DiscoverCallback  &&cb) {
     std::unique_lock _(_lock);
     if (!is_connected()) {
         DiscoverResponse r;
@@ -705,6 +1400,10 @@ void Peer::discover(const std::string_view &query, DiscoverCallback  &&cb) {
                     switch(line[0]) {
                         case 'M': r.methods.push_back(std::string(line.substr(1))); break;
                         case 'R': r.routes.push_back(std::string(line.substr(1))); break;
+                        case '=': r.unchanged = true;
+                                  [[fallthrough]];
+                        case 'V': std::from_chars(line.data()+1, line.data()+line.size(), r.version, 10);
+                                  break;
                         default: break;
                     }
                 } else {
@@ -716,14 +1415,28 @@ void Peer::discover(const std::string_view &query, DiscoverCallback  &&cb) {
         }
         cb(r);
     };
-    send_discover(idstr, query);
+    if (known_version) {
+        send_discover(idstr, query, known_version);
+    } else {
+        send_discover(idstr, query);
+    }
 }
 
 void Peer::syncVar(const std::string_view &var, const std::optional<std::string> &value) {
 	if (value.has_value()) {
-		send_var_unset(var);
-	} else {
 		send_var_set(var, *value);
+	} else {
+		send_var_unset(var);
+	}
+}
+
+void Peer::syncVars(const VarSpaceRO<std::string, std::equal_to<std::string> >::Changes &changes) {
+	if (changes.size() == 1) {
+		const auto &[name, value] = changes[0];
+		if (value) send_var_set(name, *value);
+		else send_var_unset(name);
+	} else if (!changes.empty()) {
+		send_var_batch(changes);
 	}
 }
 
@@ -771,37 +1484,90 @@ inline typename Peer::VarSpaceRO<T, Cmp>::Map Peer::VarSpaceRO<T, Cmp>::get() {
 
 template<typename T, typename Cmp>
 inline void Peer::VarSpaceRO<T, Cmp>::merge(const Map &other) {
+	std::unique_lock _(lock());
+	Changes changes;
+	changes.reserve(other.size());
+	Cmp cmp;
 	for (const auto &x: other) {
-		set(x.first, x.second);
+		auto iter = _vars.find(x.first);
+		if (iter == _vars.end() || !cmp(iter->second, x.second)) {
+			changes.emplace_back(x.first, &x.second);
+		}
 	}
+	commit(changes);
 }
 
 template<typename T, typename Cmp>
 inline void Peer::VarSpaceRO<T, Cmp>::set(const Map &other) {
-	if (_upfn) {
-		{
-			std::unique_lock _(lock());
-			auto iter = _vars.begin();
-			while (iter != _vars.end()) {
-				if (other.find(iter->first) == other.end()) {
-					(_owner.*_upfn)(iter->first, {});
-					iter = _vars.erase(iter);
-				} else {
-					++iter;
-				}
+	std::unique_lock _(lock());
+	if (_upfn || _batchfn) {
+		Changes changes;
+		changes.reserve(other.size());
+		Cmp cmp;
+		for (const auto &x: _vars) {
+			if (other.find(x.first) == other.end()) {
+				changes.emplace_back(x.first, nullptr);
 			}
 		}
-		merge(other);
+		for (const auto &x: other) {
+			auto iter = _vars.find(x.first);
+			if (iter == _vars.end() || !cmp(iter->second, x.second)) {
+				changes.emplace_back(x.first, &x.second);
+			}
+		}
+		commit(changes);
 	} else {
-		std::unique_lock _(lock());
 		_vars = other;
 	}
 }
 
 template<typename T, typename Cmp>
-inline Peer::VarSpaceRO<T, Cmp>::VarSpaceRO(Peer &owner, UpdateFn upfn)
+inline void Peer::VarSpaceRO<T, Cmp>::update(const ChangeMap &other) {
+	std::unique_lock _(lock());
+	Changes changes;
+	changes.reserve(other.size());
+	Cmp cmp;
+	for (const auto &x: other) {
+		auto iter = _vars.find(x.first);
+		if (x.second.has_value()) {
+			if (iter == _vars.end() || !cmp(iter->second, *x.second)) {
+				changes.emplace_back(x.first, &(*x.second));
+			}
+		} else if (iter != _vars.end()) {
+			changes.emplace_back(x.first, nullptr);
+		}
+	}
+	commit(changes);
+}
+
+template<typename T, typename Cmp>
+inline void Peer::VarSpaceRO<T, Cmp>::commit(const Changes &changes) {
+	if (changes.empty()) return;
+	//names of deleted variables refer to _vars, so synchronize before the change
+	if (_batchfn) {
+		(_owner.*_batchfn)(changes);
+	} else if (_upfn) {
+		for (const auto &[name, value]: changes) {
+			(_owner.*_upfn)(name, value?std::optional<T>(*value):std::optional<T>());
+		}
+	}
+	for (const auto &[name, value]: changes) {
+		if (value) {
+			auto iter = _vars.find(name);
+			if (iter == _vars.end()) _vars.emplace(std::string(name), *value);
+			else iter->second = *value;
+		} else {
+			auto iter = _vars.find(name);
+			if (iter != _vars.end()) _vars.erase(iter);
+		}
+	}
+}
+
+template<typename T, typename Cmp>
+inline Peer::VarSpaceRO<T, Cmp>::VarSpaceRO(Peer &owner, UpdateFn upfn, BatchUpdateFn batchfn)
 :_owner(owner)
 ,_upfn(upfn)
+,_batchfn(batchfn)
 {
 
 }
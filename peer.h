@@ -9,10 +9,13 @@
 #define LIB_UMQ_NODE_H_32130djwoeijd08923jdeioew
 
 #include "peer.h"
+#include "attachcache.h"
 #include "message.h"
 #include "connection.h"
 #include "methodlist.h"
 #include "payload.h"
+#include "metrics.h"
+#include "tracing.h"
 #include <shared/callback.h>
 #include <shared/svo_vector.h>
 #include <shared/toString.h>
@@ -20,9 +23,13 @@
 #include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <any>
+#include <atomic>
+#include <chrono>
 #include <queue>
+#include <unordered_map>
 
 namespace umq {
 
@@ -76,6 +83,11 @@ enum class PeerMsgType: char {
     /** Cid args - request to callback method - response is R or E (or ?) */
     callback = 'C',
 
+    ///Update of a topic encoded as difference against previous update
+    /** Dtopic K data - keyframe (full value)
+     *  Dtopic base_size delta - see TopicDelta */
+    topic_delta = 'D',
+
     ///Exception caused by a method (C or M)
     /** Eid msg - contains exception message     */
     exception = 'E',
@@ -84,14 +96,39 @@ enum class PeerMsgType: char {
     /**Hversion data */
     hello = 'H',
 
+    ///Attachment taken from the attachment cache of the receiver
+    /** Khash - counted as attachment, content is taken from the cache
+     *  Khash + - counted as nothing, next binary frame is the attachment, which is
+     *  also stored in the cache (see AttachmentCache) */
+    attachment_cached = 'K',
+
+    ///Announces the attachment cache
+    /** Lcapacity - sender of this message stores received attachments in the
+     * cache of given capacity (bytes). The other side can use PeerMsgType::attachment_cached */
+    attachment_cache = 'L',
+
     ///Method call - send request - response is R or E (or ?) */
     /** Mid method_name args */
     method_call = 'M',
 
+    ///Multiple topic updates in single message
+    /** Pcount (Ttopic size data | Qtopic size seq data)... - size is length of the
+     * rest of the entry in bytes. Entries are processed in order.
+     * P without count and data - subscriber accepts batches */
+    topic_batch = 'P',
+
+    ///Update of a topic with sequence number
+    /** Qtopic seq data */
+    topic_update_seq = 'Q',
+
     ///Result of successful call
     /** Rid data */
     result = 'R',
 
+    ///Sets and unsets several variables at once
+    /** Bcount (Svar size value | Xvar)... - size is length of the value in bytes*/
+    var_batch = 'B',
+
     ///Sets value on the other side
     /** Svar value */
     var_set = 'S',
@@ -112,6 +149,10 @@ enum class PeerMsgType: char {
     /** Xvar */
     var_unset = 'X',
 
+    ///Resync request - sent by subscriber, which detected missing updates
+    /** Ytopic last_seq */
+    resync = 'Y',
+
     ///Close the topic - sent by publisher information to subscriber that topic has been closed
     /** Ztopic */
     topic_close = 'Z'
@@ -126,6 +167,16 @@ using HelloRequest = ondra_shared::Callback<void(const Payload &, WelcomeRespons
 using UnsubscribeRequest = ondra_shared::Callback<void()>;
 ///called when node disconnects, before it is destroyed
 using DisconnectEvent = ondra_shared::Callback<void()>;
+///called when there is free space in the call window
+using CallWindowCallback = ondra_shared::Callback<void()>;
+///Called when subscriber detects missing topic updates. Return true to request resync
+using TopicGapCallback = ondra_shared::Callback<bool(std::uint64_t expected, std::uint64_t received)>;
+///Called on publisher when subscriber requests resync
+/**
+ * @param last_seq last sequence number received by the subscriber (0 if unknown)
+ * @param send function which sends update of the topic to this subscriber only
+ */
+using ResyncRequest = ondra_shared::Callback<void(std::uint64_t last_seq, TopicUpdateCallback &send)>;
 ///Helper class which returns false for every compare request
 template<typename T> struct NullCmp { bool operator()(const T &a, const T &b)const {return false;} };
 
@@ -196,6 +247,18 @@ public:
      */
     void discover(const std::string_view &query, DiscoverCallback  &&cb);
 
+    ///Discover services of the peer, skip unchanged listing
+    /**
+     * @param query discover query. Can be either empty, or contain name of method,
+     *   name of proxy to discover.
+     * @param known_version version of the listing already known to the caller
+     *   (DiscoverResponse::version). If the listing was not changed, the
+     *   response has flag unchanged set and contains no methods and routes. Use 0
+     *   to always receive full listing
+     * @param cb function called when result arrives
+     */
+    void discover(const std::string_view &query, std::size_t known_version, DiscoverCallback  &&cb);
+
     ///Perform RPC call
     /**
      *
@@ -205,6 +268,38 @@ public:
      */
     void call(const std::string_view &method, const Payload &params, ResponseCallback &&result);
 
+    ///Limits count of calls in flight
+    /**
+     * When count of pending requests reaches the limit, further calls
+     * are queued locally and sent once a response arrives. When the queue is
+     * full, the call is immediately finished with Response::Type::rejected
+     *
+     * @param max_inflight maximum count of pending requests. Set 0 for no limit (default)
+     * @param max_queued maximum count of locally queued calls
+     *
+     * @note calls of callbacks and discover requests are counted as pending
+     * requests too, but they are never queued or rejected
+     */
+    void set_call_window(std::size_t max_inflight, std::size_t max_queued = 0);
+
+    ///Determines, whether there is free space in the call window
+    /**
+     * @retval true next call will be sent immediately
+     * @retval false next call will be queued or rejected
+     */
+    bool has_call_window() const;
+
+    ///Waits for free space in the call window
+    /**
+     * Allows the producer to throttle itself. The callback is called
+     * once there is free space in the window (and the local queue is empty). If
+     * there is free space now, the callback is called immediately. The callback
+     * is also called when the peer is disconnected
+     *
+     * @param cb callback
+     */
+    void wait_call_window(CallWindowCallback &&cb);
+
     ///Subscribes given topic
     /** Doesn't perform actual subscription, it only prepares
      * the peer object to receive a process given subscription. The actual
@@ -215,6 +310,9 @@ public:
      * topic could be already processed and without proper registration
      * it is rejected.
      *
+     * The callback is destroyed when the topic is closed, unsubscribed, or
+     * when the peer is disconnected.
+     *
      * @param topic topic to register
      * @param cb callback function called for the topic update
      */
@@ -240,6 +338,21 @@ public:
      */
     TopicUpdateCallback start_publish(const std::string_view &topic, HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip, std::size_t hwm_per_cent = 100);
 
+    ///Initiates publishing with limited rate of updates
+    /**
+     * Same as start_publish(), but the subscriber receives at most one update per interval.
+     * Updates arriving sooner are conflated, only the newest one is sent when the interval
+     * expires. See UpdateThrottle
+     *
+     * @param topic topic to be published
+     * @param min_interval minimum interval between two updates
+     * @param hwmb defines behaviour for high water mark signal.
+     * @param hwm_per_cent modifies high water mark level by specified percent.
+     * @return function to call to publish the update for this node.
+     */
+    TopicUpdateCallback start_publish(const std::string_view &topic, std::chrono::milliseconds min_interval,
+            HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip, std::size_t hwm_per_cent = 100);
+
 
     ///Specifies callback function when unsubscribe is requested
     /**
@@ -250,6 +363,101 @@ public:
      */
     bool on_unsubscribe(const std::string_view &topic, UnsubscribeRequest &&cb);
 
+    ///Enables sequence numbers for published topic
+    /**
+     * Every update of the topic carries sequence number, which is increased
+     * for every update, including updates skipped due high water mark. This
+     * allows to subscriber to detect missing updates.
+     *
+     * @param topic topic name (must be started by start_publish())
+     * @param cb function called when subscriber requests resync. The function
+     * should send complete state of the topic using the send function
+     * passed as argument. Can be nullptr
+     * @retval true enabled
+     * @retval false topic is not registered, already unsubscribed, peer is down,
+     * or the topic is delta encoded (see enable_delta())
+     */
+    bool enable_sequence(const std::string_view &topic, ResyncRequest &&cb);
+
+    ///Enables delta encoding for published topic
+    /**
+     * Updates of the topic are sent as difference against the previous update
+     * sent to this peer (see TopicDelta). Full value (keyframe) is sent as the
+     * first update, then periodically, and when the difference is not smaller
+     * than the value. The subscriber rebuilds full value before the callback is
+     * called.
+     *
+     * Updates of such topic don't carry sequence numbers and they are not packed
+     * by TopicUpdateBatch, so delta encoding can't be enabled on a sequenced topic.
+     * When the subscriber has no base for a delta, it drops updates until
+     * the next keyframe and requests one by the resync message.
+     *
+     * @param topic topic name (must be started by start_publish())
+     * @param keyframe_interval count of updates between two keyframes
+     * @retval true enabled
+     * @retval false topic is not registered, already unsubscribed, peer is down,
+     * or the topic is sequenced (see enable_sequence())
+     *
+     * @note the other side must support PeerMsgType::topic_delta
+     */
+    bool enable_delta(const std::string_view &topic, std::size_t keyframe_interval = 100);
+
+    ///Enables cache of received attachments
+    /**
+     * The other side is informed about the cache. When it sends an attachment,
+     * which has been already sent on this connection and which is still in the
+     * cache, it sends only hash of the content and the attachment is resolved
+     * from the cache. Attachments smaller than attachment_cache_min_size are
+     * not cached.
+     *
+     * Cache is least recently used, limited by total size of the attachments.
+     * It is held until the peer is destroyed
+     *
+     * @param capacity capacity of the cache in bytes
+     * @retval true enabled
+     * @retval false already enabled (capacity can't be changed), or peer is down
+     *
+     * @note the other side must support PeerMsgType::attachment_cache
+     */
+    bool enable_attachment_cache(std::size_t capacity);
+
+    ///Attachments smaller than this size are always sent in full
+    static constexpr std::size_t attachment_cache_min_size = 256;
+
+    ///Announces that this peer accepts batched topic updates
+    /**
+     * Until the announcement arrives, the other side sends every topic update
+     * as a separate message, even if it is published within TopicUpdateBatch.
+     *
+     * @retval true announced
+     * @retval false already announced, or peer is down
+     *
+     * @note the other side must support PeerMsgType::topic_batch
+     */
+    bool enable_topic_batch();
+
+    ///Sets callback called when subscriber detects missing updates
+    /**
+     * Works only if the publisher has enabled sequence numbers for the topic
+     *
+     * @param topic subscribed topic
+     * @param cb callback function. The function receives expected and received
+     * sequence number. If the function returns true, the resync request is sent
+     * to the publisher
+     * @retval true registered
+     * @retval false topic is not subscribed
+     */
+    bool on_topic_gap(const std::string_view &topic, TopicGapCallback &&cb);
+
+    ///Requests resync of the topic
+    /**
+     * Sends resync request to the publisher. The publisher should respond
+     * by publishing complete state of the topic
+     *
+     * @param topic subscribed topic
+     */
+    void request_resync(const std::string_view &topic);
+
 
     ///Sets method list
     /**
@@ -261,6 +469,15 @@ public:
      */
     void set_methods(const PMethodList &method_list);
 
+    ///Sets method list updated by snapshots
+    /**
+     * Peer doesn't lock the method list during dispatching. Published changes
+     * are picked up with the next incoming request.
+     *
+     * @param method_list snapshot method list
+     */
+    void set_methods(const PSnapshotMethodList &method_list);
+
     ///Register new callback
     /**
      * Callback is ad-hoc method, which can be called by other side. Function
@@ -330,12 +547,37 @@ public:
     ///default high water mark level (global)
     static std::size_t default_hwm;
 
+    ///Sets count of queued attachments, which are resolved concurrently
+    /**
+     * Attachments are always sent in order of the queue. However the peer
+     * watches futures of several attachments at once, so a slow attachment
+     * doesn't delay the following ones - once the slow attachment is sent,
+     * the following attachments which are already resolved are sent
+     * immediately
+     *
+     * @param count count of watched attachments (minimum is 1)
+     */
+    void set_upload_window(std::size_t count);
+
+    ///Retrieves count of queued attachments, which are resolved concurrently
+    std::size_t get_upload_window() const;
+
+    ///default count of attachments resolved concurrently
+    static constexpr std::size_t default_upload_window = 16;
+
 
 
 
     ///Determines, whether stream is still connected
     bool is_connected() const;
 
+    ///Retrieves metrics of this peer
+    /**
+     * @return snapshot of counters. If the library is compiled without
+     * UMQ_ENABLE_METRICS, counters are zero, only gauges are filled
+     */
+    PeerMetricsSnapshot get_metrics() const;
+
 
 
     ///Public interface to access variables
@@ -343,7 +585,12 @@ public:
     class VarSpaceRO {
     public:
     	using Map = std::map<std::string, T, std::less<> >;
+    	///Map of changes, variables without value are deleted
+    	using ChangeMap = std::map<std::string, std::optional<T>, std::less<> >;
+    	///List of changes - name and pointer to new value (nullptr to delete)
+    	using Changes = std::vector<std::pair<std::string_view, const T *> >;
     	using UpdateFn = void (Peer::*)(const std::string_view &name, const std::optional<T> &value);
+    	using BatchUpdateFn = void (Peer::*)(const Changes &changes);
 
     	///Get value of the variable
     	/**
@@ -363,9 +610,10 @@ public:
     protected:
     	friend class Peer;
     	
-    	VarSpaceRO(Peer &owner, UpdateFn upfn);
+    	VarSpaceRO(Peer &owner, UpdateFn upfn, BatchUpdateFn batchfn);
     	Peer &_owner;
     	UpdateFn _upfn;
+    	BatchUpdateFn _batchfn;
     	std::shared_timed_mutex &lock() const;
     	Map _vars;
 
@@ -380,10 +628,23 @@ public:
     	 */
     	void set(const std::string_view &name, const std::optional<T> &value);
         ///Merge variables from the map - replacing existing ones
+        /** All changes are synchronized in single message */
         void merge(const Map &other);
 
         ///Replace whole map
+        /** All changes are synchronized in single message */
         void set(const Map &other);
+
+        ///Apply multiple changes at once
+        /**
+         * @param changes map of changes. Variables with value are set,
+         * variables without value are deleted. All changes are
+         * synchronized in single message
+         */
+        void update(const ChangeMap &changes);
+
+        ///Synchronize collected changes and apply them to the variables (must be under lock)
+        void commit(const Changes &changes);
     };
 
     template<typename T, typename Cmp>
@@ -392,6 +653,7 @@ public:
     	using VarSpaceRO<T,Cmp>::VarSpaceRO;
     	using VarSpaceRO<T,Cmp>::set;
         using VarSpaceRO<T,Cmp>::merge;
+        using VarSpaceRO<T,Cmp>::update;
 
     };
 
@@ -415,6 +677,7 @@ protected:
     Peer();
 
     friend class Request;
+    friend class TopicUpdateBatch;
 	void on_result(const std::string_view &id, const Payload &data);
 	void on_welcome(const std::string_view &version, const Payload &data);
 	void on_exception(const std::string_view &id, const Payload &data);
@@ -422,15 +685,30 @@ protected:
 	void on_hello(const std::string_view &version, const Payload &data);
 	void on_unsubscribe(const std::string_view &topic_id);
 	bool on_topic_update(const std::string_view &topic_id, const Payload &data);
+	bool on_topic_update_seq(const std::string_view &topic_id, std::string_view data, AttachList &&alist);
+	void on_resync(const std::string_view &topic_id, const std::string_view &last_seq);
 	bool on_method_call(const std::string_view &id, const std::string_view &method, const Payload &args);
     bool on_callback(const std::string_view &id, const std::string_view &name, const Payload &args);
 	void on_execute_error(const std::string_view &id, const Payload &msg);
 	bool on_binary_message(const umq::MsgFrame &msg);
 	bool on_attachment_error(const std::string_view &msg);
+	bool on_attachment_cached(const std::string_view &hash, const std::string_view &mode);
+	bool on_attachment_cache(const std::string_view &capacity);
 	void on_set_var(const std::string_view &variable, const std::string_view &data);
 	void on_unset_var(const std::string_view &variable);
+	bool on_var_batch(const std::string_view &count, std::string_view data);
+	bool on_topic_batch(const std::string_view &count, std::string_view data);
+	bool on_topic_delta(const std::string_view &topic_id, std::string_view data, AttachList &&alist);
     bool on_discover(const std::string_view &id, const std::string_view &query);
 
+    ///Calls function with current method list
+    /**
+     * @param fn function receives pointer to method list (or nullptr, if there is no method list).
+     * The method list is locked (or referenced) during the call
+     */
+    template<typename Fn>
+    auto with_methods(Fn &&fn);
+
     ///Parse message from connection
     void parse_message(const MsgFrame &msg);
 
@@ -441,12 +719,18 @@ protected:
      * @param topic_id topic id
      * @param data data of topic
      * @retval true topic update sent
+     * @param seq sequence number, 0 if sequence numbers are not enabled
      * @retval false other side unsubscribed this topic
      *
      * @note default implementation always returns true. Extending class can implement own logic
      *
      */
-    bool send_topic_update(const std::string_view &topic_id, const Payload &data, HighWaterMarkBehavior hwmb, std::size_t hwm_size );
+    struct DeltaState;
+
+    bool send_topic_update(const std::string_view &topic_id, const Payload &data, HighWaterMarkBehavior hwmb, std::size_t hwm_size, std::uint64_t seq = 0, DeltaState *delta = nullptr);
+
+    ///Sends topic update encoded as difference against previous update
+    void send_topic_delta(const std::string_view &topic_id, const Payload &data, DeltaState &delta);
 
     ///Close the topic
     /**
@@ -462,6 +746,13 @@ protected:
      */
     void send_unsubscribe(const std::string_view &topic_id);
 
+    ///Request resync of the topic
+    /**
+     * @param topic_id topic id
+     * @param last_seq last received sequence number
+     */
+    void send_resync(const std::string_view &topic_id, std::uint64_t last_seq);
+
     ///Sends result of RPC call
     /**
      * @param id id of request
@@ -515,6 +806,20 @@ protected:
 
     void send_var_unset(const std::string_view &variable);
 
+    ///Sets and unsets multiple remote variables in single message
+    /**
+     * @param changes list of changes - pairs of name and pointer to value, nullptr
+     * unsets the variable
+     */
+    void send_var_batch(const VarSpaceRO<std::string, std::equal_to<std::string> >::Changes &changes);
+
+    ///Sends multiple topic updates in single message
+    /**
+     * @param count count of entries
+     * @param entries serialized entries (see PeerMsgType::topic_batch)
+     */
+    void send_topic_batch(std::size_t count, const std::string_view &entries);
+
     void send_call(const std::string_view &id, const std::string_view &method, const Payload &params);
 
     void send_callback_call(const std::string_view &id, const std::string_view &method, const Payload &args);
@@ -522,14 +827,24 @@ protected:
     static const char *error_to_string(PeerError err);
 
     void send_message(const MsgFrame &msg);
+    void send_message(const std::string_view &header, const std::string_view &body);
 
     void send_discover(const std::string_view &id, const std::string_view &method_name);
+    void send_discover(const std::string_view &id, const std::string_view &method_name, std::size_t known_version);
 
     void send_message(PeerMsgType msgType, const std::string_view &id);
 
     template<typename MiddlePart>
     void build_send_message(PeerMsgType msgType, const std::string_view &id, MiddlePart &&fn, const Payload &payload);
+    ///Watches queued attachments and sends resolved attachments in order (under lock)
     void run_upload();
+    struct UploadItem;
+    ///Sends single attachment
+    void send_upload(const UploadItem &item);
+    ///Sends content of an attachment, uses the cache of the other side if possible
+    void send_attachment(const std::string &data);
+    ///Sends content of a file backed attachment
+    void send_file(const PFileAttachment &file);
 
     void send_message(PeerMsgType msgType, const std::string_view &id, const Payload &payload);
     void send_message(PeerMsgType msgType, const std::string_view &id, const std::string_view &cmd, const Payload &payload);
@@ -554,16 +869,57 @@ protected:
 
     static std::string_view version;
 
-    using Topics = std::map<std::string, UnsubscribeRequest, std::less<> >;
+    struct DeltaState {
+        std::mutex mx;
+        ///last value sent to the subscriber
+        std::string last;
+        std::size_t keyframe_interval;
+        std::size_t since_keyframe = 0;
+        bool has_base = false;
+    };
+
+    struct PublishedTopic {
+        UnsubscribeRequest unsub;
+        std::shared_ptr<ResyncRequest> resync;
+        bool sequenced = false;
+        std::atomic<std::uint64_t> seq = 0;
+        std::unique_ptr<DeltaState> delta;
+    };
+
+    struct SubscribedSeq {
+        ///shared, so it can be called without the lock
+        std::shared_ptr<TopicGapCallback> gap;
+        std::atomic<std::uint64_t> last = 0;
+    };
+
+    using Topics = std::map<std::string, PublishedTopic, std::less<> >;
     using Subscriptions = std::map<std::string, TopicUpdateCallback, std::less<> >;
+    using SubscribedSeqMap = std::map<std::string, SubscribedSeq, std::less<> >;
+    ///last values of delta encoded topics
+    using SubscribedDeltaMap = std::map<std::string, std::shared_ptr<const std::string>, std::less<> >;
     using CallMap = std::map<std::string, ResponseCallback, std::less<> >;
     using CallbackMap = std::map<std::string, MethodCall, std::less<> >;
 
 
     PMethodList _methods;
+    ///accessed atomically, it is read without lock
+    PSnapshotMethodList _snapshot_methods;
     Topics _topic_map;
     Subscriptions _subscr_map;
+    SubscribedSeqMap _subscr_seq;
+    SubscribedDeltaMap _subscr_delta;
     CallMap _call_map;
+
+    struct QueuedCall {
+        std::string method;
+        PayloadStr params;
+        ResponseCallback result;
+    };
+
+    std::size_t _max_inflight = 0;
+    std::size_t _max_queued = 0;
+    std::deque<QueuedCall> _call_queue;
+    std::vector<CallWindowCallback> _window_waiters;
     CallbackMap _cb_map;
 
     HelloRequest _hello_cb;
@@ -575,11 +931,39 @@ protected:
     unsigned int _call_id = 0;
 
     std::queue<Attachment> _dwnl_attachments;
-    std::queue<Attachment> _upld_attachments;
+    struct UploadItem {
+        Attachment att;
+        ///time when the attachment has been queued
+        std::chrono::steady_clock::time_point queued;
+        ///time when the content has been resolved
+        std::chrono::steady_clock::time_point resolved = {};
+        bool ready = false;
+    };
+
+    std::deque<UploadItem> _upld_attachments;
+    ///count of attachments at the front of the upload queue, which are watched
+    std::size_t _upld_watched = 0;
+    std::size_t _upld_window = default_upload_window;
+    ///cache of received attachments
+    std::unique_ptr<AttachmentCache> _dwnl_cache;
+    ///mirror of the cache of the other side
+    std::unique_ptr<AttachmentCache> _upld_cache;
+    ///this peer has announced that it accepts batched topic updates
+    bool _topic_batch_announced = false;
+    ///the other side accepts batched topic updates
+    std::atomic<bool> _topic_batch_accepted = false;
+    ///hash of the next binary frame, which is stored in the cache
+    std::string _dwnl_cache_store;
+
+    PeerMetrics _metrics;
 
 
 
     void finish_call(const std::string_view &id, Response &&response);
+    ///sends queued calls while there is space in the window (under lock)
+    void send_queued_calls();
+    ///collects waiters when there is space in the window (under lock)
+    std::vector<CallWindowCallback> collect_window_waiters();
 
 
 
@@ -589,9 +973,117 @@ protected:
     void listener_fn(const std::optional<MsgFrame> &msg);
     void disconnect();
     void syncVar(const std::string_view &var, const std::optional<std::string> &value);
+    void syncVars(const VarSpaceRO<std::string, std::equal_to<std::string> >::Changes &changes);
 
 };
 
+///Packs topic updates sent by the current thread into batches
+/**
+ * While the object exists, topic updates (without attachments) sent by the
+ * current thread are not sent immediately. They are collected per peer and when
+ * the object is destroyed, each peer receives single message (PeerMsgType::topic_batch)
+ * containing all updates in order. The receiving peer processes the updates
+ * as they were sent separately.
+ *
+ * @code
+ * {
+ *      umq::TopicUpdateBatch batch;
+ *      prices.publish(a);
+ *      volumes.publish(b);
+ * } // <- every subscriber receives one message
+ * @endcode
+ *
+ * Nested objects are allowed, the outermost object sends the batches. Other
+ * messages sent during the batch are not delayed. Topic close and updates
+ * which are not batched (with attachments, delta updates) send pending updates
+ * of the peer first, so they never overtake batched updates of the same topic.
+ *
+ * Only peers, which have announced that they accept batches (Peer::enable_topic_batch()),
+ * receive batches. Other peers receive the updates as separate messages immediately
+ */
+class TopicUpdateBatch {
+public:
+    TopicUpdateBatch();
+    ~TopicUpdateBatch();
+    TopicUpdateBatch(const TopicUpdateBatch &) = delete;
+    TopicUpdateBatch &operator=(const TopicUpdateBatch &) = delete;
+
+    ///Returns true, if there is active batch in current thread
+    static bool active() {return _cur != nullptr;}
+
+protected:
+
+    friend class Peer;
+
+    struct Pending {
+        PPeer peer;
+        std::string entries;
+        std::size_t count = 0;
+    };
+
+    std::unordered_map<Peer *, Pending> _pending;
+    TopicUpdateBatch *_prev;
+    static thread_local TopicUpdateBatch *_cur;
+
+    ///Append update to the batch of the peer (peer is locked)
+    static void append(Peer &peer, PeerMsgType type, const std::string_view &topic_id,
+            const std::string_view &data, std::uint64_t seq);
+    ///Send pending updates of the peer immediately (peer is locked)
+    static void flush(Peer &peer);
+};
+
+///Marks values shared by topic updates sent by the current thread
+/**
+ * While the object exists, a message sent by the current thread, whose body
+ * is the content of one of the values (the same memory, not a copy), passes
+ * the reference to the value to the connection
+ * (AbstractConnection::send_message() with SharedBody). So the value is not
+ * copied for every subscriber, only the header is built per peer.
+ *
+ * Publisher creates the object when it delivers a value to many subscribers.
+ * Nested objects are allowed.
+ */
+class SharedTopicValue {
+public:
+    ///Mark the values
+    /**
+     * @param values array of values, it must exist until the object is destroyed. Items can be nullptr
+     * @param count count of values
+     */
+    SharedTopicValue(const SharedBody *values, std::size_t count);
+    ~SharedTopicValue();
+    SharedTopicValue(const SharedTopicValue &) = delete;
+    SharedTopicValue &operator=(const SharedTopicValue &) = delete;
+
+    ///Find marked value
+    /**
+     * @param data data
+     * @return value which content is the data (same memory), or nullptr
+     */
+    static SharedBody find(const std::string_view &data);
+
+protected:
+    const SharedBody *_values;
+    std::size_t _count;
+    SharedTopicValue *_prev;
+    static thread_local SharedTopicValue *_cur;
+};
+
+template<typename Fn>
+inline auto Peer::with_methods(Fn &&fn) {
+    //set_methods() can replace the list from other thread, the snapshot is held by this call only
+    PSnapshotMethodList snapshot_methods = std::atomic_load(&_snapshot_methods);
+    if (snapshot_methods != nullptr) {
+        MethodListSnapshot snapshot = snapshot_methods->get();
+        return fn(snapshot.get());
+    } else if (_methods != nullptr) {
+        auto mlk = _methods.lock_shared();
+        return fn(&(*mlk));
+    } else {
+        return fn(static_cast<const MethodList *>(nullptr));
+    }
+}
+
 inline void Peer::send_message(PeerMsgType msgType, const std::string_view &id) {
 	MsgBld bld;
 	bld.push_back(static_cast<char>(msgType));
@@ -602,6 +1094,7 @@ inline void Peer::send_message(PeerMsgType msgType, const std::string_view &id)
 template<typename MiddlePart>
 inline void Peer::build_send_message(PeerMsgType msgType, const std::string_view &id,
 		MiddlePart &&fn, const Payload &payload) {
+	TraceScope _trc(TracePoint::build_send, static_cast<char>(msgType), id, payload.size());
 	MsgBld bld;
 	if (!payload.attachments.empty()) {
 		bld.push_back(static_cast<char>(PeerMsgType::attachment));
@@ -614,15 +1107,17 @@ inline void Peer::build_send_message(PeerMsgType msgType, const std::string_view
 	bld.append(id.begin(), id.end());
 	bld.push_back('\n');
 	fn(bld);
-	bld.append(payload.begin(), payload.end());
+	//payload is not copied to the builder, it can be shared by many messages
+	std::string_view hdr(bld.data(),bld.size());
 	if (payload.attachments.empty()) {
-		send_message(MsgFrame{MsgFrameType::text, std::string_view(bld.data(),bld.size())});
+		send_message(hdr, payload);
 	} else {
-		bool need_start = _upld_attachments.empty();
+		bool need_start = _upld_watched < _upld_window;
+		auto now = std::chrono::steady_clock::now();
 		for (const auto &x: payload.attachments) {
-			_upld_attachments.push(x);
+			_upld_attachments.push_back(UploadItem{x, now});
 		}
-		send_message(MsgFrame{MsgFrameType::text, std::string_view(bld.data(),bld.size())});
+		send_message(hdr, payload);
 		if (need_start) run_upload();
 	}
 }
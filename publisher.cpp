@@ -1,43 +1,406 @@
 #include "publisher.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <stdexcept>
+
 namespace umq {
 
+struct Publisher::Shard {
+	///serial publisher of subscribers of this shard
+	Publisher pub;
+	///executor of this shard (if not set, shared executor is used)
+	Executor exec;
+	///protects the active flag
+	std::mutex mx;
+	///a task is running (or scheduled)
+	std::atomic<bool> running = false;
+	///shard had subscribers after last delivery
+	std::atomic<bool> active = false;
+	///count of queued updates
+	std::atomic<std::size_t> queued = 0;
+	///count of publishers waiting for free space
+	std::atomic<unsigned int> waiting = 0;
+	///queue overflowed, subscribers are unsubscribed by the task
+	std::atomic<bool> overflow = false;
+	///signaled when space is freed (waiting publishers)
+	std::condition_variable space;
+
+	///Lock-free queue of updates, many producers, single consumer
+	struct Node {
+		std::shared_ptr<const std::string> val;
+		std::atomic<Node *> next = nullptr;
+	};
+	///last pushed node (producers)
+	std::atomic<Node *> head;
+	///node before the first queued node, its value has been already taken (consumer)
+	Node *tail;
+	Node stub;
+
+	Shard():head(&stub),tail(&stub) {}
+	~Shard() {
+		std::shared_ptr<const std::string> tmp;
+		while (pop(tmp));
+		if (tail != &stub) delete tail;
+	}
+
+	void push(std::shared_ptr<const std::string> val) {
+		queued.fetch_add(1, std::memory_order_relaxed);
+		Node *n = new Node{std::move(val)};
+		Node *prev = head.exchange(n);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	bool pop(std::shared_ptr<const std::string> &val) {
+		Node *t = tail;
+		Node *n = t->next.load(std::memory_order_acquire);
+		//empty, or a producer is in the middle of push()
+		if (n == nullptr) return false;
+		val = std::move(n->val);
+		tail = n;
+		if (t != &stub) delete t;
+		//seq_cst, it is paired with the counter of waiting publishers
+		queued.fetch_sub(1);
+		return true;
+	}
+
+	bool empty() const {
+		return head.load() == tail;
+	}
+};
+
+struct Publisher::Parallel: std::enable_shared_from_this<Publisher::Parallel> {
+	Executor exec;
+	std::vector<std::unique_ptr<Shard> > shards;
+	std::size_t next_shard = 0;
+	///history is enabled, all shards must see all updates (read by publish() without the lock)
+	std::atomic<bool> history = false;
+	///maximum count of queued updates per shard
+	std::size_t queue_limit = Publisher::default_shard_queue_limit;
+	HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip;
+};
+
+struct Publisher::FilterGroup {
+	Publisher pub;
+	FilterType type;
+	std::string key;
+	///count of subscribers being added, the group can't be removed
+	std::size_t adding = 0;
+};
+
+static std::string_view first_line(const std::string_view &v) {
+	auto pos = v.find('\n');
+	return pos == v.npos?v:v.substr(0, pos);
+}
+
 Publisher::~Publisher() {
 	reset();
 }
 
-std::size_t Publisher::subscribe(TopicUpdateCallback &&cb) {
+void Publisher::set_parallel(std::size_t shards, Executor &&executor,
+		std::size_t queue_limit, HighWaterMarkBehavior hwmb) {
+	if (shards < 1) shards = 1;
+	auto par = std::make_shared<Parallel>();
+	par->exec = std::move(executor);
+	par->queue_limit = std::max<std::size_t>(queue_limit, 1);
+	par->hwmb = hwmb;
+	for (std::size_t i = 0; i < shards; i++) par->shards.push_back(std::make_unique<Shard>());
+	install_parallel(std::move(par));
+}
+
+void Publisher::set_parallel(std::vector<Executor> &&executors,
+		std::size_t queue_limit, HighWaterMarkBehavior hwmb) {
+	if (executors.empty()) {
+		throw std::invalid_argument("Publisher::set_parallel - no executors");
+	}
+	auto par = std::make_shared<Parallel>();
+	par->queue_limit = std::max<std::size_t>(queue_limit, 1);
+	par->hwmb = hwmb;
+	for (auto &e: executors) {
+		par->shards.push_back(std::make_unique<Shard>());
+		par->shards.back()->exec = std::move(e);
+	}
+	install_parallel(std::move(par));
+}
+
+void Publisher::install_parallel(std::shared_ptr<Parallel> &&par) {
+	std::unique_lock _(_mx);
+	bool has_subs = _live > 0;
+	if (_par) {
+		for (const auto &s: _par->shards) has_subs = has_subs || s->active.load(std::memory_order_relaxed);
+	}
+	if (has_subs) {
+		throw std::logic_error("Publisher::set_parallel - publisher already has subscribers");
+	}
+	//publish() can still use the old state
+	if (_par) _par_retired.push_back(std::move(_par));
+	_par = std::move(par);
+	_par_fast.store(_par.get(), std::memory_order_release);
+}
+
+void Publisher::set_history(std::size_t count) {
 	std::unique_lock _(_mx);
-	std::size_t id = ++idcnt;
-	_subs.push_back({
-		id, std::move(cb)
+	_history_size = count;
+	while (_history.size() > count) _history.pop_front();
+	{
+		std::shared_lock __(_filter_mx);
+		for (auto &x: _filter_eq) x.second->pub.set_history(count);
+		for (auto &x: _filter_prefix) x.second->pub.set_history(count);
+	}
+	if (_par) {
+		auto par = _par;
+		par->history.store(count > 0, std::memory_order_relaxed);
+		_.unlock();
+		for (auto &s: par->shards) s->pub.set_history(count);
+	}
+}
+
+void Publisher::set_key_extractor(KeyExtractor &&fn) {
+	std::unique_lock _(_filter_mx);
+	_key_extractor = std::move(fn);
+}
+
+std::size_t Publisher::subscribe(TopicUpdateCallback &&cb, FilterType type, const std::string_view &key) {
+	std::size_t history;
+	{
+		std::lock_guard _(_mx);
+		history = _history_size;
+	}
+	std::unique_lock _(_filter_mx);
+	FilterMap &map = type == FilterType::equal?_filter_eq:_filter_prefix;
+	auto iter = map.find(key);
+	if (iter == map.end()) {
+		auto g = std::make_shared<FilterGroup>();
+		g->type = type;
+		g->key = key;
+		g->pub.set_history(history);
+		iter = map.emplace(g->key, g).first;
+		if (type == FilterType::prefix) ++_prefix_lengths[key.size()];
+	}
+	PFilterGroup g = iter->second;
+	++g->adding;
+	_has_filters.store(true, std::memory_order_release);
+	std::size_t id = ++_filter_idcnt | filtered_id_flag;
+	//registered before the history is replayed, the subscriber can leave during the replay
+	auto fiter = _filtered.emplace(id, FilteredSub{g, 0}).first;
+	_.unlock();
+	//subscribe outside of the lock, the subscriber can receive history
+	std::size_t inner = g->pub.subscribe([this, id, cb = std::move(cb)](const Payload &data) {
+		bool r;
+		try {
+			r = cb(data);
+		} catch (...) {
+			r = false;
+		}
+		if (!r) forget_filtered(id);
+		return r;
 	});
+	_.lock();
+	--g->adding;
+	fiter = _filtered.find(id);
+	if (fiter != _filtered.end()) {
+		fiter->second.id = inner;
+		return id;
+	}
+	//removed during the replay (callback returned false or unsubscribe() was called)
+	_.unlock();
+	g->pub.unsubscribe(inner);
+	remove_group_if_empty(g);
 	return id;
 }
 
-void Publisher::unsubscribe(std::size_t id) {
-	std::unique_lock _(_mx);
-	auto iter = std::lower_bound(_unsubs.begin(), _unsubs.end(), id,
-	        [](std::size_t a, std::size_t b) {return a<b;});
-	_unsubs.insert(iter, id);
-	if (!_inp) do_unsubscribe();
+void Publisher::forget_filtered(std::size_t id) {
+	PFilterGroup g;
+	std::unique_lock _(_filter_mx);
+	auto iter = _filtered.find(id);
+	if (iter == _filtered.end()) return;
+	g = std::move(iter->second.group);
+	_filtered.erase(iter);
+	_.unlock();
 }
 
-bool Publisher::publish(const std::string_view &v) {
+void Publisher::remove_group_if_empty(const PFilterGroup &group) {
+	std::unique_lock _(_filter_mx);
+	if (group->adding || !group->pub.empty()) return;
+	FilterMap &map = group->type == FilterType::equal?_filter_eq:_filter_prefix;
+	auto iter = map.find(group->key);
+	if (iter == map.end() || iter->second != group) return;
+	map.erase(iter);
+	if (group->type == FilterType::prefix) {
+		auto l = _prefix_lengths.find(group->key.size());
+		if (--l->second == 0) _prefix_lengths.erase(l);
+	}
+	_has_filters.store(!_filter_eq.empty() || !_filter_prefix.empty(), std::memory_order_release);
+}
+
+bool Publisher::publish_filtered(const std::string_view &v) {
+	std::vector<PFilterGroup> groups;
+	{
+		std::shared_lock _(_filter_mx);
+		std::string_view key = _key_extractor != nullptr?_key_extractor(v):first_line(v);
+		auto iter = _filter_eq.find(key);
+		if (iter != _filter_eq.end()) groups.push_back(iter->second);
+		//lookup only prefix lengths, which are in use
+		for (const auto &l: _prefix_lengths) {
+			if (l.first > key.size()) break;
+			iter = _filter_prefix.find(key.substr(0, l.first));
+			if (iter != _filter_prefix.end()) groups.push_back(iter->second);
+		}
+	}
+	bool r = false;
+	for (const auto &g: groups) {
+		if (g->pub.publish(v)) r = true;
+		else remove_group_if_empty(g);
+	}
+	return r;
+}
+
+void Publisher::reset_filtered() {
+	std::vector<PFilterGroup> groups;
+	{
+		std::unique_lock _(_filter_mx);
+		for (auto &x: _filter_eq) groups.push_back(std::move(x.second));
+		for (auto &x: _filter_prefix) groups.push_back(std::move(x.second));
+		_filter_eq.clear();
+		_filter_prefix.clear();
+		_prefix_lengths.clear();
+		_has_filters.store(false, std::memory_order_release);
+	}
+	for (auto &g: groups) g->pub.reset();
+	std::unordered_map<std::size_t, FilteredSub> tmp;
+	std::unique_lock _(_filter_mx);
+	std::swap(tmp, _filtered);
+	_.unlock();
+	//groups are destroyed outside of the lock
+}
+
+std::size_t Publisher::subscribe(TopicUpdateCallback &&cb) {
 	std::unique_lock _(_mx);
-	_inp = true;
-	for (const auto &x: _subs) {
-	    try {
-	        if (!x.cb(v)) _unsubs.push_back(x.id);
-	    } catch (...) {
-	        _unsubs.push_back(x.id);
-	    }
+	if (_par) {
+		//id encodes index of the shard
+		auto par = _par;
+		std::size_t n = par->shards.size();
+		std::size_t idx = par->next_shard;
+		par->next_shard = (idx + 1) % n;
+		_.unlock();
+		Shard &s = *par->shards[idx];
+		std::size_t id = s.pub.subscribe(std::move(cb));
+		std::lock_guard __(s.mx);
+		s.active.store(true, std::memory_order_relaxed);
+		return id * n + idx;
+	}
+	if (!_storage || _count == _storage->capacity) grow();
+	auto slot = std::make_shared<Slot>();
+	slot->id = ++idcnt;
+	slot->cb = std::move(cb);
+	_index.emplace(slot->id, slot);
+	//slot is behind snapshots of running publishers, they don't see it
+	_storage->slots[_count++] = slot;
+	++_live;
+	if (_history.empty()) return slot->id;
+	//slot is visible to publishers now, so they queue updates until replay is finished
+	slot->replaying.store(true, std::memory_order_relaxed);
+	std::vector<PValue> values(_history.begin(), _history.end());
+	++_inp;
+	_.unlock();
+	replay(*slot, std::move(values));
+	_.lock();
+	auto dead = leave_cycle();
+	_.unlock();
+	return slot->id;
+}
+
+void Publisher::replay(Slot &slot, std::vector<PValue> &&values) {
+	std::unique_lock lk(slot.replay_mx);
+	while (!values.empty()) {
+		lk.unlock();
+		for (const auto &v: values) {
+			if (!slot.alive.load(std::memory_order_acquire) || !deliver(slot, *v)) break;
+		}
+		values.clear();
+		lk.lock();
+		std::swap(values, slot.pending);
+	}
+	slot.replaying.store(false, std::memory_order_release);
+}
+
+bool Publisher::deliver(Slot &slot, const std::string_view &v) {
+	bool r;
+	try {
+		r = slot.cb(v);
+	} catch (...) {
+		r = false;
+	}
+	if (!r) unsubscribe(slot.id);
+	return r;
+}
+
+std::vector<TopicUpdateCallback> Publisher::leave_cycle() {
+	std::vector<TopicUpdateCallback> dead;
+	if (--_inp == 0) {
+		for (auto &s: _graveyard) dead.push_back(std::move(s->cb));
+		_graveyard.clear();
+	}
+	return dead;
+}
+
+void Publisher::grow() {
+	//new storage is also used to drop dead slots
+	auto st = std::make_shared<Storage>(std::max<std::size_t>(16, _live * 2));
+	std::size_t cnt = 0;
+	for (std::size_t i = 0; i < _count; i++) {
+		PSlot &s = _storage->slots[i];
+		if (s->alive.load(std::memory_order_relaxed)) st->slots[cnt++] = s;
+	}
+	_storage = std::move(st);
+	_count = cnt;
+}
+
+TopicUpdateCallback Publisher::remove_slot(const PSlot &slot) {
+	slot->alive.store(false, std::memory_order_release);
+	--_live;
+	TopicUpdateCallback cb;
+	if (_inp) {
+		//callback can be running now, destroy it after publishing
+		_graveyard.push_back(slot);
+	} else {
+		cb = std::move(slot->cb);
 	}
-	do_unsubscribe();
-	_inp = false;
-	return !_subs.empty();
+	//dead slots are dropped, when they occupy more than half of the storage
+	std::size_t dead = _count - _live;
+	if (dead > 32 && dead > _live) grow();
+	return cb;
 }
 
+void Publisher::unsubscribe(std::size_t id) {
+	if (id & filtered_id_flag) {
+		std::unique_lock _(_filter_mx);
+		auto iter = _filtered.find(id);
+		if (iter == _filtered.end()) return;
+		FilteredSub fs = std::move(iter->second);
+		_filtered.erase(iter);
+		_.unlock();
+		fs.group->pub.unsubscribe(fs.id);
+		remove_group_if_empty(fs.group);
+		return;
+	}
+	std::unique_lock _(_mx);
+	if (_par) {
+		auto par = _par;
+		_.unlock();
+		std::size_t n = par->shards.size();
+		par->shards[id % n]->pub.unsubscribe(id / n);
+		return;
+	}
+	auto iter = _index.find(id);
+	if (iter == _index.end()) return;
+	PSlot slot = std::move(iter->second);
+	_index.erase(iter);
+	TopicUpdateCallback cb = remove_slot(slot);
+	_.unlock();
+	//callback is destroyed outside of the lock
+}
 
 UnsubscribeRequest Publisher::create_unsub_request(std::size_t id) {
 	return UnsubscribeRequest([this,id]{
@@ -53,38 +416,196 @@ UnsubscribeRequest Publisher::create_unsub_request(
 	});
 }
 
+bool Publisher::publish(const std::string_view &v) {
+	return publish_values(&v, 1);
+}
+
+bool Publisher::publish_batch(const std::vector<std::string_view> &values) {
+	TopicUpdateBatch batch;
+	return publish_values(values.data(), values.size());
+}
+
+bool Publisher::publish_values(const std::string_view *values, std::size_t count) {
+	bool filtered = false;
+	if (_has_filters.load(std::memory_order_acquire)) {
+		for (std::size_t j = 0; j < count; j++) filtered = publish_filtered(values[j]) || filtered;
+	}
+	if (Parallel *par = _par_fast.load(std::memory_order_acquire)) {
+		bool r = false;
+		for (std::size_t j = 0; j < count; j++) r = publish_parallel(*par, values[j]) || r;
+		return r || filtered;
+	}
+	std::lock_guard __(_publish_mx);
+	std::unique_lock _(_mx);
+	std::vector<PValue> vals(count);
+	if (_history_size) {
+		//subscribers added after this point receive the values from the history
+		for (std::size_t j = 0; j < count; j++) {
+			vals[j] = std::make_shared<const std::string>(values[j]);
+			_history.push_back(vals[j]);
+		}
+		while (_history.size() > _history_size) _history.pop_front();
+	}
+	std::shared_ptr<Storage> st = _storage;
+	std::size_t cnt = _count;
+	++_inp;
+	_.unlock();
+	//value delivered to many subscribers is shared, the peers pass it to the connections without copying
+	for (std::size_t j = 0; j < count; j++) {
+		if (!vals[j]) vals[j] = SharedTopicValue::find(values[j]);
+		if (!vals[j] && cnt > 1) vals[j] = std::make_shared<const std::string>(values[j]);
+	}
+	SharedTopicValue shared(vals.data(), count);
+	for (std::size_t i = 0; i < cnt; i++) {
+		Slot &s = *st->slots[i];
+		if (!s.alive.load(std::memory_order_acquire)) continue;
+		if (s.replaying.load(std::memory_order_acquire)) {
+			std::unique_lock lk(s.replay_mx);
+			if (s.replaying.load(std::memory_order_relaxed)) {
+				for (std::size_t j = 0; j < count; j++) {
+					if (!vals[j]) vals[j] = std::make_shared<const std::string>(values[j]);
+					s.pending.push_back(vals[j]);
+				}
+				continue;
+			}
+		}
+		for (std::size_t j = 0; j < count && deliver(s, vals[j]?std::string_view(*vals[j]):values[j]); j++);
+	}
+	_.lock();
+	auto dead = leave_cycle();
+	bool ret = _live > 0 || filtered;
+	_.unlock();
+	//callbacks of removed subscribers are destroyed here
+	return ret;
+}
+
+bool Publisher::publish_parallel(Parallel &par, const std::string_view &v) {
+	bool active = false;
+	std::shared_ptr<const std::string> val;
+	for (auto &s: par.shards) {
+		bool a = s->active.load(std::memory_order_relaxed);
+		active = active || a;
+		if (!a && !par.history.load(std::memory_order_relaxed)) continue;
+		if (s->queued.load(std::memory_order_relaxed) >= par.queue_limit
+				&& !shard_full(par, *s)) continue;
+		if (!val) val = std::make_shared<const std::string>(v);
+		s->push(val);
+		if (!s->running.exchange(true)) {
+			auto task = [p = par.shared_from_this(), &shard = *s]{run_shard(p, shard);};
+			if (s->exec != nullptr) s->exec(std::move(task));
+			else par.exec(std::move(task));
+		}
+	}
+	return active;
+}
+
+bool Publisher::shard_full(Parallel &par, Shard &shard) {
+	switch (par.hwmb) {
+		default:
+		case HighWaterMarkBehavior::skip:
+			return false;
+		case HighWaterMarkBehavior::ignore:
+			return true;
+		case HighWaterMarkBehavior::unsubscribe:
+		case HighWaterMarkBehavior::close:
+			//the task is running (the queue is not empty), it unsubscribes the subscribers
+			shard.overflow.store(true, std::memory_order_relaxed);
+			return false;
+		case HighWaterMarkBehavior::block: {
+			std::unique_lock lk(shard.mx);
+			shard.waiting.fetch_add(1);
+			shard.space.wait(lk, [&]{
+				return shard.queued.load() < par.queue_limit;
+			});
+			shard.waiting.fetch_sub(1);
+			return true;
+		}
+	}
+}
+
+void Publisher::run_shard(std::shared_ptr<Parallel> par, Shard &shard) {
+	std::shared_ptr<const std::string> v;
+	while (true) {
+		{
+			//updates queued while the task is busy are sent to the peers together,
+			//the batch is limited and it is sent before the task can end
+			TopicUpdateBatch batch;
+			std::size_t limit = par->queue_limit;
+			while (limit-- && shard.pop(v)) {
+				if (shard.waiting.load()) {
+					std::lock_guard _(shard.mx);
+					shard.space.notify_all();
+				}
+				if (shard.overflow.exchange(false, std::memory_order_relaxed)) {
+					//drop queued updates, subscribers are unsubscribed
+					while (shard.pop(v));
+					shard.pub.reset();
+					break;
+				}
+				SharedTopicValue shared(&v, 1);
+				shard.pub.publish(*v);
+			}
+			v.reset();
+		}
+		if (!shard.empty()) continue;
+		{
+			//under the lock, so it can't overwrite flag set by a new subscriber
+			std::lock_guard _(shard.mx);
+			shard.active.store(!shard.pub.empty(), std::memory_order_relaxed);
+		}
+		shard.running.store(false);
+		//a value pushed before the flag was reset would be left in the queue
+		if (shard.empty() || shard.running.exchange(true)) return;
+	}
+}
+
 void Publisher::reset() {
+	reset_filtered();
 	std::unique_lock _(_mx);
-    std::vector<Subscriber> x = std::move(_subs);
-    _.unlock();
-    for (auto &s: x) {
-        s.cb(std::string_view());
-    }
-    _unsubs.clear();
+	//new subscribers must not receive values published before the reset
+	_history.clear();
+	if (_par) {
+		auto par = _par;
+		_.unlock();
+		for (auto &s: par->shards) {
+			s->pub.reset();
+			std::lock_guard __(s->mx);
+			s->active.store(!s->pub.empty(), std::memory_order_relaxed);
+		}
+		return;
+	}
+	_.unlock();
+	//wait for publishing in other threads
+	std::lock_guard __(_publish_mx);
+	_.lock();
+	std::vector<PSlot> x;
+	for (std::size_t i = 0; i < _count; i++) {
+		PSlot &s = _storage->slots[i];
+		if (s->alive.exchange(false, std::memory_order_acq_rel)) x.push_back(s);
+	}
+	_storage.reset();
+	_count = 0;
+	_live = 0;
+	_index.clear();
+	bool inp = _inp > 0;
+	_.unlock();
+	for (auto &s: x) {
+		s->cb(std::string_view());
+		//when called from a subscriber, the callback is destroyed with the snapshot
+		if (!inp) s->cb = nullptr;
+	}
 }
 
 bool Publisher::empty() const {
+	if (_has_filters.load(std::memory_order_acquire)) return false;
 	std::unique_lock _(_mx);
-	return _subs.empty();
-}
-
-void Publisher::do_unsubscribe() {
-    auto iter =  _unsubs.begin();
-    auto iend = _unsubs.end();
-    //_unsubs is ordered by id
-    //_subs is ordered by id
-    auto r = std::remove_if(_subs.begin(),_subs.end(), [&](const Subscriber &s){
-        while (iter != iend && *iter < s.id) {
-            ++iter;
-        }
-        if (iter != iend && *iter == s.id) {
-                ++iter;return true;
-        } else {
-            return false;
-        }
-    });
-    _unsubs.clear();
-    _subs.erase(r, _subs.end());
+	if (_par) {
+		for (const auto &s: _par->shards) {
+			if (s->active.load(std::memory_order_relaxed)) return false;
+		}
+		return true;
+	}
+	return _live == 0;
 }
 
 }
@@ -7,7 +7,13 @@
 
 #ifndef _LIB_UMQ_PUBLISHER_H_qeu289dhdh9dhqw
 #define _LIB_UMQ_PUBLISHER_H_qeu289dhdh9dhqw
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "peer.h"
@@ -16,18 +22,137 @@ namespace umq {
 class Publisher {
 public:
 
+	///Function which runs a task in a worker thread
+	using Executor = ondra_shared::Callback<void(ondra_shared::Callback<void()> &&)>;
+	///Function which extracts a key from the update
+	using KeyExtractor = ondra_shared::Callback<std::string_view(const std::string_view &)>;
+
+	///Type of subscriber's filter
+	enum class FilterType {
+		///key of the update must be equal to the key of the filter
+		equal,
+		///key of the update must start with the key of the filter
+		prefix
+	};
+
+	///Default limit of the queue of a shard in parallel mode
+	static constexpr std::size_t default_shard_queue_limit = 4096;
+
 	~Publisher();
 
+	///Enable parallel publishing
+	/**
+	 * Subscribers are split into shards. Every shard has own queue of updates,
+	 * which is processed by a task executed by the executor. Only one task
+	 * per shard runs at a time, so updates are delivered to each subscriber in
+	 * the order of publishing. Slow subscriber (for example blocked on high
+	 * water mark) delays only subscribers of its shard.
+	 *
+	 * In this mode, publish() doesn't wait for delivery. The value is copied once
+	 * and shared by all shards. Publishing doesn't take any lock, the value is
+	 * passed to shards through lock-free queues, so many threads can publish
+	 * at the same time.
+	 *
+	 * Updates which are queued in a shard while its task is busy are delivered
+	 * within one TopicUpdateBatch, so each peer, which accepts batches
+	 * (Peer::enable_topic_batch()), receives them in a single message.
+	 * Batches created by the publishing thread don't apply to the shards.
+	 *
+	 * Queue of each shard is limited. When a shard's queue is full, the
+	 * update is handled according to the high water mark behavior
+	 *
+	 * - skip - the shard skips the update
+	 * - block - publish() waits until the shard has free space (don't use it,
+	 * when the publisher is called from the thread of the shard)
+	 * - ignore - the queue grows without limit
+	 * - unsubscribe, close - all subscribers of the shard are unsubscribed
+	 *
+	 * @param shards count of shards
+	 * @param executor function which executes the task, for example in a
+	 * thread pool
+	 * @param queue_limit maximum count of updates queued per shard
+	 * @param hwmb behavior when a queue of a shard is full
+	 *
+	 * @note must be called before the first subscriber is added
+	 * @exception std::logic_error publisher already has subscribers
+	 */
+	void set_parallel(std::size_t shards, Executor &&executor,
+			std::size_t queue_limit = default_shard_queue_limit,
+			HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip);
+
+	///Enable parallel publishing with an executor per shard
+	/**
+	 * Same as above, but every shard has own executor. This allows to pin
+	 * shards to different threads (for example, each executor runs tasks in
+	 * its own thread)
+	 *
+	 * @param executors executors, one per shard
+	 * @param queue_limit maximum count of updates queued per shard
+	 * @param hwmb behavior when a queue of a shard is full
+	 *
+	 * @note must be called before the first subscriber is added
+	 * @exception std::logic_error publisher already has subscribers
+	 */
+	void set_parallel(std::vector<Executor> &&executors,
+			std::size_t queue_limit = default_shard_queue_limit,
+			HighWaterMarkBehavior hwmb = HighWaterMarkBehavior::skip);
+
+	///Keep last published values and send them to new subscribers
+	/**
+	 * New subscriber receives kept values (oldest first) before any
+	 * live update. Values are sent by the subscribe() function. Updates published
+	 * during this time are queued for the subscriber and sent after the kept
+	 * values, so the subscriber doesn't miss any update. Publishing is not
+	 * blocked, subscribe() returns once the subscriber catches up with the
+	 * live updates.
+	 *
+	 * @param count count of values to keep. Set 0 to disable (default)
+	 */
+	void set_history(std::size_t count);
+
 	///Subscribe subscriber
 	/**
 	 * @param cb a callback function called on publish/topic updae
 	 * @return ID of the subscriber
+	 *
+	 * @note function doesn't wait for publishing running in other thread. New
+	 * subscriber receives next update. If history is enabled, the subscriber
+	 * receives kept values during this call
 	 */
 	std::size_t subscribe(TopicUpdateCallback &&cb);
 
+	///Subscribe subscriber with a filter
+	/**
+	 * Subscriber receives only updates with matching key. Subscribers are
+	 * indexed by their filters, so publishing doesn't evaluate filters of
+	 * subscribers, which don't match. Filtered subscribers are always served
+	 * by the publishing thread (also in parallel mode)
+	 *
+	 * @param cb a callback function called on publish/topic update
+	 * @param type type of the filter
+	 * @param key key of the filter
+	 * @return ID of the subscriber
+	 *
+	 * @note when history is enabled, the subscriber receives kept values
+	 * published since the first subscriber of the same filter
+	 */
+	std::size_t subscribe(TopicUpdateCallback &&cb, FilterType type, const std::string_view &key);
+
+	///Set function which extracts key from the update
+	/**
+	 * @param fn function. Default function returns first line of the update
+	 * (text before the first new line character)
+	 *
+	 * @note must be called before the first filtered subscriber is added
+	 */
+	void set_key_extractor(KeyExtractor &&fn);
+
 	///Unsubscribe the subscriber
 	/**
 	 * @param id id of subscriber
+	 *
+	 * @note function doesn't wait for publishing running in other thread. Such
+	 * publishing can still deliver its update to the subscriber
 	 */
 	void unsubscribe(std::size_t id);
 
@@ -36,9 +161,27 @@ public:
 	 * @param v value to publish
 	 * @retval true published
 	 * @retval false no subscribers
+	 *
+	 * @note in parallel mode, the function returns before the update is delivered.
+	 * When the last subscriber is removed during delivery, the publisher can
+	 * report it with the next publish
 	 */
 	bool publish(const std::string_view &v);
 
+	///Publish multiple values at once
+	/**
+	 * Every subscriber receives all values in order. Updates sent to the
+	 * same peer (also from other publishers within the same TopicUpdateBatch)
+	 * are packed to a single message, if the peer accepts batches
+	 * (Peer::enable_topic_batch()). In parallel mode, the values are packed
+	 * by the shards (see set_parallel())
+	 *
+	 * @param values values to publish
+	 * @retval true published
+	 * @retval false no subscribers
+	 */
+	bool publish_batch(const std::vector<std::string_view> &values);
+
 
 	///Create unsubscribe request for given ID
 	UnsubscribeRequest create_unsub_request(std::size_t id);
@@ -48,7 +191,7 @@ public:
 			const std::shared_ptr<Publisher> &pub,
 			std::size_t id);
 
-	///Clear all subscribers
+	///Clear all subscribers and kept values (history)
 	void reset();
 
 	///returns true, if publisher has no subscribers
@@ -56,31 +199,108 @@ public:
 
 protected:
 
-	struct Subscriber {
+	using PValue = std::shared_ptr<const std::string>;
+
+	///Subscriber's slot
+	struct Slot {
 		std::size_t id;
 		TopicUpdateCallback cb;
+		std::atomic<bool> alive = true;
+		///subscriber receives history, live updates are queued
+		std::atomic<bool> replaying = false;
+		std::mutex replay_mx;
+		std::vector<PValue> pending;
 	};
 
-	mutable std::recursive_mutex _mx;
-	std::vector<Subscriber> _subs;
-	std::vector<std::size_t> _unsubs;
+	using PSlot = std::shared_ptr<Slot>;
+
+	///Array of slots, it is never reallocated
+	/**
+	 * New slots are added behind the end of the array, so publishing thread
+	 * can iterate its snapshot (count of slots at the beginning of publishing)
+	 * while new subscribers are added. When the array is full, or when
+	 * there are too many removed slots, new array is allocated and live slots
+	 * are copied. Old array remains valid for threads which still publish
+	 */
+	struct Storage {
+		std::unique_ptr<PSlot[]> slots;
+		std::size_t capacity;
+		explicit Storage(std::size_t capacity)
+			:slots(std::make_unique<PSlot[]>(capacity)),capacity(capacity) {}
+	};
+
+	///protects list of subscribers (only short operations)
+	mutable std::mutex _mx;
+	///serializes publishing, so subscribers receive updates in order
+	std::recursive_mutex _publish_mx;
+	std::shared_ptr<Storage> _storage;
+	///count of used slots in the storage
+	std::size_t _count = 0;
+	///count of slots, which are alive
+	std::size_t _live = 0;
+	std::unordered_map<std::size_t, PSlot> _index;
 	std::size_t idcnt = 0;
-	/** in progress = true?
-	 *
-	 * Because recursive_mutex is used, it is possible to call unsubscribe from
-	 * the subscriber during publish cycle. This can harm publishing cycle. So
-	 * if the _inp is true, unsubscribe requests are collected in _unsubs array,
-	 * which is ordered by id. Once the publish cycle is finished, all
-	 * marked subscribers are removed from the _subs. So it is now possible to call
-	 * unsubscribe from the subscriber, which has the same effect as returning false
-	 * from the subscriber. It is also possible to unsubscribe other subscribers.
-	 * (this can happen, when during publishing, the subscriber's connection is closed,
-	 * which can cause massive unsubscribe of all topics on the connection
+	/** count of publishing cycles in progress
+	 *
+	 * Callback of the subscriber can't be destroyed while it can be called
+	 * by the publishing cycle. Unsubscribed slot is only marked as dead. When
+	 * a publishing is in progress, the slot is moved to _graveyard and its
+	 * callback is destroyed once the publishing is finished.
 	 *
+	 * It is possible to call unsubscribe from the subscriber, which has the same effect
+	 * as returning false from the subscriber. It is also possible to unsubscribe
+	 * or subscribe other subscribers.
 	 */
-	bool _inp = false;
+	std::size_t _inp = 0;
+	std::vector<PSlot> _graveyard;
+	///kept values
+	std::deque<PValue> _history;
+	std::size_t _history_size = 0;
+
+	struct Shard;
+	struct Parallel;
+
+	std::shared_ptr<Parallel> _par;
+	///parallel state read by publish() without the lock
+	std::atomic<Parallel *> _par_fast = nullptr;
+	///replaced parallel states, they can be still used by publish()
+	std::vector<std::shared_ptr<Parallel> > _par_retired;
+
+	struct FilterGroup;
+	using PFilterGroup = std::shared_ptr<FilterGroup>;
+	using FilterMap = std::map<std::string, PFilterGroup, std::less<> >;
+	struct FilteredSub {
+		PFilterGroup group;
+		std::size_t id;
+	};
+
+	///ids of filtered subscribers have the highest bit set
+	static constexpr std::size_t filtered_id_flag = ~(~std::size_t(0) >> 1);
+
+	mutable std::shared_mutex _filter_mx;
+	FilterMap _filter_eq;
+	FilterMap _filter_prefix;
+	///lengths of prefixes in _filter_prefix (length -> count)
+	std::map<std::size_t, std::size_t> _prefix_lengths;
+	std::unordered_map<std::size_t, FilteredSub> _filtered;
+	std::size_t _filter_idcnt = 0;
+	std::atomic<bool> _has_filters = false;
+	KeyExtractor _key_extractor;
 
-	void do_unsubscribe();
+	void grow();
+	TopicUpdateCallback remove_slot(const PSlot &slot);
+	std::vector<TopicUpdateCallback> leave_cycle();
+	void replay(Slot &slot, std::vector<PValue> &&values);
+	bool deliver(Slot &slot, const std::string_view &v);
+	bool publish_values(const std::string_view *values, std::size_t count);
+	bool publish_filtered(const std::string_view &v);
+	void forget_filtered(std::size_t id);
+	void remove_group_if_empty(const PFilterGroup &group);
+	void reset_filtered();
+	void install_parallel(std::shared_ptr<Parallel> &&par);
+	static bool publish_parallel(Parallel &par, const std::string_view &v);
+	static bool shard_full(Parallel &par, Shard &shard);
+	static void run_shard(std::shared_ptr<Parallel> par, Shard &shard);
 
 };
 
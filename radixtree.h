@@ -0,0 +1,180 @@
+/*
+ * radixtree.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_RADIXTREE_H_d0923jd0239dj0ewjdw
+#define LIB_UMQ_RADIXTREE_H_d0923jd0239dj0ewjdw
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace umq {
+
+///Compressed radix tree (patricia trie) indexed by strings
+/**
+ * Every key is stored as path of edges labeled by parts of the key. Edges
+ * are compressed, so the depth of the tree is limited by count of branches,
+ * not by length of the keys.
+ *
+ * Lookup is performed in O(key length) and it doesn't allocate memory. It
+ * is possible to walk all values stored along the path of the key, which
+ * allows to find longest prefix match.
+ *
+ * @tparam T type of value stored at nodes. It must be default constructible
+ */
+template<typename T>
+class RadixTree {
+public:
+
+    ///Retrieve value for given key, create it if doesn't exist
+    /**
+     * @param key key
+     * @return reference to value (default constructed, if it is new)
+     */
+    T &operator[](std::string_view key);
+
+    ///Find exact key
+    /**
+     * @param key key to search
+     * @return pointer to value or nullptr, if not found
+     */
+    const T *find(std::string_view key) const;
+
+    ///Walk all values stored along the path of the key
+    /**
+     * @param key key to walk
+     * @param fn function receives (const T &value, std::size_t prefix_len). It is
+     * called for each key, which is prefix of given key (including the key itself),
+     * from the shortest to the longest
+     */
+    template<typename Fn>
+    void walk(std::string_view key, Fn &&fn) const;
+
+    ///Find longest key which is prefix of given key
+    /**
+     * @param key key to search
+     * @param pred predicate which receives value. Only values passed the predicate
+     * are considered
+     * @return pointer to value or nullptr
+     */
+    template<typename Pred>
+    const T *find_longest_prefix(std::string_view key, Pred &&pred) const;
+
+    ///Remove all items
+    void clear();
+
+    ///Returns true if the tree is empty
+    bool empty() const {return _root.children.empty() && !_root.used;}
+
+protected:
+
+    struct Node {
+        std::string label;
+        std::vector<std::unique_ptr<Node> > children;
+        T value = {};
+        bool used = false;
+
+        const Node *find_child(char c) const {
+            auto iter = std::lower_bound(children.begin(), children.end(), c, cmp_first);
+            if (iter != children.end() && (*iter)->label[0] == c) return iter->get();
+            return nullptr;
+        }
+
+        static bool cmp_first(const std::unique_ptr<Node> &n, char c) {
+            return n->label[0] < c;
+        }
+    };
+
+    Node _root;
+};
+
+template<typename T>
+inline T &RadixTree<T>::operator[](std::string_view key) {
+    Node *nd = &_root;
+    while (!key.empty()) {
+        auto iter = std::lower_bound(nd->children.begin(), nd->children.end(), key[0], Node::cmp_first);
+        if (iter == nd->children.end() || (*iter)->label[0] != key[0]) {
+            auto n = std::make_unique<Node>();
+            n->label = std::string(key);
+            n->used = true;
+            Node *r = n.get();
+            nd->children.insert(iter, std::move(n));
+            return r->value;
+        }
+        Node *ch = iter->get();
+        std::string_view lb = ch->label;
+        std::size_t common = 0;
+        std::size_t mx = std::min(lb.size(), key.size());
+        while (common < mx && lb[common] == key[common]) ++common;
+        if (common < lb.size()) {
+            //split the edge
+            auto mid = std::make_unique<Node>();
+            mid->label = std::string(lb.substr(0, common));
+            ch->label.erase(0, common);
+            mid->children.push_back(std::move(*iter));
+            *iter = std::move(mid);
+            ch = iter->get();
+        }
+        nd = ch;
+        key = key.substr(common);
+    }
+    nd->used = true;
+    return nd->value;
+}
+
+template<typename T>
+inline const T *RadixTree<T>::find(std::string_view key) const {
+    const Node *nd = &_root;
+    while (!key.empty()) {
+        nd = nd->find_child(key[0]);
+        if (nd == nullptr) return nullptr;
+        std::string_view lb = nd->label;
+        if (key.compare(0, lb.size(), lb) != 0) return nullptr;
+        key = key.substr(lb.size());
+    }
+    return nd->used?&nd->value:nullptr;
+}
+
+template<typename T>
+template<typename Fn>
+inline void RadixTree<T>::walk(std::string_view key, Fn &&fn) const {
+    const Node *nd = &_root;
+    std::size_t pos = 0;
+    while (true) {
+        if (nd->used) fn(static_cast<const T &>(nd->value), pos);
+        if (pos == key.size()) break;
+        nd = nd->find_child(key[pos]);
+        if (nd == nullptr) break;
+        std::string_view lb = nd->label;
+        if (key.compare(pos, lb.size(), lb) != 0) break;
+        pos += lb.size();
+    }
+}
+
+template<typename T>
+template<typename Pred>
+inline const T *RadixTree<T>::find_longest_prefix(std::string_view key, Pred &&pred) const {
+    const T *r = nullptr;
+    walk(key, [&](const T &v, std::size_t) {
+        if (pred(v)) r = &v;
+    });
+    return r;
+}
+
+template<typename T>
+inline void RadixTree<T>::clear() {
+    _root.children.clear();
+    _root.used = false;
+    _root.value = T();
+}
+
+}
+
+
+
+#endif /* LIB_UMQ_RADIXTREE_H_d0923jd0239dj0ewjdw */
@@ -0,0 +1,337 @@
+#include "reconnect.h"
+
+#include <shared/trailer.h>
+#include <userver/scheduler.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace umq {
+
+PReconnectingPeer ReconnectingPeer::make(ConnectFn &&connect, const Backoff &backoff) {
+    return PReconnectingPeer(new ReconnectingPeer(std::move(connect), backoff));
+}
+
+ReconnectingPeer::ReconnectingPeer(ConnectFn &&connect, const Backoff &backoff)
+:_connect(std::move(connect)),_backoff(backoff) {}
+
+ReconnectingPeer::~ReconnectingPeer() {
+    stop();
+}
+
+void ReconnectingPeer::start(const std::string_view &hello, ConnectEvent &&on_connect) {
+    {
+        std::lock_guard _(_lock);
+        if (!_stopped) return;
+        _stopped = false;
+        _attempt = 0;
+        _hello = hello;
+        _on_connect = std::make_shared<ConnectEvent>(std::move(on_connect));
+    }
+    connect();
+}
+
+void ReconnectingPeer::stop() {
+    PPeer peer;
+    PendingCalls calls;
+    {
+        std::lock_guard _(_lock);
+        if (_stopped) return;
+        _stopped = true;
+        _connected = false;
+        ++_gen;
+        peer = std::move(_peer);
+        std::swap(calls, _calls);
+    }
+    peer.reset();
+    for (auto &x: calls) {
+        if (x.second.result != nullptr) x.second.result(Response(Response::Type::disconnected, Payload()));
+    }
+}
+
+void ReconnectingPeer::set_methods(const PMethodList &methods) {
+    PPeer peer;
+    {
+        std::lock_guard _(_lock);
+        _methods = methods;
+        peer = _peer;
+    }
+    if (peer != nullptr) peer->set_methods(methods);
+}
+
+PPeer ReconnectingPeer::get_peer() const {
+    std::lock_guard _(_lock);
+    return _peer;
+}
+
+bool ReconnectingPeer::is_connected() const {
+    std::lock_guard _(_lock);
+    return _connected;
+}
+
+void ReconnectingPeer::call(const std::string_view &method, const Payload &params,
+        ResponseCallback &&result, bool idempotent) {
+    std::unique_lock lk(_lock);
+    if (!_connected && !idempotent) {
+        lk.unlock();
+        result(Response(Response::Type::disconnected, Payload()));
+        return;
+    }
+    unsigned int id = ++_call_id;
+    unsigned int gen = _connected?_gen:0;
+    _calls.emplace(id, PendingCall{
+        std::string(method),
+        PayloadStr(std::string(params), params.attachments),
+        std::move(result),
+        idempotent,
+        gen});
+    PPeer peer = _connected?_peer:nullptr;
+    lk.unlock();
+    if (peer != nullptr) send_call(peer, id, gen, method, params);
+}
+
+void ReconnectingPeer::subscribe(const std::string_view &topic, const std::string_view &method,
+        const Payload &params, TopicUpdateCallback &&cb, ResponseCallback &&result) {
+    std::unique_lock lk(_lock);
+    auto ins = _subs.try_emplace(std::string(topic));
+    Subscription &sub = ins.first->second;
+    sub.method = method;
+    sub.params = PayloadStr(std::string(params), params.attachments);
+    sub.cb = std::make_shared<TopicUpdateCallback>(std::move(cb));
+    if (result != nullptr) sub.result = std::make_shared<ResponseCallback>(std::move(result));
+    else sub.result.reset();
+    if (_connected) {
+        PPeer peer = _peer;
+        unsigned int gen = _gen;
+        Subscription s = sub;
+        lk.unlock();
+        //the peer keeps the first callback of the topic, replace it
+        if (!ins.second) peer->unsubscribe(topic);
+        send_subscribe(peer, gen, std::string(topic), s);
+    }
+}
+
+void ReconnectingPeer::unsubscribe(const std::string_view &topic) {
+    std::unique_lock lk(_lock);
+    auto iter = _subs.find(topic);
+    if (iter == _subs.end()) return;
+    _subs.erase(iter);
+    PPeer peer = _connected?_peer:nullptr;
+    lk.unlock();
+    if (peer != nullptr) peer->unsubscribe(topic);
+}
+
+void ReconnectingPeer::set_var(const std::string_view &name, const std::optional<std::string> &value) {
+    std::unique_lock lk(_lock);
+    if (value.has_value()) {
+        auto iter = _vars.find(name);
+        if (iter == _vars.end()) _vars.emplace(std::string(name), *value);
+        else iter->second = *value;
+    } else {
+        auto iter = _vars.find(name);
+        if (iter != _vars.end()) _vars.erase(iter);
+    }
+    PPeer peer = _connected?_peer:nullptr;
+    lk.unlock();
+    if (peer != nullptr) peer->local.set(name, value);
+}
+
+void ReconnectingPeer::connect() {
+    {
+        std::lock_guard _(_lock);
+        if (_stopped) return;
+    }
+    _connect([wk = weak_from_this()](PConnection &&conn) {
+        auto me = wk.lock();
+        if (me != nullptr) me->on_connect(std::move(conn));
+    });
+}
+
+std::chrono::milliseconds ReconnectingPeer::next_delay() {
+    unsigned int a = _attempt++;
+    auto d = _backoff.initial;
+    for (unsigned int i = 0; i < a && d < _backoff.max; i++) d *= _backoff.multiplier;
+    d = std::min(d, _backoff.max);
+    //half of the delay is fixed, other half is random - spreads reconnects of many clients
+    static thread_local std::minstd_rand rnd(std::random_device{}());
+    auto half = d.count()/2;
+    std::uniform_int_distribution<decltype(half)> dist(0, half);
+    return std::chrono::milliseconds(d.count() - half + dist(rnd));
+}
+
+void ReconnectingPeer::schedule_reconnect() {
+    std::chrono::milliseconds delay;
+    {
+        std::lock_guard _(_lock);
+        if (_stopped) return;
+        delay = next_delay();
+    }
+    userver::After(delay) >> [wk = weak_from_this()] {
+        auto me = wk.lock();
+        if (me != nullptr) me->connect();
+    };
+}
+
+void ReconnectingPeer::on_connect(PConnection &&conn) {
+    if (conn == nullptr) {
+        schedule_reconnect();
+        return;
+    }
+    PPeer peer = Peer::make();
+    PPeer old;
+    PMethodList methods;
+    std::string hello;
+    unsigned int gen;
+    {
+        std::lock_guard _(_lock);
+        if (_stopped) return;
+        gen = ++_gen;
+        old = std::move(_peer);
+        _peer = peer;
+        _connected = false;
+        methods = _methods;
+        hello = _hello;
+    }
+    old.reset();
+    auto wk = weak_from_this();
+    peer->on_disconnect([wk, gen] {
+        auto me = wk.lock();
+        if (me != nullptr) me->on_disconnect(gen);
+    });
+    if (methods != nullptr) peer->set_methods(methods);
+    peer->init_client(std::move(conn), Payload(hello), [wk, gen](const Payload &welcome) {
+        auto me = wk.lock();
+        if (me != nullptr) me->on_welcome(gen, welcome);
+    });
+}
+
+void ReconnectingPeer::on_welcome(unsigned int gen, const Payload &welcome) {
+    struct Resend {
+        unsigned int id;
+        std::string method;
+        PayloadStr params;
+    };
+    PPeer peer;
+    Vars vars;
+    Subscriptions subs;
+    std::shared_ptr<ConnectEvent> on_connect;
+    std::vector<Resend> resend;
+    {
+        std::lock_guard _(_lock);
+        if (_stopped || gen != _gen) return;
+        _connected = true;
+        _attempt = 0;
+        peer = _peer;
+        vars = _vars;
+        subs = _subs;
+        on_connect = _on_connect;
+        for (auto &x: _calls) {
+            if (x.second.gen != gen) {
+                x.second.gen = gen;
+                resend.push_back({x.first, x.second.method, x.second.params});
+            }
+        }
+    }
+    if (!vars.empty()) peer->local.set(vars);
+    for (const auto &x: subs) send_subscribe(peer, gen, x.first, x.second);
+    for (const auto &x: resend) send_call(peer, x.id, gen, x.method, x.params);
+    if (on_connect != nullptr && *on_connect != nullptr) (*on_connect)(peer, welcome);
+}
+
+void ReconnectingPeer::on_disconnect(unsigned int gen) {
+    {
+        std::lock_guard _(_lock);
+        if (_stopped || gen != _gen) return;
+        _connected = false;
+    }
+    schedule_reconnect();
+}
+
+void ReconnectingPeer::send_call(const PPeer &peer, unsigned int id, unsigned int gen,
+        const std::string_view &method, const Payload &params) {
+    peer->call(method, params, [wk = weak_from_this(), id, gen](Response &&resp) {
+        auto me = wk.lock();
+        if (me != nullptr) me->on_response(id, gen, std::move(resp));
+    });
+}
+
+void ReconnectingPeer::on_response(unsigned int id, unsigned int gen, Response &&resp) {
+    std::unique_lock lk(_lock);
+    auto iter = _calls.find(id);
+    //response to a call which has been already sent through newer connection
+    if (iter == _calls.end() || iter->second.gen != gen) return;
+    if (resp.is_disconnected() && iter->second.idempotent && !_stopped) {
+        iter->second.gen = 0;
+        return;
+    }
+    ResponseCallback cb = std::move(iter->second.result);
+    _calls.erase(iter);
+    lk.unlock();
+    if (cb != nullptr) cb(std::move(resp));
+}
+
+void ReconnectingPeer::send_subscribe(const PPeer &peer, unsigned int gen,
+        const std::string &topic, const Subscription &sub) {
+    auto wk = weak_from_this();
+    //detects topic close by publisher - the callback is destroyed
+    auto closed = ondra_shared::trailer([wk, topic, gen, cb = std::weak_ptr<TopicUpdateCallback>(sub.cb)]{
+        auto me = wk.lock();
+        if (me != nullptr) me->on_topic_closed(topic, gen, cb.lock());
+    });
+    peer->subscribe(topic, [wk, topic, closed = std::move(closed)](const Payload &data) {
+        auto me = wk.lock();
+        return me != nullptr && me->on_topic_update(topic, data);
+    });
+    peer->call(sub.method, sub.params, [wk, topic, gen, cb = std::weak_ptr<TopicUpdateCallback>(sub.cb)](Response &&resp) {
+        auto me = wk.lock();
+        if (me != nullptr) me->on_subscribe_response(topic, gen, cb.lock(), std::move(resp));
+    });
+}
+
+bool ReconnectingPeer::on_topic_update(const std::string &topic, const Payload &data) {
+    std::shared_ptr<TopicUpdateCallback> cb;
+    {
+        std::lock_guard _(_lock);
+        auto iter = _subs.find(topic);
+        if (iter == _subs.end()) return false;
+        cb = iter->second.cb;
+    }
+    if ((*cb)(data)) return true;
+    std::lock_guard _(_lock);
+    auto iter = _subs.find(topic);
+    if (iter != _subs.end() && iter->second.cb == cb) _subs.erase(iter);
+    return false;
+}
+
+void ReconnectingPeer::on_topic_closed(const std::string &topic, unsigned int gen,
+        const std::shared_ptr<TopicUpdateCallback> &cb) {
+    std::lock_guard _(_lock);
+    //topic closed by publisher - callback is destroyed while the connection is active
+    if (_stopped || !_connected || gen != _gen) return;
+    auto iter = _subs.find(topic);
+    //the subscription could be replaced by a new one
+    if (iter != _subs.end() && iter->second.cb == cb) _subs.erase(iter);
+}
+
+void ReconnectingPeer::on_subscribe_response(const std::string &topic, unsigned int gen,
+        const std::shared_ptr<TopicUpdateCallback> &cb, Response &&resp) {
+    if (resp.is_disconnected()) return;
+    std::shared_ptr<ResponseCallback> result;
+    PPeer peer;
+    {
+        std::lock_guard _(_lock);
+        if (gen != _gen) return;
+        auto iter = _subs.find(topic);
+        //response of a replaced subscription is ignored
+        if (iter == _subs.end() || iter->second.cb != cb) return;
+        result = iter->second.result;
+        if (!resp.is_result()) {
+            _subs.erase(iter);
+            peer = _peer;
+        }
+    }
+    if (peer != nullptr) peer->unsubscribe(topic);
+    if (result != nullptr) (*result)(std::move(resp));
+}
+
+}
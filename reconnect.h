@@ -0,0 +1,193 @@
+/*
+ * reconnect.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_RECONNECT_H_doiwe2093jd029dj023d
+#define LIB_UMQ_RECONNECT_H_doiwe2093jd029dj023d
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "peer.h"
+
+namespace umq {
+
+class ReconnectingPeer;
+
+using PReconnectingPeer = std::shared_ptr<ReconnectingPeer>;
+
+///Backoff settings of ReconnectingPeer
+struct ReconnectBackoff {
+    ///delay after first failure
+    std::chrono::milliseconds initial = std::chrono::milliseconds(100);
+    ///maximum delay
+    std::chrono::milliseconds max = std::chrono::milliseconds(30000);
+    ///multiplier of the delay for every next attempt
+    unsigned int multiplier = 2;
+};
+
+///Client peer which reconnects automatically
+/**
+ * The Peer object is single-use, after disconnect a new Peer must be created.
+ * This class does it automatically. It creates new connection using a connect
+ * function, waits with exponential backoff between attempts and after the
+ * Welcome message arrives, it restores the state of the previous connection:
+ *
+ * - local variables (sent in single batch)
+ * - subscriptions (the subscribe request is repeated)
+ * - pending idempotent calls (they are sent again)
+ *
+ * All restore messages are sent at once without waiting for responses.
+ */
+class ReconnectingPeer: public std::enable_shared_from_this<ReconnectingPeer> {
+public:
+
+    using PConnection = std::unique_ptr<AbstractConnection>;
+    ///Receives new connection, nullptr when connect failed
+    using ConnectCallback = ondra_shared::Callback<void(PConnection &&conn)>;
+    ///Connect function - must create connection and pass it to the callback
+    using ConnectFn = ondra_shared::Callback<void(ConnectCallback &&cb)>;
+    ///Called when connection is established and the state has been restored
+    using ConnectEvent = ondra_shared::Callback<void(const PPeer &peer, const Payload &welcome)>;
+
+    using Backoff = ReconnectBackoff;
+
+    ///Create instance
+    /**
+     * @param connect function which creates connection
+     * @param backoff backoff settings
+     */
+    static PReconnectingPeer make(ConnectFn &&connect, const Backoff &backoff = Backoff());
+
+    ~ReconnectingPeer();
+
+    ///Start connecting
+    /**
+     * @param hello payload sent with Hello message
+     * @param on_connect function called after every successful connect
+     */
+    void start(const std::string_view &hello, ConnectEvent &&on_connect = nullptr);
+
+    ///Stop reconnecting and disconnect
+    /** Pending calls are finished as disconnected */
+    void stop();
+
+    ///Sets method list of the peer (applied to every new connection)
+    void set_methods(const PMethodList &methods);
+
+    ///Retrieves current peer
+    /** @return current peer or nullptr. Note that peer can be disconnected */
+    PPeer get_peer() const;
+
+    ///Determines, whether peer is connected and Welcome has been received
+    bool is_connected() const;
+
+    ///Perform RPC call
+    /**
+     * @param method method
+     * @param params parameters
+     * @param result callback which handles result
+     * @param idempotent set true, if the call can be repeated. Such call is
+     * sent again after reconnect, when the connection is lost before the
+     * response arrives. It is also queued while the peer is not connected.
+     * Non-idempotent call is finished as disconnected in such case
+     */
+    void call(const std::string_view &method, const Payload &params, ResponseCallback &&result, bool idempotent = false);
+
+    ///Subscribe the topic
+    /**
+     * Registers topic and calls method, which performs subscription on the
+     * other side. Both is repeated after every reconnect
+     *
+     * @param topic topic id
+     * @param method method which subscribes the topic
+     * @param params parameters of the method
+     * @param cb callback function called for the topic update. Return false
+     * to unsubscribe
+     * @param result optional callback which receives response of the subscribe request (after
+     * every reconnect). If the response is not a result, the subscription is removed
+     */
+    void subscribe(const std::string_view &topic, const std::string_view &method, const Payload &params,
+            TopicUpdateCallback &&cb, ResponseCallback &&result = nullptr);
+
+    ///Unsubscribe the topic
+    void unsubscribe(const std::string_view &topic);
+
+    ///Set local variable (restored after reconnect)
+    /**
+     * @param name name of variable
+     * @param value value, use empty value to delete the variable
+     */
+    void set_var(const std::string_view &name, const std::optional<std::string> &value);
+
+protected:
+
+    ReconnectingPeer(ConnectFn &&connect, const Backoff &backoff);
+
+    struct PendingCall {
+        std::string method;
+        PayloadStr params;
+        ResponseCallback result;
+        bool idempotent;
+        ///generation of connection, where the call has been sent. 0 - not sent
+        unsigned int gen;
+    };
+
+    struct Subscription {
+        std::string method;
+        PayloadStr params;
+        std::shared_ptr<TopicUpdateCallback> cb;
+        std::shared_ptr<ResponseCallback> result;
+    };
+
+    using PendingCalls = std::map<unsigned int, PendingCall>;
+    using Subscriptions = std::map<std::string, Subscription, std::less<> >;
+    using Vars = Peer::VarSpace<std::string, std::equal_to<std::string> >::Map;
+
+    ConnectFn _connect;
+    Backoff _backoff;
+    std::string _hello;
+    ///shared, so the callback can be called without the lock, while start() replaces it
+    std::shared_ptr<ConnectEvent> _on_connect;
+    PMethodList _methods;
+
+    mutable std::mutex _lock;
+    PPeer _peer;
+    ///generation of current connection
+    unsigned int _gen = 0;
+    ///count of failed attempts
+    unsigned int _attempt = 0;
+    unsigned int _call_id = 0;
+    bool _connected = false;
+    bool _stopped = true;
+    PendingCalls _calls;
+    Subscriptions _subs;
+    Vars _vars;
+
+    void connect();
+    void schedule_reconnect();
+    std::chrono::milliseconds next_delay();
+    void on_connect(PConnection &&conn);
+    void on_welcome(unsigned int gen, const Payload &welcome);
+    void on_disconnect(unsigned int gen);
+    void on_response(unsigned int id, unsigned int gen, Response &&resp);
+    bool on_topic_update(const std::string &topic, const Payload &data);
+    void on_topic_closed(const std::string &topic, unsigned int gen, const std::shared_ptr<TopicUpdateCallback> &cb);
+    void on_subscribe_response(const std::string &topic, unsigned int gen,
+            const std::shared_ptr<TopicUpdateCallback> &cb, Response &&resp);
+
+    void send_call(const PPeer &peer, unsigned int id, unsigned int gen, const std::string_view &method, const Payload &params);
+    void send_subscribe(const PPeer &peer, unsigned int gen, const std::string &topic, const Subscription &sub);
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_RECONNECT_H_doiwe2093jd029dj023d */
@@ -24,6 +24,11 @@ RequestBase::RequestBase(RequestBase &&other)
     ,_method_name(std::move(other._method_name))
     ,_response_sent(std::move(other._response_sent)) {
     other._response_sent = true; 
+#ifdef UMQ_ENABLE_METRICS
+    _latency = other._latency;
+    _start = other._start;
+    other._latency = nullptr;
+#endif
 }
 
 
@@ -51,6 +56,7 @@ void Request::send_result(const Payload &val) {
 		nd->send_result(_id,val);
 	}
 	_response_sent = true;
+	record_latency();
 }
 
 void Request::send_exception(const Payload &val) {
@@ -60,6 +66,7 @@ void Request::send_exception(const Payload &val) {
 		nd->send_exception(_id,val);
 	}
 	_response_sent = true;
+	record_latency();
 }
 
 void Request::send_exception(int code, const std::string_view &message) {
@@ -77,6 +84,7 @@ void Request::send_execute_error(const Payload &reason) {
 		nd->send_execute_error(_id,reason);
 	}
 	_response_sent = true;
+	record_latency();
 }
 
 
@@ -5,6 +5,7 @@
 #include <shared/callback.h>
 #include <vector>
 #include "payload.h"
+#include "metrics.h"
 
 namespace umq {
 
@@ -60,6 +61,13 @@ public:
         return _method_name;
     }
 
+#ifdef UMQ_ENABLE_METRICS
+    ///Starts measuring latency of the request. It is recorded when response is sent
+    void start_latency(LatencyHistogram *h) {
+        _latency = h;
+        _start = std::chrono::steady_clock::now();
+    }
+#endif
 
 protected:
     PWkPeer _peer;
@@ -67,6 +75,19 @@ protected:
     std::string_view _id;
     std::string_view _method_name;    
     bool _response_sent;
+#ifdef UMQ_ENABLE_METRICS
+    LatencyHistogram *_latency = nullptr;
+    std::chrono::steady_clock::time_point _start;
+
+    void record_latency() {
+        if (_latency) {
+            _latency->record_since(_start);
+            _latency = nullptr;
+        }
+    }
+#else
+    void record_latency() {}
+#endif
     
 };
 
@@ -131,6 +152,8 @@ public:
         execute_error,
         ///response is empty, request was not processed because peer is disconnected
         disconnected,
+        ///response is empty, request was not sent because call window and queue are full
+        rejected,
 
     };
 
@@ -159,6 +182,7 @@ public:
     bool is_exception() const {return _t == Type::exception;}
     bool is_execute_error() const {return _t == Type::execute_error;}
     bool is_disconnected() const {return _t == Type::disconnected;}
+    bool is_rejected() const {return _t == Type::rejected;}
 protected:
     Type _t;
     std::vector<char> _text;
@@ -178,6 +202,10 @@ struct DiscoverResponse {
     std::string error;
     ///doc is valid (ignore methods and routes)
     bool isdoc = false;
+    ///version of the method list (0 if not reported)
+    std::size_t version = 0;
+    ///listing was not changed since known version (methods and routes are empty)
+    bool unchanged = false;
 };
 
 ///Discover request for a route/proxy
@@ -9,13 +9,40 @@
 
 
 #include "tcpconnection.h"
+#include "tracing.h"
 
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
 #include <future>
+#include <stdexcept>
 namespace umq {
 
+///maximum time to wait for the socket while a file is transferred
+static constexpr auto send_file_timeout = std::chrono::seconds(60);
+///maximum count of parts written by single writev
+static constexpr std::size_t max_write_parts = 64;
+
 TCPConnection::TCPConnection(userver::Stream &&stream)
 :_stream(userver::createBufferedStream(std::move(stream))) {}
 
+TCPConnection::TCPConnection(userver::Stream &&stream, int socket, userver::AsyncProvider provider)
+:_stream(std::move(stream)) {
+    if (provider == nullptr) throw std::invalid_argument("TCPConnection: no async provider to send files");
+    _output = std::make_shared<Output>(socket, std::move(provider));
+}
+
+TCPConnection::~TCPConnection() {
+    if (_output) {
+        //pending waits keep the state, but they must not touch the socket
+        std::lock_guard _(_output->io);
+        _output->closed = true;
+    }
+}
+
 void TCPConnection::start_listen(AbstractConnectionListener &listener) {
     listener_loop(listener);
 }
@@ -48,8 +75,14 @@ void TCPConnection::listener_loop(AbstractConnectionListener &listener) {
                     case ReadStage::size: 
                         _msg_size = (_msg_size << 7) | (buff[0] & 0x7F);
                         if ((buff[0] & 0x80) == 0) {
-                            _msg_stage = ReadStage::content;
+                            if (_msg_size) {
+                                _msg_stage = ReadStage::content;
+                            } else {
+                                process_frame(listener,_msg_type, std::string_view());
+                                _msg_stage = ReadStage::type;
+                            }
                         }
+                        buff = buff.substr(1);
                         break;
                     case ReadStage::content: 
                         data = buff.substr(0, _msg_size);
@@ -65,6 +98,7 @@ void TCPConnection::listener_loop(AbstractConnectionListener &listener) {
                                 process_frame(listener,_msg_type, _msg_buffer);
                             }
                             _msg_buffer.clear();
+                            _msg_stage = ReadStage::type;
                         }
                 }
             }
@@ -88,29 +122,88 @@ void TCPConnection::send_ping() {
 void TCPConnection::flush() {
 }
 
+//7 bits per byte, most significant first, bit 0x80 marks that more bytes follow
 template<typename C>
-void create_number(std::size_t s, C &c) {
+void create_number(std::size_t s, C &c, char more = 0) {
     auto nx = s >> 7;
     auto t = s & 0x7F;
-    if (nx) {
-        create_number(nx, c);
-        c.push_back(static_cast<char>(t) | 0x80);
-    } else {
-        c.push_back(static_cast<char>(t));
-    }
+    if (nx) create_number(nx, c, static_cast<char>(0x80));
+    c.push_back(static_cast<char>(t) | more);
 }
 
 bool TCPConnection::send_message(Type type, const std::string_view &data) {
-    std::lock_guard _(_lk);
+    return send_message(type, data, std::string_view());
+}
+
+bool TCPConnection::send_message(Type type, const std::string_view &header, const std::string_view &body) {
+    std::size_t sz = header.size() + body.size();
+    char tc = type == Type::text_frame && !header.empty()?header[0]:0;
+    TraceScope _trc(TracePoint::conn_send, tc, std::string_view(), sz);
+    std::unique_lock lk(_lk);
     if (!_connected) return false;
+    //both parts are gathered directly to the output buffer
     _fmt_buffer.push_back(static_cast<char>(type));
-    create_number(data.length(), _fmt_buffer);
-    _fmt_buffer.append(data);
+    create_number(sz, _fmt_buffer);
+    _fmt_buffer.append(header);
+    _fmt_buffer.append(body);
+    if (_output) {
+        {
+            std::lock_guard _(_output->lk);
+            if (_output->failed) {
+                _fmt_buffer.clear();
+                return false;
+            }
+            append_output(*_output, _fmt_buffer);
+        }
+        _fmt_buffer.clear();
+        lk.unlock();
+        pump_output(_output);
+        return true;
+    }
+#ifdef UMQ_ENABLE_TRACING
+    std::shared_ptr<AbstractTracer> trc;
+    if (current_tracer.load(std::memory_order_relaxed)) trc = get_tracer();
+    if (trc) {
+        //measure how long the frame waits in the output buffer (the callback holds the tracer)
+        _connected = _stream.write_async(_fmt_buffer, [trc = std::move(trc), span = TraceSpan::start(TracePoint::output_wait, tc, std::string_view(), sz)](bool) mutable {
+            span.end_ns = TraceSpan::now();
+            trc->record(span);
+        });
+    } else
+#endif
     _connected = _stream.write_async(_fmt_buffer, nullptr);
     _fmt_buffer.clear();
     return true;
 }
 
+bool TCPConnection::send_message(MsgFrameType type, const std::string_view &header, const SharedBody &body) {
+    if (!_output) return send_message(type, header, std::string_view(*body));
+    Type t;
+    switch(type) {
+        default: return false;
+        case MsgFrameType::text: t = Type::text_frame; break;
+        case MsgFrameType::binary: t = Type::binary_frame; break;
+    }
+    std::size_t sz = header.size() + body->size();
+    char tc = t == Type::text_frame && !header.empty()?header[0]:0;
+    TraceScope _trc(TracePoint::conn_send, tc, std::string_view(), sz);
+    {
+        std::lock_guard _(_lk);
+        if (!_connected) return false;
+        std::lock_guard __(_output->lk);
+        if (_output->failed) return false;
+        //only the header is copied, the body is referenced until it is written
+        _fmt_buffer.push_back(static_cast<char>(t));
+        create_number(sz, _fmt_buffer);
+        _fmt_buffer.append(header);
+        append_output(*_output, _fmt_buffer);
+        _fmt_buffer.clear();
+        if (!body->empty()) _output->queue.emplace_back(body);
+    }
+    pump_output(_output);
+    return true;
+}
+
 bool TCPConnection::send_message(const MsgFrame &msg) {
     switch(msg.type) {
         default: return false;
@@ -121,8 +214,177 @@ bool TCPConnection::send_message(const MsgFrame &msg) {
     }
 }
 
+bool TCPConnection::send_message(MsgFrameType type, const std::string_view &header, const std::string_view &body) {
+    switch(type) {
+        default: return false;
+        case MsgFrameType::text:
+            return send_message(Type::text_frame, header, body);
+        case MsgFrameType::binary:
+            return send_message(Type::binary_frame, header, body);
+    }
+}
+
 void TCPConnection::send_pong(const std::string_view &data) {
     send_message(Type::pong_frame, data);
 }
 
+bool TCPConnection::send_file(const PFileAttachment &file) {
+    if (!_output) return AbstractConnection::send_file(file);
+    TraceScope _trc(TracePoint::conn_send, 0, std::string_view(), file->get_size());
+    {
+        std::lock_guard _(_lk);
+        if (!_connected) return false;
+        std::lock_guard __(_output->lk);
+        if (_output->failed) return false;
+        std::string hdr;
+        hdr.push_back(static_cast<char>(Type::binary_frame));
+        create_number(file->get_size(), hdr);
+        append_output(*_output, hdr);
+        _output->queue.emplace_back(file);
+    }
+    pump_output(_output);
+    return true;
+}
+
+void TCPConnection::append_output(Output &out, const std::string_view &data) {
+    if (out.queue.empty() || !std::holds_alternative<std::string>(out.queue.back())) {
+        out.queue.emplace_back(std::string());
+    }
+    std::get<std::string>(out.queue.back()).append(data);
+}
+
+void TCPConnection::pump_output(const POutput &out) {
+    std::lock_guard io(out->io);
+    if (out->closed) return;
+    //writes which finish immediately don't recurse, the next one is started here
+    do {
+        std::unique_lock lk(out->lk);
+        if (out->writing || out->failed || out->queue.empty()) return;
+        out->writing = true;
+        if (auto *file = std::get_if<PFileAttachment>(&out->queue.front())) {
+            out->file = std::move(*file);
+            out->queue.pop_front();
+            out->file_offset = static_cast<off_t>(out->file->get_offset());
+            out->file_remain = out->file->get_size();
+            lk.unlock();
+            //the transfer runs in the dispatcher, not in the thread, which sends the message
+            wait_writable(out);
+            return;
+        }
+        //frames up to the next file are written together
+        while (!out->queue.empty() && out->parts.size() < max_write_parts
+                && !std::holds_alternative<PFileAttachment>(out->queue.front())) {
+            out->parts.push_back(std::move(out->queue.front()));
+            out->queue.pop_front();
+        }
+        out->part_index = 0;
+        out->part_offset = 0;
+    } while (transfer(out));
+}
+
+void TCPConnection::end_write(const POutput &out, bool ok) {
+    std::lock_guard io(out->io);
+    std::lock_guard _(out->lk);
+    out->writing = false;
+    out->parts.clear();
+    out->file.reset();
+    if (!ok && !out->failed) {
+        //the frame can be incomplete, the stream can't continue
+        out->failed = true;
+        out->queue.clear();
+        if (!out->closed) ::shutdown(out->socket, SHUT_RDWR);
+    }
+}
+
+void TCPConnection::wait_writable(const POutput &out) {
+    std::lock_guard io(out->io);
+    if (out->closed) return;
+    //the callback holds the state, the wait can outlive the connection
+    out->provider->runAsync(
+            userver::AsyncResource(userver::SocketResource(userver::SocketResource::write, out->socket)),
+            [out](bool ok) {
+                if (!ok) end_write(out, false);
+                else if (!transfer(out)) return;
+                pump_output(out);
+            }, std::chrono::system_clock::now() + send_file_timeout);
+}
+
+static std::string_view part_data(const std::variant<std::string, SharedBody, PFileAttachment> &part) {
+    if (auto *s = std::get_if<std::string>(&part)) return *s;
+    return *std::get<SharedBody>(part);
+}
+
+bool TCPConnection::transfer(const POutput &out) {
+    //the destructor waits until the socket is released
+    std::lock_guard io(out->io);
+    if (out->closed) return false;
+    //only the owner of the write (writing) accesses the state of the write
+    while (out->file && out->file_remain) {
+        ssize_t r = ::sendfile(out->socket, out->file->get_fd(), &out->file_offset, out->file_remain);
+        if (r > 0) {
+            out->file_remain -= static_cast<std::size_t>(r);
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            wait_writable(out);
+            return false;
+        } else if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            //descriptor doesn't support sendfile, send the rest from the memory
+            try {
+                out->parts.emplace_back(FileAttachment(out->file->get_fd(), out->file_offset, out->file_remain, false).read());
+            } catch (...) {
+                end_write(out, false);
+                return true;
+            }
+            out->file_remain = 0;
+        } else {
+            //error, or the file has been truncated
+            end_write(out, false);
+            return true;
+        }
+    }
+    while (out->part_index < out->parts.size()) {
+        iovec iov[max_write_parts];
+        std::size_t cnt = 0;
+        std::size_t total = 0;
+        for (std::size_t i = out->part_index; i < out->parts.size() && cnt < max_write_parts; i++) {
+            std::string_view d = part_data(out->parts[i]);
+            if (i == out->part_index) d = d.substr(out->part_offset);
+            iov[cnt].iov_base = const_cast<char *>(d.data());
+            iov[cnt].iov_len = d.size();
+            total += d.size();
+            ++cnt;
+        }
+        if (!total) break;
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        //sendmsg is writev, which doesn't raise SIGPIPE
+        ssize_t r = ::sendmsg(out->socket, &msg, MSG_NOSIGNAL);
+        if (r > 0) {
+            std::size_t w = static_cast<std::size_t>(r);
+            while (w) {
+                std::size_t rem = part_data(out->parts[out->part_index]).size() - out->part_offset;
+                if (w < rem) {
+                    out->part_offset += w;
+                    break;
+                }
+                w -= rem;
+                out->part_offset = 0;
+                ++out->part_index;
+            }
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            wait_writable(out);
+            return false;
+        } else {
+            end_write(out, false);
+            return true;
+        }
+    }
+    end_write(out, true);
+    return true;
+}
+
 }
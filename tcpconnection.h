@@ -7,9 +7,16 @@
 
 #ifndef _LIB_UMQ_TCPCONNECTION_H_9032udw0du289djhioewrfj4350
 #define _LIB_UMQ_TCPCONNECTION_H_9032udw0du289djhioewrfj4350
+#include <userver/async_provider.h>
 #include <userver/stream.h>
 #include <atomic>
 #include <cstddef>
+#include <sys/types.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <variant>
+#include <vector>
 
 #include "message.h"
 #include "connection.h"
@@ -21,6 +28,23 @@ public:
 
     TCPConnection( userver::Stream &&stream);
 
+    ///Construct connection which can send files without copying
+    /**
+     * @param stream stream used to read the socket. The connection writes
+     * directly to the socket, it queues the output itself. Frames are written by
+     * writev() (a shared body is not copied), and file attachments are sent by sendfile()
+     * once all previous frames are written
+     * @param socket native handle of the socket of the stream (non-blocking). The connection
+     * doesn't take ownership of the handle, but it doesn't touch the handle after
+     * the connection is destroyed
+     * @param provider async provider, which waits for the socket during the file transfer.
+     * Default is the provider of the current thread
+     * @exception std::invalid_argument no provider (the connection is not created in
+     * a thread of the dispatcher and no provider is given)
+     */
+    TCPConnection( userver::Stream &&stream, int socket,
+            userver::AsyncProvider provider = userver::getCurrentAsyncProvider());
+
     TCPConnection(const TCPConnection &) = delete;
     TCPConnection &operator=(const TCPConnection &) = delete;
 
@@ -29,7 +53,10 @@ public:
     virtual void start_listen(AbstractConnectionListener &listener) override;
     virtual void flush() override;
     virtual bool send_message(const MsgFrame &msg) override;
+    virtual bool send_message(MsgFrameType type, const std::string_view &header, const std::string_view &body) override;
+    virtual bool send_message(MsgFrameType type, const std::string_view &header, const SharedBody &body) override;
     virtual bool is_hwm(std::size_t v) override;
+    virtual bool send_file(const PFileAttachment &file) override;
 
 protected:
 
@@ -61,17 +88,77 @@ protected:
     
     std::mutex _lk;
     std::string _fmt_buffer;
-    
+
+    ///Part of the output: data, shared body or file
+    using OutputPart = std::variant<std::string, SharedBody, PFileAttachment>;
+
+    ///State of the output written directly to the socket
+    /**
+     * The state is shared with pending waits for the socket, so they can finish
+     * after the connection is destroyed
+     */
+    struct Output {
+        ///guards the socket and the state of the current write, the destructor closes the output under this lock
+        std::recursive_mutex io;
+        ///the connection is destroyed, the socket must not be touched
+        bool closed = false;
+        int socket;
+        ///provider which waits for the socket
+        userver::AsyncProvider provider;
+
+        ///guards the queue and the flags below
+        std::mutex lk;
+        ///parts waiting to be written
+        std::deque<OutputPart> queue;
+        ///a write or a file transfer is in progress - only one writer owns the socket
+        bool writing = false;
+        ///write failed, the stream can't continue
+        bool failed = false;
+
+        ///parts being written by writev (data and shared bodies)
+        std::vector<OutputPart> parts;
+        ///index of the first part which is not fully written
+        std::size_t part_index = 0;
+        ///count of bytes of this part which are already written
+        std::size_t part_offset = 0;
+        ///file being transferred
+        PFileAttachment file;
+        off_t file_offset = 0;
+        std::size_t file_remain = 0;
+
+        Output(int socket, userver::AsyncProvider &&provider)
+            :socket(socket),provider(std::move(provider)) {}
+    };
+    using POutput = std::shared_ptr<Output>;
+
+    ///output written directly to the socket, nullptr if the socket is not known (files are read to the memory)
+    POutput _output;
+
     void process_frame(AbstractConnectionListener &listener, Type type, std::string_view data);
     
     bool send_message(Type type, const std::string_view &data);
+    bool send_message(Type type, const std::string_view &header, const std::string_view &body);
     
     void disconnect();
-    void finish_write(bool ok);
     void listen_cycle();
     void send_ping();
     void send_pong(const std::string_view &data);
 
+    ///appends data to the output queue (under lock)
+    static void append_output(Output &out, const std::string_view &data);
+    ///starts next write from the output queue, if there is no write in progress
+    static void pump_output(const POutput &out);
+    ///finishes the write or the file transfer, the next one is started by pump_output
+    static void end_write(const POutput &out, bool ok);
+    ///waits (asynchronously) until the socket is writable, then continues the write
+    static void wait_writable(const POutput &out);
+    ///writes the current parts or the current file until the socket is full
+    /**
+     * @retval true write is finished (or failed), next write can start
+     * @retval false waiting for the socket
+     */
+    static bool transfer(const POutput &out);
+
 
 
 };
@@ -0,0 +1,113 @@
+#include <userver/scheduler.h>
+#include <userver/static_webserver.h>
+#include "userver/websockets_server_handler.h"
+#include "userver/http_server.h"
+
+#include "../coro.h"
+#include "../wsconnection.h"
+
+static void forward_response(umq::Request &req, const umq::Response &resp) {
+    if (resp.is_result()) {
+        req.send_result(resp.get_data());
+    } else if (resp.is_exception()) {
+        req.send_exception(resp.get_data());
+    } else if (resp.is_execute_error()) {
+        req.send_execute_error(resp.get_data());
+    } else {
+        req.send_exception(503, "Call failed");
+    }
+}
+
+//calls the method on the client and returns its result
+static umq::coro::Task<> echo(umq::Request req) {
+    umq::PPeer peer = req.lock_peer();
+    std::string subname(req.get_method_name().substr(5));
+    std::string data(req.get_data());
+    umq::Response resp = co_await umq::coro::call(peer, subname, umq::Payload(data));
+    forward_response(req, resp);
+}
+
+//calls all methods listed in the argument (one per line), returns all results
+static umq::coro::Task<> fanout(umq::Request req) {
+    umq::PPeer peer = req.lock_peer();
+    std::string_view args = req.get_data();
+    std::string out;
+    while (!args.empty()) {
+        std::string method(userver::splitAt("\n", args));
+        if (method.empty()) continue;
+        co_await umq::coro::call_window(peer);
+        umq::Response resp = co_await umq::coro::call(peer, method, "");
+        out.append(method).append(": ").append(resp.get_data()).append("\n");
+    }
+    req.send_result(umq::Payload(out));
+}
+
+//returns total size of all attachments
+static umq::coro::Task<> attachment_size(umq::Request req) {
+    std::size_t total = 0;
+    for (const auto &att: req.get_data().attachments) {
+        std::string content = co_await umq::coro::attachment(att);
+        total += content.size();
+    }
+    req.send_result(umq::Payload(std::to_string(total)));
+}
+
+//subscribes topic on the client and republishes it back
+static umq::coro::Task<> mirror(umq::PPeer peer, std::string topic) {
+    auto pub = peer->start_publish(topic+"_mirror");
+    auto sub = umq::coro::TopicStream::subscribe(peer, topic);
+    while (auto v = co_await sub.next()) {
+        if (!pub(*v)) break;
+    }
+}
+
+int main(int argc, char **argv) {
+
+    using namespace userver;
+
+    auto addrs = NetAddr::fromString("*", "10000");
+    HttpServer server;
+
+    auto methods = umq::PMethodList::make();
+    {
+        auto m = methods.lock();
+        m->route("echo:") >> [](umq::Request &&req) {
+            echo(std::move(req)).detach();
+        };
+        m->method("fanout")
+            << "Calls methods listed in the argument (one per line) and returns their results" >>
+            [](umq::Request &&req) {
+                fanout(std::move(req)).detach();
+            };
+        m->method("attachment_size")
+            << "Returns total size of attachments" >>
+            [](umq::Request &&req) {
+                attachment_size(std::move(req)).detach();
+            };
+        m->method("mirror")
+            << "Subscribes topic on the client and publishes it back as <topic>_mirror. Argument: ID of topic" >>
+            [](umq::Request &&req) {
+                if (req.get_data().empty()) {
+                    req.send_exception(400, "Topic is not specified");
+                } else {
+                    mirror(req.lock_peer(), std::string(req.get_data())).detach();
+                    req.send_result("");
+                }
+            };
+    }
+
+    server.addPath("", StaticWebserver({"tests/web","index.html"}));
+
+    server.addPath("/ws", WebsocketServerHandler([=](WSStream &stream){
+        auto peer = umq::Peer::make();
+        peer->init_server(std::make_unique<umq::WSConnection>(std::move(stream)), nullptr);
+        peer->keep_until_disconnected();
+        peer->set_methods(methods);
+    }));
+    server.start(addrs, createAsyncProvider({1,4}));
+
+    setThreadAsyncProvider(server.getAsyncProvider());
+
+    server.stopOnSignal();
+    server.runAsWorker();
+}
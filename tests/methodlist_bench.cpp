@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../methodlist.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int services = 200;
+static constexpr int methods_per_service = 25;
+static constexpr int subroutes_per_service = 10;
+static constexpr int rounds = 20;
+
+template<typename Fn>
+void measure(const char *title, const std::vector<std::string> &names, Fn &&fn) {
+    std::size_t found = 0;
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (const auto &n: names) {
+            found += fn(n)?1:0;
+        }
+    }
+    auto dur = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-start).count();
+    std::size_t cnt = names.size()*rounds;
+    std::cout << title << ": " << cnt << " lookups, "
+              << static_cast<double>(dur)/cnt << " ns/lookup, found "
+              << found << std::endl;
+}
+
+int main(int argc, char **argv) {
+
+    umq::MethodList ml;
+    std::vector<std::string> method_names;
+    std::vector<std::string> route_names;
+    std::vector<std::string> miss_names;
+
+    int tag_method = 0, tag_route = 0, tag_subroute = 0;
+
+    for (int s = 0; s < services; s++) {
+        std::string svc = "Service" + std::to_string(s) + ":";
+        ml.route(svc) >> [&](umq::Request &&) {tag_route++;};
+        for (int m = 0; m < methods_per_service; m++) {
+            std::string name = svc + "method" + std::to_string(m);
+            ml.method(name) << "Documentation" >> [&](umq::Request &&) {tag_method++;};
+            method_names.push_back(name);
+        }
+        for (int r = 0; r < subroutes_per_service; r++) {
+            std::string sub = svc + "sub" + std::to_string(r) + ":";
+            ml.route(sub) >> [&](umq::Request &&) {tag_subroute++;};
+            route_names.push_back(sub + "anything");
+        }
+        miss_names.push_back("Unknown" + std::to_string(s) + ":method");
+    }
+
+    std::cout << "Registered " << ml.methods.size() << " methods and "
+              << ml.proxies.size() << " routes" << std::endl;
+
+    //verify, that nested routes are resolved to the longest prefix
+    const umq::MethodCall *m1 = ml.find_method("Service1:sub2:xyz");
+    const umq::MethodCall *m2 = ml.find_method("Service1:other");
+    const umq::MethodCall *m3 = ml.find_method("Service1:method3");
+    if (m1 != &ml.proxies["Service1:sub2:"].first
+        || m2 != &ml.proxies["Service1:"].first
+        || m3 != &ml.methods["Service1:method3"].first
+        || ml.find_method("Unknown:method") != nullptr) {
+        std::cerr << "Lookup returned unexpected result" << std::endl;
+        return 1;
+    }
+
+    //build index outside of measurement
+    ml.get_discover_listing();
+
+    measure("methods", method_names, [&](std::string_view n) {
+        return ml.find_method(n) != nullptr;
+    });
+    measure("routes", route_names, [&](std::string_view n) {
+        return ml.find_method(n) != nullptr;
+    });
+    measure("misses", miss_names, [&](std::string_view n) {
+        return ml.find_method(n) != nullptr;
+    });
+    measure("docs", method_names, [&](std::string_view n) {
+        return ml.find_doc(n) != nullptr;
+    });
+
+    return 0;
+}
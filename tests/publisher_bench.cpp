@@ -0,0 +1,82 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../publisher.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int initial_subscribers = 10000;
+static constexpr int churn_threads = 4;
+static constexpr auto duration = std::chrono::seconds(2);
+
+int main(int argc, char **argv) {
+
+    umq::Publisher pub;
+    std::atomic<std::size_t> delivered = 0;
+    std::atomic<bool> stop = false;
+    std::string msg(100, 'x');
+
+    auto subscriber = [&](const umq::Payload &data) {
+        if (!data.empty()) delivered.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    };
+
+    for (int i = 0; i < initial_subscribers; i++) {
+        pub.subscribe(subscriber);
+    }
+
+    std::vector<std::size_t> churn(churn_threads);
+    std::vector<std::uint64_t> churn_max_ns(churn_threads);
+    std::vector<std::thread> thrs;
+    for (int t = 0; t < churn_threads; t++) {
+        thrs.emplace_back([&, t] {
+            std::vector<std::size_t> ids;
+            std::size_t cnt = 0;
+            std::uint64_t max_ns = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto start = Clock::now();
+                if (ids.size() < 100) {
+                    ids.push_back(pub.subscribe(subscriber));
+                } else {
+                    pub.unsubscribe(ids[cnt % ids.size()]);
+                    ids[cnt % ids.size()] = pub.subscribe(subscriber);
+                }
+                std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-start).count();
+                if (ns > max_ns) max_ns = ns;
+                ++cnt;
+            }
+            for (auto id: ids) pub.unsubscribe(id);
+            churn[t] = cnt;
+            churn_max_ns[t] = max_ns;
+        });
+    }
+
+    std::size_t publishes = 0;
+    auto start = Clock::now();
+    while (Clock::now() - start < duration) {
+        pub.publish(msg);
+        ++publishes;
+    }
+    stop = true;
+    for (auto &t: thrs) t.join();
+    double secs = std::chrono::duration<double>(Clock::now()-start).count();
+
+    std::size_t churn_total = 0;
+    std::uint64_t churn_max = 0;
+    for (int t = 0; t < churn_threads; t++) {
+        churn_total += churn[t];
+        churn_max = std::max(churn_max, churn_max_ns[t]);
+    }
+
+    std::cout << "subscribers: " << initial_subscribers << ", churn threads: " << churn_threads << std::endl
+              << "publish: " << publishes/secs << " /s" << std::endl
+              << "deliveries: " << delivered.load()/secs << " /s" << std::endl
+              << "churn: " << churn_total/secs << " ops/s, max latency "
+              << churn_max/1000 << " us" << std::endl;
+
+    return 0;
+}
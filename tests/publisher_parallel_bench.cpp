@@ -0,0 +1,133 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../publisher.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int subscribers = 1000;
+static constexpr int publishes_per_thread = 2000;
+
+///Runs tasks in a single dedicated thread
+class Worker {
+public:
+    Worker():_thr([this]{run();}) {}
+    ~Worker() {
+        {
+            std::lock_guard _(_mx);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _thr.join();
+    }
+    void post(ondra_shared::Callback<void()> &&fn) {
+        {
+            std::lock_guard _(_mx);
+            _queue.push_back(std::move(fn));
+        }
+        _cv.notify_one();
+    }
+protected:
+    std::mutex _mx;
+    std::condition_variable _cv;
+    std::deque<ondra_shared::Callback<void()> > _queue;
+    bool _stop = false;
+    std::thread _thr;
+
+    void run() {
+        std::unique_lock lk(_mx);
+        while (true) {
+            _cv.wait(lk, [&]{return _stop || !_queue.empty();});
+            if (_queue.empty()) return;
+            auto fn = std::move(_queue.front());
+            _queue.pop_front();
+            lk.unlock();
+            fn();
+            lk.lock();
+        }
+    }
+};
+
+struct alignas(64) Counter {
+    std::atomic<std::size_t> n = 0;
+};
+
+///Publishes from given count of threads, returns deliveries per second
+static double run(umq::Publisher &pub, int threads) {
+    std::vector<Counter> counters(subscribers);
+    for (int i = 0; i < subscribers; i++) {
+        pub.subscribe([&c = counters[i]](const umq::Payload &data) {
+            if (data.empty()) return false;
+            c.n.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        });
+    }
+    std::string msg(100, 'x');
+    std::size_t expected = static_cast<std::size_t>(threads) * publishes_per_thread;
+    auto start = Clock::now();
+    std::vector<std::thread> thrs;
+    for (int t = 0; t < threads; t++) {
+        thrs.emplace_back([&] {
+            for (int i = 0; i < publishes_per_thread; i++) pub.publish(msg);
+        });
+    }
+    for (auto &t: thrs) t.join();
+    //in parallel mode, wait for delivery
+    for (auto &c: counters) {
+        while (c.n.load(std::memory_order_relaxed) < expected) std::this_thread::yield();
+    }
+    double secs = std::chrono::duration<double>(Clock::now()-start).count();
+    pub.reset();
+    return expected * subscribers / secs;
+}
+
+///Publisher sharded to given count of dedicated threads
+static double run_sharded(int shards, int threads) {
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::vector<umq::Publisher::Executor> execs;
+    for (int i = 0; i < shards; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        execs.push_back([w = workers.back().get()](ondra_shared::Callback<void()> &&fn) {
+            w->post(std::move(fn));
+        });
+    }
+    umq::Publisher pub;
+    //every delivery is counted, so the publishers must not skip updates
+    pub.set_parallel(std::move(execs), umq::Publisher::default_shard_queue_limit,
+            umq::HighWaterMarkBehavior::block);
+    return run(pub, threads);
+}
+
+int main(int argc, char **argv) {
+
+    //optional argument: maximum count of threads and shards
+    int max_threads = argc > 1?std::atoi(argv[1]):std::max<int>(std::thread::hardware_concurrency(), 2);
+
+    std::cout << "subscribers: " << subscribers << ", publishes per thread: " << publishes_per_thread << std::endl;
+    std::cout << "deliveries/s, rows: producer threads, columns: serial, then count of shards" << std::endl;
+    std::cout << "threads\tserial";
+    for (int shards = 1; shards <= max_threads; shards *= 2) std::cout << "\t" << shards;
+    std::cout << std::endl;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        std::cout << threads;
+        {
+            umq::Publisher pub;
+            std::cout << "\t" << run(pub, threads);
+        }
+        for (int shards = 1; shards <= max_threads; shards *= 2) {
+            std::cout << "\t" << run_sharded(shards, threads);
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
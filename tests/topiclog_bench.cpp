@@ -0,0 +1,73 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "../topiclog.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+static void report(const char *title, std::size_t count, std::size_t bytes, double secs) {
+    std::cout << title << ": " << count << " records, "
+              << static_cast<std::size_t>(count/secs) << " rec/s, "
+              << bytes/secs/(1024*1024) << " MB/s" << std::endl;
+}
+
+static void bench(const std::string &dir, std::size_t msg_size, std::size_t count) {
+    std::filesystem::remove_all(dir);
+    std::string msg(msg_size, 'x');
+    std::cout << "--- message size " << msg_size << " bytes" << std::endl;
+    {
+        umq::TopicLog log(dir);
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < count; i++) {
+            log.append(msg);
+        }
+        report("append", count, count*msg_size, seconds_since(start));
+    }
+    {
+        //reopen - measures index rebuild too
+        auto start = Clock::now();
+        umq::TopicLog log(dir);
+        std::cout << "open: " << seconds_since(start)*1000 << " ms, "
+                  << log.get_end_offset() << " records" << std::endl;
+
+        start = Clock::now();
+        std::size_t cnt = 0, bytes = 0;
+        log.read(0, [&](const umq::TopicLog::Record &r){
+            cnt++;
+            bytes += r.data.size();
+            return true;
+        });
+        report("replay", cnt, bytes, seconds_since(start));
+
+        start = Clock::now();
+        std::size_t lookups = 10000;
+        std::size_t found = 0;
+        for (std::size_t i = 0; i < lookups; i++) {
+            std::uint64_t ofs = (i * 7919) % count;
+            log.read(ofs, [&](const umq::TopicLog::Record &r){
+                found += r.offset == ofs;
+                return false;
+            });
+        }
+        std::cout << "seek: " << seconds_since(start)*1e9/lookups << " ns/lookup, found "
+                  << found << std::endl;
+    }
+    std::filesystem::remove_all(dir);
+}
+
+int main(int argc, char **argv) {
+    std::string dir = std::filesystem::temp_directory_path().string()
+            + "/umq_topiclog_bench_" + std::to_string(getpid());
+    std::size_t scale = argc > 1?std::strtoul(argv[1], nullptr, 10):1;
+    bench(dir, 100, 1000000*scale);
+    bench(dir, 4096, 100000*scale);
+    return 0;
+}
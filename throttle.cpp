@@ -0,0 +1,124 @@
+#include "throttle.h"
+
+#include <algorithm>
+
+#include <userver/scheduler.h>
+
+namespace umq {
+
+TopicUpdateCallback UpdateThrottle::wrap(TopicUpdateCallback &&cb, std::chrono::milliseconds interval) {
+    //closes the subscription when the publisher drops the callback
+    struct Holder {
+        PSub sub;
+        explicit Holder(PSub sub):sub(std::move(sub)) {}
+        Holder(Holder &&other):sub(std::move(other.sub)) {}
+        ~Holder() {if (sub) sub->close();}
+    };
+    Holder h(std::make_shared<Sub>(std::move(cb), get_group(interval)));
+    return [h = std::move(h)](const Payload &data) {
+        return h.sub->update(data);
+    };
+}
+
+UpdateThrottle::Group &UpdateThrottle::get_group(std::chrono::milliseconds interval) {
+    static std::mutex mx;
+    static std::map<std::chrono::milliseconds, PGroup> groups;
+    std::lock_guard _(mx);
+    PGroup &g = groups[interval];
+    if (g == nullptr) g = std::make_shared<Group>(interval);
+    return *g;
+}
+
+bool UpdateThrottle::Sub::update(const Payload &data) {
+    std::unique_lock lk(mx);
+    if (closed) return false;
+    auto now = Clock::now();
+    if (!queued && now - last_sent >= group.get_interval()) {
+        last_sent = now;
+        closed = !cb(data);
+        return !closed;
+    }
+    //conflate - only the newest value is held
+    held.emplace(std::string(data), data.attachments);
+    if (!queued) {
+        queued = true;
+        auto deadline = last_sent + group.get_interval();
+        lk.unlock();
+        group.enqueue(shared_from_this(), deadline);
+    }
+    return true;
+}
+
+std::optional<UpdateThrottle::Clock::time_point> UpdateThrottle::Sub::flush(Clock::time_point now) {
+    std::lock_guard _(mx);
+    if (closed) {
+        queued = false;
+        return {};
+    }
+    //sent directly during current interval
+    if (now - last_sent < group.get_interval()) return last_sent + group.get_interval();
+    queued = false;
+    if (held.has_value()) {
+        PayloadStr data = std::move(*held);
+        held.reset();
+        last_sent = now;
+        closed = !cb(data);
+    }
+    return {};
+}
+
+void UpdateThrottle::Sub::close() {
+    TopicUpdateCallback tmp;
+    {
+        std::lock_guard _(mx);
+        closed = true;
+        held.reset();
+        tmp = std::move(cb);
+    }
+    //destroyed outside of the lock (it can send topic close)
+}
+
+void UpdateThrottle::Group::enqueue(PSub &&sub, Clock::time_point deadline) {
+    std::lock_guard _(_mx);
+    _queued.emplace(deadline, std::move(sub));
+    //the timer is moved sooner, when the sub has to send before the scheduled tick
+    if (!_scheduled.has_value() || deadline < *_scheduled) schedule(deadline);
+}
+
+void UpdateThrottle::Group::schedule(Clock::time_point at) {
+    _scheduled = at;
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(at - Clock::now());
+    userver::After(std::max(delay, std::chrono::milliseconds(0))) >> [me = shared_from_this(), id = ++_timer_id]{
+        me->tick(id);
+    };
+}
+
+void UpdateThrottle::Group::tick(unsigned int timer_id) {
+    auto now = Clock::now();
+    std::vector<PSub> lst;
+    {
+        std::lock_guard _(_mx);
+        if (timer_id != _timer_id) return;
+        _scheduled.reset();
+        auto end = _queued.upper_bound(now);
+        for (auto iter = _queued.begin(); iter != end; ++iter) lst.push_back(std::move(iter->second));
+        _queued.erase(_queued.begin(), end);
+    }
+    std::vector<std::pair<Clock::time_point, PSub> > wait;
+    {
+        //subscribers of the same peer, which send at the same time, receive single message
+        TopicUpdateBatch batch;
+        for (PSub &s: lst) {
+            auto deadline = s->flush(now);
+            if (deadline.has_value()) wait.emplace_back(*deadline, std::move(s));
+        }
+    }
+    std::lock_guard _(_mx);
+    for (auto &w: wait) _queued.emplace(std::move(w));
+    //enqueue() could schedule the timer meanwhile
+    if (!_queued.empty() && (!_scheduled.has_value() || _queued.begin()->first < *_scheduled)) {
+        schedule(_queued.begin()->first);
+    }
+}
+
+}
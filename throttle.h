@@ -0,0 +1,107 @@
+/*
+ * throttle.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_THROTTLE_H_pwoe92jd02jd93kdw0
+#define LIB_UMQ_THROTTLE_H_pwoe92jd02jd93kdw0
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "peer.h"
+
+namespace umq {
+
+///Limits rate of topic updates sent to a subscriber
+/**
+ * Throttled subscriber receives at most one update per interval. Updates
+ * arriving sooner are conflated - only the newest value is held and it is
+ * sent when the interval expires. When there was no update during the last
+ * interval, the next update is sent immediately.
+ *
+ * Subscribers with the same interval share single timer, which runs only while
+ * there are held updates. The held update is sent when the interval since
+ * the last update of its subscriber expires, so it waits at most one interval.
+ * Updates sent by the timer at the same time are packed by
+ * TopicUpdateBatch, so a peer with many throttled topics receives one message
+ * per interval (if the peer accepts batches, see Peer::enable_topic_batch()).
+ *
+ * @code
+ * publisher.subscribe(UpdateThrottle::wrap(peer->start_publish("topic"), std::chrono::milliseconds(200)));
+ * @endcode
+ */
+class UpdateThrottle {
+public:
+
+    ///Create throttled callback
+    /**
+     * @param cb callback which sends the update (for example result of Peer::start_publish)
+     * @param interval minimum interval between two updates
+     * @return callback which can be subscribed to a publisher. When the original
+     * callback returns false, the next call of this callback returns false too.
+     * When the returned callback is destroyed, held update is dropped
+     */
+    static TopicUpdateCallback wrap(TopicUpdateCallback &&cb, std::chrono::milliseconds interval);
+
+protected:
+
+    using Clock = std::chrono::steady_clock;
+
+    class Group;
+
+    struct Sub: std::enable_shared_from_this<Sub> {
+        std::mutex mx;
+        TopicUpdateCallback cb;
+        Group &group;
+        std::optional<PayloadStr> held;
+        Clock::time_point last_sent = {};
+        ///sub is in the list of the group
+        bool queued = false;
+        ///original callback returned false, or the wrapper has been destroyed
+        bool closed = false;
+
+        Sub(TopicUpdateCallback &&cb, Group &group):cb(std::move(cb)),group(group) {}
+        bool update(const Payload &data);
+        ///sends held update, returns the deadline when the sub must still wait
+        std::optional<Clock::time_point> flush(Clock::time_point now);
+        void close();
+    };
+
+    using PSub = std::shared_ptr<Sub>;
+
+    class Group: public std::enable_shared_from_this<Group> {
+    public:
+        explicit Group(std::chrono::milliseconds interval):_interval(interval) {}
+        std::chrono::milliseconds get_interval() const {return _interval;}
+        void enqueue(PSub &&sub, Clock::time_point deadline);
+    protected:
+        std::chrono::milliseconds _interval;
+        std::mutex _mx;
+        ///queued subscribers ordered by the time, when they can send
+        std::multimap<Clock::time_point, PSub> _queued;
+        ///time of the scheduled tick
+        std::optional<Clock::time_point> _scheduled;
+        ///identifies the current timer, ticks of replaced timers are ignored
+        unsigned int _timer_id = 0;
+
+        void schedule(Clock::time_point at);
+        void tick(unsigned int timer_id);
+    };
+
+    using PGroup = std::shared_ptr<Group>;
+
+    ///Retrieve group for given interval (groups are never destroyed)
+    static Group &get_group(std::chrono::milliseconds interval);
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_THROTTLE_H_pwoe92jd02jd93kdw0 */
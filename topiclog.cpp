@@ -0,0 +1,267 @@
+#include "topiclog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace umq {
+
+static constexpr std::size_t segment_name_digits = 20;
+static constexpr std::string_view segment_suffix = ".log";
+
+static void throw_errno(const std::string &what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+TopicLog::Segment::Segment(const std::string &fname, std::uint64_t base,
+        std::size_t capacity, std::size_t index_interval)
+:_fname(fname),_base(base),_index_interval(std::max<std::size_t>(index_interval, 1)) {
+    _fd = ::open(fname.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+    if (_fd < 0) throw_errno("Unable to open: " + fname);
+    struct stat st;
+    if (::fstat(_fd, &st) < 0) {
+        ::close(_fd);
+        throw_errno("Unable to stat: " + fname);
+    }
+    if (st.st_size == 0) {
+        if (::ftruncate(_fd, capacity) < 0) {
+            ::close(_fd);
+            throw_errno("Unable to allocate: " + fname);
+        }
+        _capacity = capacity;
+    } else {
+        _capacity = st.st_size;
+    }
+    void *m = ::mmap(nullptr, _capacity, PROT_READ|PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (m == MAP_FAILED) {
+        ::close(_fd);
+        throw_errno("Unable to map: " + fname);
+    }
+    _map = static_cast<char *>(m);
+    _index_cap = _capacity / _index_interval + 2;
+    _index = std::make_unique<IndexEntry[]>(_index_cap);
+    _next_offset.store(base, std::memory_order_relaxed);
+    scan();
+}
+
+TopicLog::Segment::~Segment() {
+    ::munmap(_map, _capacity);
+    ::close(_fd);
+}
+
+void TopicLog::Segment::scan() {
+    std::size_t pos = 0;
+    while (pos + sizeof(RecordHeader) <= _capacity) {
+        const RecordHeader *h = at(pos);
+        if (h->magic != record_magic) break;
+        std::size_t rs = record_size(h->size);
+        if (pos + rs > _capacity) break;
+        if (pos == 0 || pos - _last_index_pos >= _index_interval) {
+            add_index(h->offset, h->timestamp, pos);
+        }
+        _next_offset.store(h->offset+1, std::memory_order_relaxed);
+        _last_ts.store(h->timestamp, std::memory_order_relaxed);
+        pos += rs;
+    }
+    _end.store(pos, std::memory_order_release);
+}
+
+void TopicLog::Segment::add_index(std::uint64_t offset, std::uint64_t timestamp, std::size_t pos) {
+    std::size_t cnt = _index_count.load(std::memory_order_relaxed);
+    if (cnt >= _index_cap) return;
+    _index[cnt] = IndexEntry{offset, timestamp, pos};
+    _index_count.store(cnt+1, std::memory_order_release);
+    _last_index_pos = pos;
+}
+
+bool TopicLog::Segment::append(const std::string_view &data, std::uint64_t offset, std::uint64_t timestamp) {
+    std::size_t pos = _end.load(std::memory_order_relaxed);
+    std::size_t rs = record_size(data.size());
+    if (pos + rs > _capacity) return false;
+    RecordHeader *h = reinterpret_cast<RecordHeader *>(_map + pos);
+    std::memcpy(h+1, data.data(), data.size());
+    h->size = static_cast<std::uint32_t>(data.size());
+    h->offset = offset;
+    h->timestamp = timestamp;
+    h->magic = record_magic;
+    if (pos == 0 || pos - _last_index_pos >= _index_interval) {
+        add_index(offset, timestamp, pos);
+    }
+    _next_offset.store(offset+1, std::memory_order_release);
+    _last_ts.store(timestamp, std::memory_order_release);
+    _end.store(pos + rs, std::memory_order_release);
+    return true;
+}
+
+std::size_t TopicLog::Segment::find_pos(std::uint64_t offset) const {
+    const IndexEntry *b = _index.get();
+    const IndexEntry *e = index_end();
+    auto iter = std::upper_bound(b, e, offset, [](std::uint64_t v, const IndexEntry &x){
+        return v < x.offset;
+    });
+    if (iter == b) return 0;
+    return (iter-1)->pos;
+}
+
+std::size_t TopicLog::Segment::find_pos_time(std::uint64_t timestamp) const {
+    const IndexEntry *b = _index.get();
+    const IndexEntry *e = index_end();
+    //first entry with timestamp >= requested, scan starts at previous entry
+    auto iter = std::lower_bound(b, e, timestamp, [](const IndexEntry &x, std::uint64_t v){
+        return x.timestamp < v;
+    });
+    if (iter == b) return 0;
+    return (iter-1)->pos;
+}
+
+void TopicLog::Segment::remove() {
+    ::unlink(_fname.c_str());
+}
+
+void TopicLog::Segment::flush() {
+    ::msync(_map, get_end(), MS_SYNC);
+}
+
+TopicLog::TopicLog(const std::string &path, const TopicLogConfig &cfg)
+:_path(path),_cfg(cfg) {
+    if (::mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
+        throw_errno("Unable to create directory: " + path);
+    }
+    DIR *d = ::opendir(path.c_str());
+    if (d == nullptr) throw_errno("Unable to open directory: " + path);
+    std::vector<std::uint64_t> bases;
+    while (auto *ent = ::readdir(d)) {
+        std::string_view name(ent->d_name);
+        if (name.size() != segment_name_digits + segment_suffix.size()) continue;
+        if (name.substr(segment_name_digits) != segment_suffix) continue;
+        std::uint64_t base = 0;
+        bool ok = true;
+        for (char c: name.substr(0, segment_name_digits)) {
+            if (c < '0' || c > '9') {ok = false; break;}
+            base = base * 10 + (c - '0');
+        }
+        if (ok) bases.push_back(base);
+    }
+    ::closedir(d);
+    std::sort(bases.begin(), bases.end());
+    for (std::uint64_t b: bases) {
+        _segments.push_back(std::make_shared<Segment>(segment_name(b), b, _cfg.segment_size, _cfg.index_interval));
+    }
+    if (_segments.empty()) {
+        roll(0, _cfg.segment_size);
+    } else {
+        _last_ts = _segments.back()->get_last_timestamp();
+    }
+}
+
+std::string TopicLog::segment_name(std::uint64_t base) const {
+    std::string num = std::to_string(base);
+    std::string out = _path;
+    out.push_back('/');
+    out.append(segment_name_digits - num.size(), '0');
+    out.append(num);
+    out.append(segment_suffix);
+    return out;
+}
+
+void TopicLog::roll(std::uint64_t base, std::size_t min_capacity) {
+    std::size_t cap = std::max(_cfg.segment_size, min_capacity);
+    _segments.push_back(std::make_shared<Segment>(segment_name(base), base, cap, _cfg.index_interval));
+    apply_retention_lk();
+}
+
+std::uint64_t TopicLog::now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::uint64_t TopicLog::append(const std::string_view &data) {
+    return append(data, now());
+}
+
+std::uint64_t TopicLog::append(const std::string_view &data, std::uint64_t timestamp) {
+    //size of the record is stored as 32bit number
+    if (data.size() > max_record_size) throw std::length_error("TopicLog: record is too large");
+    std::lock_guard _(_lock);
+    timestamp = std::max(timestamp, _last_ts);
+    _last_ts = timestamp;
+    Segment *s = _segments.back().get();
+    std::uint64_t offset = s->get_next_offset();
+    if (!s->append(data, offset, timestamp)) {
+        roll(offset, record_size(data.size()));
+        _segments.back()->append(data, offset, timestamp);
+    }
+    return offset;
+}
+
+std::vector<TopicLog::PSegment> TopicLog::get_segments() const {
+    std::lock_guard _(_lock);
+    return _segments;
+}
+
+std::uint64_t TopicLog::find_offset(std::uint64_t timestamp) const {
+    auto segs = get_segments();
+    for (const auto &s: segs) {
+        if (s->get_last_timestamp() < timestamp) continue;
+        std::size_t end = s->get_end();
+        std::size_t pos = s->find_pos_time(timestamp);
+        while (pos < end) {
+            const RecordHeader *h = s->at(pos);
+            if (h->timestamp >= timestamp) return h->offset;
+            pos += record_size(h->size);
+        }
+    }
+    return segs.back()->get_next_offset();
+}
+
+std::uint64_t TopicLog::get_begin_offset() const {
+    std::lock_guard _(_lock);
+    return _segments.front()->get_base();
+}
+
+std::uint64_t TopicLog::get_end_offset() const {
+    std::lock_guard _(_lock);
+    return _segments.back()->get_next_offset();
+}
+
+std::size_t TopicLog::apply_retention() {
+    std::lock_guard _(_lock);
+    return apply_retention_lk();
+}
+
+std::size_t TopicLog::apply_retention_lk() {
+    std::uint64_t total = 0;
+    for (const auto &s: _segments) total += s->get_end();
+    std::uint64_t tm = now();
+    std::uint64_t max_age = std::chrono::duration_cast<std::chrono::milliseconds>(_cfg.retention_age).count();
+    std::size_t removed = 0;
+    while (_segments.size() - removed > 1) {
+        const Segment &s = *_segments[removed];
+        bool by_size = _cfg.retention_bytes && total > _cfg.retention_bytes;
+        bool by_age = max_age && s.get_last_timestamp() + max_age < tm;
+        if (!by_size && !by_age) break;
+        total -= s.get_end();
+        _segments[removed]->remove();
+        ++removed;
+    }
+    _segments.erase(_segments.begin(), _segments.begin() + removed);
+    return removed;
+}
+
+void TopicLog::flush() {
+    PSegment s;
+    {
+        std::lock_guard _(_lock);
+        s = _segments.back();
+    }
+    s->flush();
+}
+
+}
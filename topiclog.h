@@ -0,0 +1,241 @@
+/*
+ * topiclog.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_TOPICLOG_H_wpoeid20d92jd0jwo3d
+#define LIB_UMQ_TOPICLOG_H_wpoeid20d92jd0jwo3d
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace umq {
+
+///Configuration of the TopicLog
+struct TopicLogConfig {
+    ///size of single segment file in bytes
+    std::size_t segment_size = 64*1024*1024;
+    ///distance in bytes between entries of the sparse index
+    std::size_t index_interval = 4096;
+    ///maximum total size of the log, older segments are removed. 0 - unlimited
+    std::uint64_t retention_bytes = 0;
+    ///maximum age of records, older segments are removed. 0 - unlimited
+    std::chrono::seconds retention_age = std::chrono::seconds(0);
+};
+
+///Append-only log of topic updates
+/**
+ * The log is stored in a directory, split into segments. Every segment is
+ * a memory mapped file named by offset of its first record. Every record
+ * has an offset (sequence number starting by 0) and timestamp (milliseconds
+ * since epoch).
+ *
+ * Each segment has a sparse index (kept in memory, rebuilt when
+ * the log is opened), which maps offsets and timestamps to positions
+ * in the segment.
+ *
+ * Only one thread can append at a time (appends are serialized). Reading runs
+ * in parallel with appending. A reader takes the lock only to copy the list
+ * of segments, the records are read from the mapped segments without the lock.
+ */
+class TopicLog {
+public:
+
+    ///Single record
+    struct Record {
+        std::uint64_t offset;
+        std::uint64_t timestamp;
+        std::string_view data;
+    };
+
+    ///Open or create the log
+    /**
+     * @param path path to directory. It is created, if doesn't exist
+     * @param cfg configuration
+     *
+     * @exception std::system_error unable to open or create the log
+     */
+    explicit TopicLog(const std::string &path, const TopicLogConfig &cfg = TopicLogConfig());
+
+    TopicLog(const TopicLog &) = delete;
+    TopicLog &operator=(const TopicLog &) = delete;
+
+    ///Maximum size of the content of a record
+    static constexpr std::size_t max_record_size = 0xFFFFFFFF;
+
+    ///Append record
+    /**
+     * @param data content of the record
+     * @return offset of the record
+     * @exception std::length_error record is larger than max_record_size
+     */
+    std::uint64_t append(const std::string_view &data);
+
+    ///Append record with given timestamp
+    /**
+     * @param data content of the record
+     * @param timestamp timestamp in milliseconds. Timestamps in the log never
+     * decrease. If the timestamp is lower than timestamp of the previous record,
+     * timestamp of the previous record is used
+     * @return offset of the record
+     * @exception std::length_error record is larger than max_record_size
+     */
+    std::uint64_t append(const std::string_view &data, std::uint64_t timestamp);
+
+    ///Read records
+    /**
+     * @param from offset of the first record. If the record has already been removed
+     * by retention, reading starts by the first available record
+     * @param fn function called for every record - bool(const Record &). Function
+     * returns true to continue, or false to stop reading. Content of the record
+     * is valid only during the call
+     * @return offset of next record to read
+     */
+    template<typename Fn>
+    std::uint64_t read(std::uint64_t from, Fn &&fn) const;
+
+    ///Find first record which has timestamp equal or greater than specified
+    /**
+     * @param timestamp timestamp in milliseconds
+     * @return offset of the record, or end offset if there is no such record
+     */
+    std::uint64_t find_offset(std::uint64_t timestamp) const;
+
+    ///Offset of the first available record
+    std::uint64_t get_begin_offset() const;
+    ///Offset of the next record (count of records ever written)
+    std::uint64_t get_end_offset() const;
+
+    ///Remove old segments according to retention settings
+    /**
+     * It is called automatically when new segment is created.
+     * The active segment is never removed
+     *
+     * @return count of removed segments
+     */
+    std::size_t apply_retention();
+
+    ///Flush active segment to the disk
+    void flush();
+
+    ///Current time in milliseconds
+    static std::uint64_t now();
+
+protected:
+
+    struct RecordHeader {
+        std::uint32_t magic;
+        std::uint32_t size;
+        std::uint64_t offset;
+        std::uint64_t timestamp;
+    };
+
+    static constexpr std::uint32_t record_magic = 0x4C514D55; //UMQL
+    static constexpr std::size_t alignment = 8;
+
+    static std::size_t record_size(std::size_t data_size) {
+        return (sizeof(RecordHeader) + data_size + alignment - 1) & ~(alignment - 1);
+    }
+
+    struct IndexEntry {
+        std::uint64_t offset;
+        std::uint64_t timestamp;
+        std::size_t pos;
+    };
+
+    class Segment {
+    public:
+        ///Open or create segment
+        Segment(const std::string &fname, std::uint64_t base, std::size_t capacity, std::size_t index_interval);
+        ~Segment();
+        Segment(const Segment &) = delete;
+        Segment &operator=(const Segment &) = delete;
+
+        ///Append record (only one thread)
+        /** @retval false segment is full */
+        bool append(const std::string_view &data, std::uint64_t offset, std::uint64_t timestamp);
+        ///Find position to start scan for given offset
+        std::size_t find_pos(std::uint64_t offset) const;
+        ///Find position to start scan for given timestamp
+        std::size_t find_pos_time(std::uint64_t timestamp) const;
+
+        const RecordHeader *at(std::size_t pos) const {
+            return reinterpret_cast<const RecordHeader *>(_map + pos);
+        }
+        std::size_t get_end() const {return _end.load(std::memory_order_acquire);}
+        std::uint64_t get_base() const {return _base;}
+        std::uint64_t get_next_offset() const {return _next_offset.load(std::memory_order_acquire);}
+        std::uint64_t get_last_timestamp() const {return _last_ts.load(std::memory_order_acquire);}
+        ///Remove the file (it stays mapped until the object is destroyed)
+        void remove();
+        void flush();
+
+    protected:
+        std::string _fname;
+        std::uint64_t _base;
+        int _fd = -1;
+        char *_map = nullptr;
+        std::size_t _capacity = 0;
+        std::size_t _index_interval;
+        std::unique_ptr<IndexEntry[]> _index;
+        std::size_t _index_cap = 0;
+        std::atomic<std::size_t> _index_count = 0;
+        std::size_t _last_index_pos = 0;
+        std::atomic<std::size_t> _end = 0;
+        std::atomic<std::uint64_t> _next_offset = 0;
+        std::atomic<std::uint64_t> _last_ts = 0;
+
+        void scan();
+        void add_index(std::uint64_t offset, std::uint64_t timestamp, std::size_t pos);
+        const IndexEntry *index_end() const {
+            return _index.get() + _index_count.load(std::memory_order_acquire);
+        }
+    };
+
+    using PSegment = std::shared_ptr<Segment>;
+
+    std::string _path;
+    TopicLogConfig _cfg;
+    mutable std::mutex _lock;
+    std::vector<PSegment> _segments;
+    std::uint64_t _last_ts = 0;
+
+    std::vector<PSegment> get_segments() const;
+    std::string segment_name(std::uint64_t base) const;
+    void roll(std::uint64_t base, std::size_t min_capacity);
+    std::size_t apply_retention_lk();
+};
+
+template<typename Fn>
+inline std::uint64_t TopicLog::read(std::uint64_t from, Fn &&fn) const {
+    std::uint64_t next = from;
+    for (const auto &s: get_segments()) {
+        if (s->get_next_offset() <= next) continue;
+        std::size_t end = s->get_end();
+        std::size_t pos = s->find_pos(next);
+        while (pos < end) {
+            const RecordHeader *h = s->at(pos);
+            if (h->offset >= next) {
+                Record r{h->offset, h->timestamp,
+                    std::string_view(reinterpret_cast<const char *>(h+1), h->size)};
+                next = h->offset + 1;
+                if (!fn(r)) return next;
+            }
+            pos += record_size(h->size);
+        }
+    }
+    return next;
+}
+
+}
+
+
+
+#endif /* LIB_UMQ_TOPICLOG_H_wpoeid20d92jd0jwo3d */
@@ -0,0 +1,125 @@
+#include "tracing.h"
+
+#include <fstream>
+
+namespace umq {
+
+#ifdef UMQ_ENABLE_TRACING
+std::atomic<AbstractTracer *> current_tracer = nullptr;
+///owns the current tracer, current_tracer is its fast copy
+static std::shared_ptr<AbstractTracer> current_tracer_owner;
+#endif
+
+void set_tracer(std::shared_ptr<AbstractTracer> tracer) {
+#ifdef UMQ_ENABLE_TRACING
+    current_tracer.store(tracer.get(), std::memory_order_relaxed);
+    std::atomic_store(&current_tracer_owner, std::move(tracer));
+#else
+    (void)tracer;
+#endif
+}
+
+std::shared_ptr<AbstractTracer> get_tracer() {
+#ifdef UMQ_ENABLE_TRACING
+    return std::atomic_load(&current_tracer_owner);
+#else
+    return nullptr;
+#endif
+}
+
+static std::atomic<std::size_t> tracer_instance_counter = 0;
+
+RingBufferTracer::RingBufferTracer(std::size_t capacity)
+:_capacity(std::max<std::size_t>(capacity,1))
+,_instance_id(++tracer_instance_counter) {}
+
+RingBufferTracer::Ring &RingBufferTracer::get_ring() {
+    struct TLS {
+        std::size_t instance_id = 0;
+        std::shared_ptr<Ring> ring;
+    };
+    static thread_local TLS tls;
+    if (tls.instance_id != _instance_id) {
+        auto r = std::make_shared<Ring>();
+        r->spans.reserve(_capacity);
+        std::lock_guard _(_lock);
+        r->thread_index = _rings.size();
+        _rings.push_back(r);
+        tls.ring = std::move(r);
+        tls.instance_id = _instance_id;
+    }
+    return *tls.ring;
+}
+
+void RingBufferTracer::record(const TraceSpan &span) {
+    Ring &r = get_ring();
+    std::lock_guard _(r.mx);
+    if (r.spans.size() < _capacity) {
+        r.spans.push_back(span);
+    } else {
+        r.spans[r.pos] = span;
+    }
+    r.pos = (r.pos + 1) % _capacity;
+}
+
+std::vector<TraceSpan> RingBufferTracer::get_spans() const {
+    std::vector<TraceSpan> out;
+    std::lock_guard _(_lock);
+    for (const auto &r: _rings) {
+        std::lock_guard __(r->mx);
+        out.insert(out.end(), r->spans.begin(), r->spans.end());
+    }
+    std::sort(out.begin(), out.end(), [](const TraceSpan &a, const TraceSpan &b){
+        return a.start_ns < b.start_ns;
+    });
+    return out;
+}
+
+static const char *trace_point_name(TracePoint pt) {
+    switch (pt) {
+        case TracePoint::parse: return "parse";
+        case TracePoint::dispatch: return "dispatch";
+        case TracePoint::build_send: return "build_send";
+        case TracePoint::conn_send: return "conn_send";
+        case TracePoint::output_wait: return "output_wait";
+        default: return "unknown";
+    }
+}
+
+static void write_json_string(std::ostream &out, std::string_view str) {
+    out << '"';
+    for (char c: str) {
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 32) out << ' ';
+        else out << c;
+    }
+    out << '"';
+}
+
+bool RingBufferTracer::dump(const std::string &fname) const {
+    std::ofstream out(fname, std::ios::out|std::ios::trunc);
+    if (!out) return false;
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    std::lock_guard _(_lock);
+    for (const auto &r: _rings) {
+        std::lock_guard __(r->mx);
+        for (const auto &s: r->spans) {
+            if (!first) out << ",\n";
+            first = false;
+            out << "{\"name\":\"" << trace_point_name(s.point) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << r->thread_index
+                << ",\"ts\":" << s.start_ns/1000.0
+                << ",\"dur\":" << (s.end_ns-s.start_ns)/1000.0
+                << ",\"args\":{\"type\":";
+            write_json_string(out, s.msg_type?std::string_view(&s.msg_type,1):std::string_view("binary"));
+            out << ",\"id\":";
+            write_json_string(out, s.get_id());
+            out << ",\"size\":" << s.size << "}}";
+        }
+    }
+    out << "\n]}\n";
+    return !!out;
+}
+
+}
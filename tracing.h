@@ -0,0 +1,185 @@
+/*
+ * tracing.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_TRACING_H_dwoi3209dj203jd0923
+#define LIB_UMQ_TRACING_H_dwoi3209dj203jd0923
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace umq {
+
+///Place in the code where the span was measured
+enum class TracePoint: unsigned char {
+    ///parsing incoming frame (includes dispatch)
+    parse,
+    ///execution of user's handler (method, callback, topic update, response)
+    dispatch,
+    ///building outgoing message
+    build_send,
+    ///sending frame through the connection (transport)
+    conn_send,
+    ///frame waiting in the connection's output buffer until it is written
+    output_wait
+};
+
+///Single measured span
+struct TraceSpan {
+    static constexpr std::size_t max_id_len = 23;
+
+    TracePoint point;
+    ///message type (character) or 0 for binary frames
+    char msg_type;
+    ///length of id
+    unsigned char id_len;
+    ///message id (truncated)
+    std::array<char, max_id_len> id;
+    ///size of message in bytes
+    std::size_t size;
+    ///start time (steady clock) in nanoseconds
+    std::uint64_t start_ns;
+    ///end time (steady clock) in nanoseconds
+    std::uint64_t end_ns;
+
+    std::string_view get_id() const {return std::string_view(id.data(), id_len);}
+
+    static std::uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ///Create span and set its start time to now
+    static TraceSpan start(TracePoint point, char msg_type, std::string_view id, std::size_t size) {
+        TraceSpan span;
+        span.point = point;
+        span.msg_type = msg_type;
+        span.id_len = static_cast<unsigned char>(std::min(id.size(), max_id_len));
+        std::copy(id.begin(), id.begin()+span.id_len, span.id.begin());
+        span.size = size;
+        span.start_ns = now();
+        span.end_ns = span.start_ns;
+        return span;
+    }
+};
+
+///Receives measured spans
+/**
+ * The tracer can be called from many threads at once
+ */
+class AbstractTracer {
+public:
+    virtual ~AbstractTracer() = default;
+    virtual void record(const TraceSpan &span) = 0;
+};
+
+///Tracer which stores spans to per-thread ring buffers
+/**
+ * Every thread writes to its own ring buffer, older spans are overwritten.
+ * Content of all buffers can be dumped to a file in Chrome's trace event
+ * format (chrome://tracing, Perfetto)
+ */
+class RingBufferTracer: public AbstractTracer {
+public:
+    ///Construct the tracer
+    /**
+     * @param capacity count of spans stored per thread
+     */
+    explicit RingBufferTracer(std::size_t capacity = 65536);
+
+    virtual void record(const TraceSpan &span) override;
+
+    ///Dump all spans to the file
+    /**
+     * @param fname name of the file
+     * @retval true success
+     * @retval false unable to write the file
+     */
+    bool dump(const std::string &fname) const;
+
+    ///Retrieve all stored spans ordered by start time
+    std::vector<TraceSpan> get_spans() const;
+
+protected:
+    struct Ring {
+        std::mutex mx;
+        std::vector<TraceSpan> spans;
+        std::size_t pos = 0;
+        std::size_t thread_index = 0;
+    };
+
+    std::size_t _capacity;
+    std::size_t _instance_id;
+    mutable std::mutex _lock;
+    std::vector<std::shared_ptr<Ring> > _rings;
+
+    Ring &get_ring();
+};
+
+///Sets current tracer
+/**
+ * @param tracer tracer, nullptr to disable tracing. The tracer is shared with
+ * running spans (TraceScope and pending output_wait), so it is released after
+ * the last of them is recorded
+ */
+void set_tracer(std::shared_ptr<AbstractTracer> tracer);
+
+///Retrieves current tracer
+/** @return current tracer or nullptr */
+std::shared_ptr<AbstractTracer> get_tracer();
+
+#ifdef UMQ_ENABLE_TRACING
+
+///Current tracer without ownership, fast check whether tracing is active
+extern std::atomic<AbstractTracer *> current_tracer;
+
+///Measures span from construction to destruction
+class TraceScope {
+public:
+    TraceScope(TracePoint point, char msg_type, std::string_view id, std::size_t size) {
+        //the owner is taken only when tracing is active, the scope keeps the tracer alive
+        if (current_tracer.load(std::memory_order_relaxed)) {
+            _tracer = get_tracer();
+            if (_tracer) _span = TraceSpan::start(point, msg_type, id, size);
+        }
+    }
+    ~TraceScope() {
+        if (_tracer) {
+            _span.end_ns = TraceSpan::now();
+            _tracer->record(_span);
+        }
+    }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+protected:
+    std::shared_ptr<AbstractTracer> _tracer;
+    TraceSpan _span;
+};
+
+#else
+
+///Tracing is disabled - the class is empty
+class TraceScope {
+public:
+    TraceScope(TracePoint, char, std::string_view, std::size_t) {}
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#endif
+
+}
+
+
+
+#endif /* LIB_UMQ_TRACING_H_dwoi3209dj203jd0923 */
@@ -0,0 +1,155 @@
+#include "workqueue.h"
+
+#include <algorithm>
+
+namespace umq {
+
+PWorkQueue WorkQueue::make(unsigned int max_attempts) {
+    return PWorkQueue(new WorkQueue(max_attempts));
+}
+
+WorkQueue::WorkQueue(unsigned int max_attempts)
+:_max_attempts(max_attempts) {}
+
+WorkQueue::~WorkQueue() {
+    //responses of jobs in flight are ignored (weak pointer is expired)
+    for (auto &x: _pending) {
+        if (x.done != nullptr) x.done(Response(Response::Type::disconnected, Payload()));
+    }
+    for (auto &x: _inflight) {
+        if (x.second.job.done != nullptr) x.second.job.done(Response(Response::Type::disconnected, Payload()));
+    }
+}
+
+std::size_t WorkQueue::push(const Payload &job, ResponseCallback &&done) {
+    std::size_t id;
+    {
+        std::lock_guard _(_mx);
+        id = ++_job_id;
+        _pending.push_back(Job{id, PayloadStr(std::string(job), job.attachments), std::move(done), 0});
+    }
+    dispatch();
+    return id;
+}
+
+std::size_t WorkQueue::add_consumer(const PPeer &peer, const std::string_view &method, std::size_t prefetch) {
+    std::size_t id;
+    {
+        std::lock_guard _(_mx);
+        id = ++_consumer_id;
+        _consumers.push_back(Consumer{id, peer, std::string(method), std::max<std::size_t>(prefetch,1), 0});
+    }
+    dispatch();
+    return id;
+}
+
+void WorkQueue::remove_consumer(std::size_t id) {
+    std::lock_guard _(_mx);
+    remove_consumer_lk(id);
+}
+
+void WorkQueue::remove_consumer_lk(std::size_t id) {
+    auto iter = std::find_if(_consumers.begin(), _consumers.end(), [&](const Consumer &c){
+        return c.id == id;
+    });
+    if (iter != _consumers.end()) _consumers.erase(iter);
+}
+
+std::size_t WorkQueue::get_pending() const {
+    std::lock_guard _(_mx);
+    return _pending.size();
+}
+
+std::size_t WorkQueue::get_inflight() const {
+    std::lock_guard _(_mx);
+    return _inflight.size();
+}
+
+std::size_t WorkQueue::get_consumers() const {
+    std::lock_guard _(_mx);
+    return _consumers.size();
+}
+
+WorkQueue::Consumer *WorkQueue::find_consumer() {
+    Consumer *best = nullptr;
+    for (auto &c: _consumers) {
+        if (c.inflight < c.prefetch && (best == nullptr || c.inflight < best->inflight)) {
+            best = &c;
+        }
+    }
+    return best;
+}
+
+void WorkQueue::dispatch() {
+    std::vector<Dispatch> out;
+    {
+        std::lock_guard _(_mx);
+        while (!_pending.empty()) {
+            Consumer *c = find_consumer();
+            if (c == nullptr) break;
+            PPeer peer = c->peer.lock();
+            if (peer == nullptr) {
+                remove_consumer_lk(c->id);
+                continue;
+            }
+            Job job = std::move(_pending.front());
+            _pending.pop_front();
+            std::size_t job_id = job.id;
+            ++c->inflight;
+            out.push_back(Dispatch{std::move(peer), c->method, job.data, job_id, c->id});
+            _inflight.emplace(job_id, InFlight{std::move(job), c->id});
+        }
+    }
+    for (const auto &d: out) {
+        d.peer->call(d.method, d.data, [wk = weak_from_this(), job_id = d.job_id, consumer_id = d.consumer_id](Response &&resp) {
+            auto me = wk.lock();
+            if (me != nullptr) me->on_response(job_id, consumer_id, std::move(resp));
+        });
+    }
+}
+
+void WorkQueue::on_response(std::size_t job_id, std::size_t consumer_id, Response &&resp) {
+    ResponseCallback done;
+    {
+        std::lock_guard _(_mx);
+        auto iter = _inflight.find(job_id);
+        if (iter == _inflight.end()) return;
+        Job job = std::move(iter->second.job);
+        _inflight.erase(iter);
+
+        auto citer = std::find_if(_consumers.begin(), _consumers.end(), [&](const Consumer &c){
+            return c.id == consumer_id;
+        });
+        if (citer != _consumers.end()) {
+            --citer->inflight;
+            if (resp.is_disconnected()) {
+                _consumers.erase(citer);
+            } else if (resp.is_rejected()) {
+                //call window of the peer is full - don't send more than it has in flight
+                if (citer->inflight) citer->prefetch = citer->inflight;
+                else _consumers.erase(citer);
+            }
+        }
+
+        switch (resp.get_type()) {
+            case Response::Type::result:
+                done = std::move(job.done);
+                break;
+            case Response::Type::disconnected:
+            case Response::Type::rejected:
+                //not consumer's fault - don't count the attempt, keep the order
+                _pending.push_front(std::move(job));
+                break;
+            default:
+                ++job.attempts;
+                //failed job goes to the end, so it doesn't block the others
+                if (_max_attempts == 0 || job.attempts < _max_attempts) _pending.push_back(std::move(job));
+                else done = std::move(job.done);
+                break;
+        }
+    }
+    if (done != nullptr) done(std::move(resp));
+    dispatch();
+}
+
+}
@@ -0,0 +1,149 @@
+/*
+ * workqueue.h
+ *
+ *  Created on: 18. 10. 2026
+ *      Author: ondra
+ */
+
+#ifndef LIB_UMQ_WORKQUEUE_H_oiwjd029jd023jd09jw
+#define LIB_UMQ_WORKQUEUE_H_oiwjd029jd023jd09jw
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "peer.h"
+
+namespace umq {
+
+class WorkQueue;
+
+using PWorkQueue = std::shared_ptr<WorkQueue>;
+
+///Push-pull work queue with competing consumers
+/**
+ * Producers push jobs to the queue. Consumers are peers, which offer a method
+ * processing the job. The queue calls the method on the consumer with the job as
+ * an argument. The response is the acknowledgment:
+ *
+ * - result - job is done, it is removed from the queue
+ * - exception or execute error - job failed, it is requeued at the end of the queue
+ *   (up to max_attempts), so a failing job doesn't block other jobs
+ * - disconnected - the consumer is removed, the job is requeued at the front
+ *
+ * Every consumer has prefetch limit - maximum count of jobs in flight. The job is
+ * dispatched to the consumer with the lowest count of jobs in flight.
+ */
+class WorkQueue: public std::enable_shared_from_this<WorkQueue> {
+public:
+
+    ///Default count of failed attempts before the job is finished with the failure
+    static constexpr unsigned int default_max_attempts = 5;
+
+    ///Create the queue
+    /**
+     * @param max_attempts maximum count of failed attempts to process the job. When
+     * limit is reached, the job is finished with the last failure. Set 0 for unlimited,
+     * but then a job which always fails is retried forever
+     */
+    static PWorkQueue make(unsigned int max_attempts = default_max_attempts);
+
+    ///Destroy the queue, pending jobs are finished as disconnected
+    ~WorkQueue();
+
+    WorkQueue(const WorkQueue &) = delete;
+    WorkQueue &operator=(const WorkQueue &) = delete;
+
+    ///Push job to the queue
+    /**
+     * @param job content of the job (attachments are supported)
+     * @param done optional callback called when job is done. It receives
+     * response of the consumer
+     * @return id of the job
+     */
+    std::size_t push(const Payload &job, ResponseCallback &&done = nullptr);
+
+    ///Register consumer
+    /**
+     * @param peer consumer's peer
+     * @param method method called on consumer's side
+     * @param prefetch maximum count of jobs in flight for this consumer
+     * @return id of consumer
+     *
+     * @note consumer is removed automatically when the peer is disconnected
+     */
+    std::size_t add_consumer(const PPeer &peer, const std::string_view &method, std::size_t prefetch = 1);
+
+    ///Unregister consumer
+    /**
+     * Jobs in flight are not interrupted. If they fail, they are
+     * dispatched to other consumers
+     *
+     * @param id id of consumer
+     */
+    void remove_consumer(std::size_t id);
+
+    ///Count of jobs waiting to dispatch
+    std::size_t get_pending() const;
+
+    ///Count of jobs in flight
+    std::size_t get_inflight() const;
+
+    ///Count of consumers
+    std::size_t get_consumers() const;
+
+protected:
+
+    explicit WorkQueue(unsigned int max_attempts);
+
+    struct Job {
+        std::size_t id;
+        PayloadStr data;
+        ResponseCallback done;
+        unsigned int attempts;
+    };
+
+    struct Consumer {
+        std::size_t id;
+        PWkPeer peer;
+        std::string method;
+        std::size_t prefetch;
+        std::size_t inflight;
+    };
+
+    struct InFlight {
+        Job job;
+        std::size_t consumer;
+    };
+
+    struct Dispatch {
+        PPeer peer;
+        std::string method;
+        PayloadStr data;
+        std::size_t job_id;
+        std::size_t consumer_id;
+    };
+
+    unsigned int _max_attempts;
+    mutable std::mutex _mx;
+    std::deque<Job> _pending;
+    std::map<std::size_t, InFlight> _inflight;
+    std::vector<Consumer> _consumers;
+    std::size_t _job_id = 0;
+    std::size_t _consumer_id = 0;
+
+    ///Dispatch pending jobs (must be called without lock)
+    void dispatch();
+    ///Find least loaded consumer which is able to accept a job (under lock)
+    Consumer *find_consumer();
+    void on_response(std::size_t job_id, std::size_t consumer_id, Response &&resp);
+    void remove_consumer_lk(std::size_t id);
+};
+
+}
+
+
+
+#endif /* LIB_UMQ_WORKQUEUE_H_oiwjd029jd023jd09jw */
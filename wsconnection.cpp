@@ -2,6 +2,7 @@
 
 #include <shared/trailer.h>
 #include "message.h"
+#include "tracing.h"
 namespace umq {
 
 WSConnection::WSConnection(userver::WSStream &&stream)
@@ -42,6 +43,9 @@ void WSConnection::flush() {
 }
 
 bool WSConnection::send_message(const umq::MsgFrame &msg) {
+    TraceScope _trc(TracePoint::conn_send,
+            msg.type == MsgFrameType::text && !msg.data.empty()?msg.data[0]:0,
+            std::string_view(), msg.data.size());
     switch(msg.type) {
         case MsgFrameType::text:
             return _s.send_text(msg.data);
@@ -19,6 +19,7 @@ public:
     virtual void start_listen(AbstractConnectionListener &listener) override;
     virtual void flush() override;
     virtual bool send_message(const MsgFrame &msg) override;
+    using AbstractConnection::send_message;
     virtual bool is_hwm(std::size_t v) override;
 
 protected: